@@ -26,6 +26,7 @@
 #include <assert.h>
 #include <math.h>
 #include "ast.h"
+#include "forest.h"
 
 #define EVAL_CHILD(i) ((n)->child[(i)]->type->eval((n)->child[(i)],env))
 
@@ -459,6 +460,89 @@ min_args:1,
 max_args:1,
 };
 
+// -------------------------- lookup ----------------------------------------
+
+/* lookup(x, keys, values) is values[i] for the key equal to x, and 0.0
+   if there isn't one. It replaces a one-hot encoding of x multiplied
+   with a weight vector, see node_fuse_one_hot(). */
+constant_t node_lookup_eval(node_t*n, environment_t* env)
+{
+    constant_t key = EVAL_CHILD(0);
+    constant_t keys = EVAL_CHILD(1);
+    constant_t values = EVAL_CHILD(2);
+    array_t*a = AS_ARRAY(keys);
+    int i;
+    for(i=0;i<a->size;i++) {
+        if(constant_equals(&key, &a->entries[i]))
+            return AS_ARRAY(values)->entries[i];
+    }
+    return float_constant(0.0);
+}
+nodetype_t node_lookup =
+{
+name:"lookup",
+flags:NODE_FLAG_HAS_CHILDREN,
+eval: node_lookup_eval,
+min_args:3,
+max_args:3,
+};
+
+// -------------------------- dot -------------------------------------------
+
+/* The products are summed up left to right, as a double, the same
+   way an add node (and the dot products Python, Ruby and Javascript
+   code is generated for) sums them up. The product of two floats is
+   exact in a double, so only the order of the additions matters. */
+float dot_product(const float*weights, const float*x, int size)
+{
+    double sum = 0.0;
+    int i;
+    for(i=0;i<size;i++) {
+        sum += (double)weights[i]*x[i];
+    }
+    return sum;
+}
+
+/* dot(weights, x0, x1, ...) is weights[0]*x0 + weights[1]*x1 + ...,
+   summed up by dot_product() */
+constant_t node_dot_eval(node_t*n, environment_t* env)
+{
+    array_t*a = AS_FLOAT_ARRAY(EVAL_CHILD(0));
+    int size = n->num_children - 1;
+    float weights[size];
+    float x[size];
+    int t;
+    for(t=0;t<size;t++) {
+        weights[t] = a->entries[t].f;
+        x[t] = AS_FLOAT(EVAL_CHILD(t+1));
+    }
+    return float_constant(dot_product(weights, x, size));
+}
+nodetype_t node_dot =
+{
+name:"dot",
+flags:NODE_FLAG_HAS_CHILDREN,
+eval: node_dot_eval,
+min_args:2,
+max_args:INT_MAX,
+};
+
+// -------------------------- forest ----------------------------------------
+
+constant_t node_forest_eval(node_t*n, environment_t* env)
+{
+    forest_t*f = AS_FOREST(n->value);
+    return f->classes->entries[forest_predict(f, env->row)];
+}
+nodetype_t node_forest =
+{
+name:"forest",
+flags:NODE_FLAG_HAS_VALUE,
+eval: node_forest_eval,
+min_args:0,
+max_args:0,
+};
+
 // -------------------------- string_array ------------------------------------
 
 constant_t node_string_array_eval(node_t*n, environment_t* env)
@@ -874,6 +958,9 @@ node_t* node_new_with_args(nodetype_t*t,...)
         case opcode_node_constant:
 	    n->value = va_arg(arglist,constant_t);
             break;
+        case opcode_node_forest:
+	    n->value = forest_constant(va_arg(arglist,forest_t*));
+            break;
         case opcode_node_setlocal:
         case opcode_node_getlocal:
         case opcode_node_inclocal:
@@ -971,6 +1058,26 @@ void node_destroy(node_t*n)
     free(n);
 }
 
+/* a deep copy, including arrays and forests */
+node_t* node_duplicate(node_t*n)
+{
+    node_t*c = node_new(n->type, 0);
+    if(n->type->flags&NODE_FLAG_HAS_VALUE) {
+        c->value = n->value;
+        if(c->value.type == CONSTANT_FOREST) {
+            c->value.forest = forest_clone(n->value.forest);
+        } else if(c->value.type >= CONSTANT_INT_ARRAY) {
+            c->value.a = array_new(n->value.a->size);
+            memcpy(c->value.a->entries, n->value.a->entries, sizeof(constant_t)*n->value.a->size);
+        }
+    }
+    int t;
+    for(t=0;t<n->num_children;t++) {
+        node_append_child(c, node_duplicate(n->child[t]));
+    }
+    return c;
+}
+
 void node_destroy_self(node_t*n)
 {
     int t;
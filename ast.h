@@ -102,6 +102,9 @@ struct _node {
     NODE(0x28, node_brackets) \
     NODE(0x29, node_array_at_pos_inc) \
     NODE(0x2a, node_array_arg_max_i) \
+    NODE(0x2b, node_forest) \
+    NODE(0x2c, node_lookup) \
+    NODE(0x2d, node_dot) \
 
 #define NODE(opcode, name) extern nodetype_t name;
 LIST_NODES
@@ -126,12 +129,15 @@ bool node_is_array(node_t*n);
 void node_append_child(node_t*n, node_t*child);
 void node_set_child(node_t*n, int num, node_t*child);
 bool node_sanitycheck(node_t*n);
+node_t* node_duplicate(node_t*n);
 void node_destroy(node_t*n);
 void node_destroy_self(node_t*n);
 constant_t node_eval(node_t*n,environment_t* e);
 void node_remove_child(node_t*n, int num);
 void node_print(node_t*n);
 
+float dot_product(const float*weights, const float*x, int size);
+
 #ifdef __cplusplus
 }
 #endif
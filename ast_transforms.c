@@ -24,6 +24,8 @@
 #include <math.h>
 #include <memory.h>
 #include "ast_transforms.h"
+#include "forest.h"
+#include "dict.h"
 
 bool node_has_consumer_parent(node_t*n)
 {
@@ -152,6 +154,8 @@ constant_type_t node_type(node_t*n, model_t*m)
             return CONSTANT_BOOL;
         case opcode_node_bool_to_float:
         case opcode_node_float:
+        case opcode_node_lookup:
+        case opcode_node_dot:
             return CONSTANT_FLOAT;
         case opcode_node_category:
             return CONSTANT_CATEGORY;
@@ -196,6 +200,10 @@ constant_type_t node_type(node_t*n, model_t*m)
             return node_array_element_type(n->child[0]);
         case opcode_node_param:
             return model_param_type(m, n->value.i);
+        case opcode_node_forest: {
+            array_t*classes = n->value.forest->classes;
+            return classes->size ? classes->entries[0].type : CONSTANT_MISSING;
+        }
         case opcode_node_getlocal:
             return local_type(node_find_root(n), n->value.i, m);
 	default:
@@ -347,6 +355,8 @@ int node_precedence(node_t*n)
 	case opcode_node_arg_max:
 	case opcode_node_array_at_pos:
 	case opcode_node_array_arg_max_i:
+	case opcode_node_lookup:
+	case opcode_node_dot:
             return 9;
 	case opcode_node_getlocal:
 	case opcode_node_param:
@@ -374,6 +384,51 @@ node_t* node_insert_brackets(node_t*n)
     }
     return n;
 }
+/* Replace forests by nested ifs, except for those keep (if set)
+   returns true for */
+node_t* node_expand_forests(node_t*n, bool (*keep)(struct _forest*f))
+{
+    if(n->type == &node_forest && !(keep && keep(n->value.forest))) {
+        node_t*code = forest_to_node(n->value.forest);
+        code->parent = n->parent;
+        node_destroy(n);
+        return code;
+    }
+    int t;
+    for(t=0;t<n->num_children;t++) {
+        node_t*c = n->child[t];
+        if(n->type == &node_block && c->type == &node_forest &&
+           !(keep && keep(c->value.forest))) {
+            /* splice the expanded statements into our own block, so
+               that the last of them is the one which returns */
+            node_t*code = node_expand_forests(c, keep);
+            node_t**children = (node_t**)n->child;
+            int num = n->num_children;
+            int add = code->num_children - 1;
+            /* node_append_child() grows arrays in powers of two */
+            int size = 1;
+            while(size < num+add)
+                size <<= 1;
+            node_t**new_children = malloc(sizeof(node_t*)*size);
+            memcpy(new_children, children, sizeof(node_t*)*t);
+            memcpy(new_children+t, code->child, sizeof(node_t*)*code->num_children);
+            memcpy(new_children+t+1+add, children+t+1, sizeof(node_t*)*(num-t-1));
+            free(children);
+            n->child = new_children;
+            n->num_children = num + add;
+            int i;
+            for(i=t;i<t+1+add;i++) {
+                new_children[i]->parent = n;
+            }
+            t += add;
+            free((void*)code->child);
+            node_destroy_self(code);
+        } else {
+            node_set_child(n, t, node_expand_forests(c, keep));
+        }
+    }
+    return n;
+}
 node_t* node_prepare_for_code_generation(node_t*n)
 {
     n = node_optimize(n);
@@ -556,8 +611,11 @@ node_t* node_optimize2(node_t*n, bool*again)
              */
             if(node_equals_node(n->child[1], n->child[2])) {
                 node_t*new_node = n->child[1];
+                node_destroy(n->child[0]);
+                node_destroy(n->child[2]);
+                free((void*)n->child);
                 node_destroy_self(n);
-                return n->child[1];
+                return new_node;
             }
             break;
 	case opcode_node_setlocal:
@@ -582,6 +640,515 @@ node_t* node_optimize2(node_t*n, bool*again)
     }
     return n;
 }
+static bool node_is_literal(node_t*n);
+
+/* nodes without side effects, which only depend on their children
+   (and, for param, on the row) */
+static bool node_is_pure(node_t*n)
+{
+    switch(node_get_opcode(n)) {
+	case opcode_node_add:
+	case opcode_node_sub:
+	case opcode_node_mul:
+	case opcode_node_div:
+	case opcode_node_lt:
+	case opcode_node_lte:
+	case opcode_node_gt:
+	case opcode_node_gte:
+	case opcode_node_in:
+	case opcode_node_not:
+	case opcode_node_neg:
+	case opcode_node_exp:
+	case opcode_node_sqr:
+	case opcode_node_abs:
+	case opcode_node_bool_to_float:
+	case opcode_node_equals:
+	case opcode_node_arg_max:
+	case opcode_node_arg_max_i:
+	case opcode_node_brackets:
+	case opcode_node_lookup:
+	case opcode_node_dot:
+	case opcode_node_param:
+            return true;
+        default:
+            return node_is_literal(n);
+    }
+}
+/* constants, other than zero_int_array (which programs modify) */
+static bool node_is_literal(node_t*n)
+{
+    switch(node_get_opcode(n)) {
+	case opcode_node_float:
+	case opcode_node_int:
+	case opcode_node_bool:
+	case opcode_node_category:
+	case opcode_node_string:
+	case opcode_node_constant:
+	case opcode_node_missing:
+	case opcode_node_float_array:
+	case opcode_node_int_array:
+	case opcode_node_category_array:
+	case opcode_node_string_array:
+	case opcode_node_mixed_array:
+            return true;
+        default:
+            return false;
+    }
+}
+static node_t* node_new_literal(constant_t c, node_t*parent)
+{
+    node_t*n;
+    switch(c.type) {
+        case CONSTANT_FLOAT:
+            n = node_new_with_args(&node_float, (double)c.f);
+        break;
+        case CONSTANT_INT:
+            n = node_new_with_args(&node_int, c.i);
+        break;
+        case CONSTANT_BOOL:
+            n = node_new_with_args(&node_bool, (int)c.b);
+        break;
+        case CONSTANT_CATEGORY:
+            n = node_new_with_args(&node_category, c.c);
+        break;
+        case CONSTANT_STRING:
+            n = node_new_with_args(&node_string, c.s);
+        break;
+        default:
+            return 0;
+    }
+    n->parent = parent;
+    return n;
+}
+
+/* Replace operations on constants by their result. The result is
+   computed by the node itself, so it's exactly what evaluating the
+   program would have produced.
+   We don't fold just some of the children of an add, since the sum
+   is built up as a double, and a float constant in the middle of it
+   would round differently. */
+static node_t* node_fold_constants(node_t*n, bool*again)
+{
+    int t;
+    for(t=0;t<n->num_children;t++) {
+        node_set_child(n, t, node_fold_constants(n->child[t], again));
+    }
+    if(n->type == &node_if && n->child[0]->type == &node_bool) {
+        int branch = n->child[0]->value.b ? 1 : 2;
+        node_t*new_node = n->child[branch];
+        new_node->parent = n->parent;
+        node_destroy(n->child[0]);
+        node_destroy(n->child[3-branch]);
+        free((void*)n->child);
+        node_destroy_self(n);
+        *again = true;
+        return new_node;
+    }
+    if(!n->num_children || n->type == &node_brackets || !node_is_pure(n))
+        return n;
+    for(t=0;t<n->num_children;t++) {
+        if(!node_is_literal(n->child[t]))
+            return n;
+    }
+    node_t*new_node = node_new_literal(node_eval(n, 0), n->parent);
+    if(!new_node)
+        return n;
+    node_destroy(n);
+    *again = true;
+    return new_node;
+}
+
+/* If n is one element of a one-hot encoding, i.e.
+        bool_to_float(x == key) * weight
+   for a param x, return x, and store key and weight. */
+static node_t* node_one_hot_param(node_t*n, constant_t**key, float*weight)
+{
+    *weight = 1.0;
+    if(n->type == &node_mul) {
+        if(n->child[1]->type == &node_float) {
+            *weight = n->child[1]->value.f;
+            n = n->child[0];
+        } else if(n->child[0]->type == &node_float) {
+            *weight = n->child[0]->value.f;
+            n = n->child[1];
+        } else {
+            return NULL;
+        }
+    }
+    if(n->type != &node_bool_to_float || n->child[0]->type != &node_equals)
+        return NULL;
+    node_t*x = n->child[0]->child[0];
+    node_t*c = n->child[0]->child[1];
+    if(x->type != &node_param) {
+        node_t*tmp = x;x = c;c = tmp;
+    }
+    if(x->type != &node_param)
+        return NULL;
+    if(c->type != &node_constant && c->type != &node_category &&
+       c->type != &node_string && c->type != &node_int)
+        return NULL;
+    if(c->value.type != CONSTANT_CATEGORY && c->value.type != CONSTANT_STRING &&
+       c->value.type != CONSTANT_INT)
+        return NULL;
+    *key = &c->value;
+    return x;
+}
+
+/* Replace runs of one-hot terms of the same input in a sum, e.g.
+        bool_to_float(x == "a") * 0.5 + bool_to_float(x == "b") * 0.7
+   by a single
+        lookup(x, ["a", "b"], [0.5, 0.7])
+   At most one of the terms isn't zero, so the sum stays exactly the
+   same. */
+static node_t* node_fuse_one_hot(node_t*n, bool*again)
+{
+    int t;
+    for(t=0;t<n->num_children;t++) {
+        node_set_child(n, t, node_fuse_one_hot(n->child[t], again));
+    }
+    if(n->type != &node_add)
+        return n;
+
+    int num = 0;
+    t = 0;
+    while(t < n->num_children) {
+        constant_t*key;
+        float weight;
+        node_t*param = node_one_hot_param(n->child[t], &key, &weight);
+        if(!param) {
+            node_set_child(n, num++, n->child[t++]);
+            continue;
+        }
+        int input = param->value.i;
+
+        /* the keys have to be distinct, otherwise more than one term
+           could be non-zero */
+        dict_t*seen = dict_new(&constant_hash_type);
+        int end = t;
+        while(end < n->num_children) {
+            param = node_one_hot_param(n->child[end], &key, &weight);
+            if(!param || param->value.i != input || dict_contains(seen, key))
+                break;
+            dict_put(seen, key, 0);
+            end++;
+        }
+        dict_destroy(seen);
+        if(end - t < 2) {
+            node_set_child(n, num++, n->child[t++]);
+            continue;
+        }
+
+        array_t*keys = array_new(end - t);
+        array_t*values = array_new(end - t);
+        int i;
+        for(i=t;i<end;i++) {
+            node_one_hot_param(n->child[i], &key, &weight);
+            keys->entries[i-t] = *key;
+            values->entries[i-t] = float_constant(weight);
+            node_destroy(n->child[i]);
+        }
+        node_t*lookup = node_new(&node_lookup, n);
+        node_append_child(lookup, node_new_with_args(&node_param, input));
+        node_append_child(lookup, node_new_array(keys));
+        node_append_child(lookup, node_new_array(values));
+        node_set_child(n, num++, lookup);
+        t = end;
+        *again = true;
+    }
+    n->num_children = num;
+    return n;
+}
+
+/* For lookups on small non-negative categories, return the values as
+   one array indexed by category (and 0.0 for unknown categories), so
+   that the lookup needs no compares at all. */
+array_t* node_lookup_table(node_t*n)
+{
+    array_t*keys = n->child[1]->value.a;
+    array_t*values = n->child[2]->value.a;
+    int max = -1;
+    int t;
+    for(t=0;t<keys->size;t++) {
+        if(keys->entries[t].type != CONSTANT_CATEGORY || keys->entries[t].c < 0)
+            return NULL;
+        if(keys->entries[t].c > max)
+            max = keys->entries[t].c;
+    }
+    if(max >= keys->size*2 + 16)
+        return NULL;
+    array_t*table = array_new(max + 1);
+    array_fill(table, float_constant(0.0));
+    /* like node_lookup_eval(), the first matching key wins */
+    for(t=keys->size-1;t>=0;t--) {
+        table->entries[keys->entries[t].c] = values->entries[t];
+    }
+    return table;
+}
+
+typedef struct _expression {
+    node_t*node;
+    unsigned int hash;
+    int count;
+    int local;
+} expression_t;
+
+static bool expression_equals(const void*o1, const void*o2)
+{
+    const expression_t*e1 = (const expression_t*)o1;
+    const expression_t*e2 = (const expression_t*)o2;
+    return e1->hash == e2->hash && node_equals_node(e1->node, e2->node);
+}
+static unsigned int expression_hash(const void*o)
+{
+    return ((const expression_t*)o)->hash;
+}
+static type_t expression_type = {
+    equals: expression_equals,
+    hash: expression_hash,
+    dup: ptr_dup,
+    free: ptr_free,
+};
+
+/* only expressions computing a float are worth keeping in a local
+   (the others are either cheap, or used as conditions) */
+static bool expression_is_float(node_t*n)
+{
+    switch(node_get_opcode(n)) {
+	case opcode_node_add:
+	case opcode_node_sub:
+	case opcode_node_mul:
+	case opcode_node_div:
+	case opcode_node_neg:
+	case opcode_node_exp:
+	case opcode_node_sqr:
+	case opcode_node_abs:
+	case opcode_node_bool_to_float:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static unsigned int node_value_hash(node_t*n)
+{
+    constant_t*c = &n->value;
+    switch(c->type) {
+        case CONSTANT_FLOAT:
+        case CONSTANT_INT:
+        case CONSTANT_CATEGORY:
+            return crc32_add_bytes(c->type, &c->i, sizeof(c->i));
+        case CONSTANT_BOOL:
+            return crc32_add_bytes(c->type, &c->b, sizeof(c->b));
+        case CONSTANT_STRING:
+            return crc32_add_string(c->type, c->s);
+        default:
+            return c->type;
+    }
+}
+
+/* Count the pure expressions which are always evaluated (i.e., aren't
+   inside the branch of an if). occurrences maps every counted node to
+   its expression. Returns whether n is pure. */
+static bool count_expressions(node_t*n, dict_t*expressions, dict_t*occurrences, unsigned int*hash)
+{
+    bool pure = node_is_pure(n);
+    uint8_t opcode = node_get_opcode(n);
+    unsigned int h = crc32_add_bytes(0, &opcode, 1);
+    if(n->type->flags&NODE_FLAG_HAS_VALUE) {
+        h = h*31 + node_value_hash(n);
+    }
+    int t;
+    for(t=0;t<n->num_children;t++) {
+        unsigned int child_hash = 0;
+        if(n->type == &node_if && t > 0) {
+            /* conditionally evaluated */
+            pure = false;
+            continue;
+        }
+        pure &= count_expressions(n->child[t], expressions, occurrences, &child_hash);
+        h = h*31 + child_hash;
+    }
+    *hash = h;
+    if(pure && expression_is_float(n)) {
+        expression_t key = {node: n, hash: h};
+        expression_t*e = (expression_t*)dict_lookup(expressions, &key);
+        if(!e) {
+            e = (expression_t*)calloc(1, sizeof(expression_t));
+            e->node = n;
+            e->hash = h;
+            e->local = -1;
+            dict_put(expressions, e, e);
+        }
+        e->count++;
+        dict_put(occurrences, n, e);
+    }
+    return pure;
+}
+static node_t* hoist_expressions(node_t*n, dict_t*occurrences, node_t*block, int*num_locals, bool*again)
+{
+    expression_t*e = (expression_t*)dict_lookup(occurrences, n);
+    if(e && e->count > 1) {
+        if(e->local < 0) {
+            e->local = (*num_locals)++;
+            node_t*setlocal = node_new_with_args(&node_setlocal, e->local);
+            node_t*parent = n->parent;
+            node_append_child(setlocal, n);
+            node_append_child(block, setlocal);
+            n = node_new_with_args(&node_getlocal, e->local);
+            n->parent = parent;
+        } else {
+            node_t*getlocal = node_new_with_args(&node_getlocal, e->local);
+            getlocal->parent = n->parent;
+            node_destroy(n);
+            n = getlocal;
+        }
+        *again = true;
+        return n;
+    }
+    int t;
+    for(t=0;t<n->num_children;t++) {
+        if(n->type == &node_if && t > 0)
+            continue;
+        node_set_child(n, t, hoist_expressions(n->child[t], occurrences, block, num_locals, again));
+    }
+    return n;
+}
+
+/* Compute expressions which occur more than once (e.g. the input
+   scaling code SVMs and neural networks repeat for every support
+   vector resp. neuron) only once, at the start of the program, and
+   store them in locals. Only done for programs which are blocks. */
+static void node_eliminate_common_subexpressions(node_t*n, bool*again)
+{
+    if(n->type != &node_block)
+        return;
+    int num_locals = node_highest_local(n);
+    while(1) {
+        dict_t*expressions = dict_new(&expression_type);
+        dict_t*occurrences = dict_new(&ptr_type);
+        unsigned int hash;
+        count_expressions(n, expressions, occurrences, &hash);
+
+        bool hoisted = false;
+        node_t*block = node_new(&node_block, 0);
+        int t;
+        for(t=0;t<n->num_children;t++) {
+            node_set_child(n, t, hoist_expressions(n->child[t], occurrences, block, &num_locals, &hoisted));
+        }
+        DICT_ITERATE_DATA(expressions, expression_t*, e) {
+            free(e);
+        }
+        dict_destroy(expressions);
+        dict_destroy(occurrences);
+
+        if(!hoisted) {
+            node_destroy(block);
+            break;
+        }
+        /* prepend the new setlocals. node_append_child() grows arrays
+           in powers of two */
+        int num = block->num_children + n->num_children;
+        int size = 1;
+        while(size < num)
+            size <<= 1;
+        node_t**children = malloc(sizeof(node_t*)*size);
+        memcpy(children, block->child, sizeof(node_t*)*block->num_children);
+        memcpy(children+block->num_children, n->child, sizeof(node_t*)*n->num_children);
+        for(t=0;t<block->num_children;t++) {
+            children[t]->parent = n;
+        }
+        free((void*)n->child);
+        n->child = children;
+        n->num_children = num;
+        free((void*)block->child);
+        node_destroy_self(block);
+        *again = true;
+    }
+}
+
+static bool node_is_pure_tree(node_t*n)
+{
+    if(!node_is_pure(n))
+        return false;
+    int t;
+    for(t=0;t<n->num_children;t++) {
+        if(!node_is_pure_tree(n->child[t]))
+            return false;
+    }
+    return true;
+}
+static void mark_used_locals(node_t*n, bool*used, bool include_stores)
+{
+    if(n->type == &node_getlocal || n->type == &node_inclocal ||
+       (include_stores && n->type == &node_setlocal)) {
+        used[n->value.i] = true;
+    }
+    int t;
+    for(t=0;t<n->num_children;t++) {
+        mark_used_locals(n->child[t], used, include_stores);
+    }
+}
+static void renumber_locals(node_t*n, int*map)
+{
+    if(n->type == &node_getlocal || n->type == &node_inclocal || n->type == &node_setlocal) {
+        n->value.i = map[n->value.i];
+    }
+    int t;
+    for(t=0;t<n->num_children;t++) {
+        renumber_locals(n->child[t], map);
+    }
+}
+static bool remove_dead_stores(node_t*n, bool*used)
+{
+    bool removed = false;
+    int t;
+    if(n->type == &node_block) {
+        for(t=0;t<n->num_children-1;t++) {
+            node_t*c = n->child[t];
+            if(c->type == &node_setlocal && !used[c->value.i] && node_is_pure_tree(c->child[0])) {
+                node_remove_child(n, t--);
+                node_destroy(c);
+                removed = true;
+            }
+        }
+    }
+    for(t=0;t<n->num_children;t++) {
+        removed |= remove_dead_stores(n->child[t], used);
+    }
+    return removed;
+}
+
+/* Remove assignments to locals which are never read, and renumber the
+   remaining locals so that they're contiguous again */
+static void node_eliminate_dead_locals(node_t*n, bool*again)
+{
+    int num_locals = node_highest_local(n);
+    if(!num_locals)
+        return;
+    bool*used = calloc(num_locals, sizeof(bool));
+    while(1) {
+        memset(used, 0, num_locals*sizeof(bool));
+        mark_used_locals(n, used, false);
+        if(!remove_dead_stores(n, used))
+            break;
+        *again = true;
+    }
+    /* stores with side effects stay, and still need their own local */
+    memset(used, 0, num_locals*sizeof(bool));
+    mark_used_locals(n, used, true);
+    int*map = malloc(sizeof(int)*num_locals);
+    int t, pos = 0;
+    for(t=0;t<num_locals;t++) {
+        map[t] = pos;
+        if(used[t])
+            pos++;
+    }
+    if(pos < num_locals) {
+        renumber_locals(n, map);
+    }
+    free(map);
+    free(used);
+}
 node_t* node_optimize(node_t*n)
 {
     bool again;
@@ -589,6 +1156,10 @@ node_t* node_optimize(node_t*n)
     do {
 	again = 0;
 	n = node_optimize2(n, &again);
+	n = node_fold_constants(n, &again);
+	n = node_fuse_one_hot(n, &again);
+	node_eliminate_common_subexpressions(n, &again);
+	node_eliminate_dead_locals(n, &again);
     } while(again);
     return n;
 }
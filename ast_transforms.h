@@ -25,6 +25,7 @@
 #include "ast.h"
 
 node_t* node_prepare_for_code_generation(node_t*n);
+node_t* node_expand_forests(node_t*n, bool (*keep)(struct _forest*f));
 node_t* node_insert_brackets(node_t*n) ;
 node_t* node_do_cascade_returns(node_t*n) ;
 bool node_has_consumer_parent(node_t*n);
@@ -42,6 +43,7 @@ constant_type_t*node_local_types(node_t*node, model_t*m, int* num_locals);
 constant_type_t model_param_type(model_t*m, int var);
 bool node_has_child(node_t*n, nodetype_t*type);
 node_t* node_optimize(node_t*n);
+array_t* node_lookup_table(node_t*n);
 
 
 #endif
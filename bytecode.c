@@ -0,0 +1,789 @@
+/* bytecode.c
+   Flat bytecode for fast AST evaluation.
+
+   Part of the data prediction package.
+
+   Copyright (c) 2011 Matthias Kramm <kramm@quiss.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include "bytecode.h"
+#include "ast_transforms.h"
+
+/* The bytecode is a stack machine. Every compiled node pushes exactly
+   one value, just like every node_eval() returns exactly one value.
+   Types are checked by the AST (see node_sanitycheck), so the
+   interpreter loop doesn't check them again. */
+
+#define LIST_OPS \
+    OP(end) \
+    OP(push) \
+    OP(pop) \
+    OP(param) \
+    OP(jump) \
+    OP(jump_if_false) \
+    OP(add) \
+    OP(sub) \
+    OP(mul) \
+    OP(div) \
+    OP(lt) \
+    OP(lte) \
+    OP(gt) \
+    OP(gte) \
+    OP(lt_const) \
+    OP(lte_const) \
+    OP(gt_const) \
+    OP(gte_const) \
+    OP(equals) \
+    OP(in) \
+    OP(in_const) \
+    OP(not) \
+    OP(neg) \
+    OP(exp) \
+    OP(sqr) \
+    OP(abs) \
+    OP(bool_to_float) \
+    OP(getlocal) \
+    OP(setlocal) \
+    OP(inclocal) \
+    OP(arg_max) \
+    OP(arg_max_i) \
+    OP(array_at_pos) \
+    OP(array_at_pos_inc) \
+    OP(array_arg_max_i) \
+    OP(zero_int_array) \
+    OP(forest) \
+    OP(lookup) \
+    OP(lookup_table) \
+    OP(dot) \
+
+enum {
+#define OP(name) op_##name,
+LIST_OPS
+#undef OP
+};
+
+static const char*op_names[] = {
+#define OP(name) #name,
+LIST_OPS
+#undef OP
+};
+
+// ------------------------------ compiler --------------------------------
+
+typedef struct _compiler {
+    program_t*p;
+    int code_size;
+    int constants_size;
+    int scratch_arrays_size;
+    int dots_size;
+    int weights_size;
+    int stack;
+} compiler_t;
+
+static int emit(compiler_t*c, uint8_t op, int32_t arg, int stack_effect)
+{
+    program_t*p = c->p;
+    if(p->num_instructions == c->code_size) {
+        c->code_size = c->code_size ? c->code_size*2 : 64;
+        p->code = realloc(p->code, sizeof(instruction_t)*c->code_size);
+    }
+    instruction_t*i = &p->code[p->num_instructions];
+    i->op = op;
+    i->arg = arg;
+    c->stack += stack_effect;
+    if(c->stack > p->max_stack)
+        p->max_stack = c->stack;
+    return p->num_instructions++;
+}
+
+static int add_constant(compiler_t*c, constant_t v)
+{
+    program_t*p = c->p;
+    if(p->num_constants == c->constants_size) {
+        c->constants_size = c->constants_size ? c->constants_size*2 : 16;
+        p->constants = realloc(p->constants, sizeof(constant_t)*c->constants_size);
+    }
+    /* arrays and forests belong to the AST, which might be transformed
+       (or destroyed) independently of us */
+    if(v.type == CONSTANT_FOREST) {
+        v.forest = forest_clone(v.forest);
+        /* our copy is immutable, so it can carry lookup tables */
+        forest_build_quickscorer(v.forest);
+    } else if(v.type >= CONSTANT_INT_ARRAY) {
+        array_t*a = array_new(v.a->size);
+        memcpy(a->entries, v.a->entries, sizeof(constant_t)*v.a->size);
+        v.a = a;
+    }
+    p->constants[p->num_constants] = v;
+    return p->num_constants++;
+}
+
+static int add_scratch_array(compiler_t*c, int size)
+{
+    program_t*p = c->p;
+    if(p->num_scratch_arrays == c->scratch_arrays_size) {
+        c->scratch_arrays_size = c->scratch_arrays_size ? c->scratch_arrays_size*2 : 4;
+        p->scratch_arrays = realloc(p->scratch_arrays, sizeof(scratch_array_t)*c->scratch_arrays_size);
+    }
+    scratch_array_t*s = &p->scratch_arrays[p->num_scratch_arrays];
+    s->offset = p->scratch_size;
+    s->size = size;
+    /* one constant_t worth of space for the array header */
+    assert(sizeof(array_t) <= sizeof(constant_t));
+    p->scratch_size += 1 + size;
+    return p->num_scratch_arrays++;
+}
+
+static int add_dot_weights(compiler_t*c, array_t*a)
+{
+    program_t*p = c->p;
+    if(p->num_dots == c->dots_size) {
+        c->dots_size = c->dots_size ? c->dots_size*2 : 4;
+        p->dots = realloc(p->dots, sizeof(dot_weights_t)*c->dots_size);
+    }
+    if(p->num_weights + a->size > c->weights_size) {
+        while(p->num_weights + a->size > c->weights_size)
+            c->weights_size = c->weights_size ? c->weights_size*2 : 64;
+        p->weights = realloc(p->weights, sizeof(float)*c->weights_size);
+    }
+    dot_weights_t*d = &p->dots[p->num_dots];
+    d->offset = p->num_weights;
+    d->size = a->size;
+    int t;
+    for(t=0;t<a->size;t++) {
+        p->weights[p->num_weights++] = a->entries[t].f;
+    }
+    return p->num_dots++;
+}
+
+static void compile_node(compiler_t*c, node_t*n);
+
+static void compile_children(compiler_t*c, node_t*n)
+{
+    int t;
+    for(t=0;t<n->num_children;t++) {
+        compile_node(c, n->child[t]);
+    }
+}
+
+static void compile_compare(compiler_t*c, node_t*n, uint8_t op, uint8_t op_const)
+{
+    compile_node(c, n->child[0]);
+    if(n->child[1]->type == &node_float) {
+        emit(c, op_const, add_constant(c, n->child[1]->value), 0);
+    } else {
+        compile_node(c, n->child[1]);
+        emit(c, op, 0, -1);
+    }
+}
+
+static void compile_node(compiler_t*c, node_t*n)
+{
+    nodetype_t*type = n->type;
+    if(type == &node_block) {
+        int t;
+        for(t=0;t<n->num_children;t++) {
+            compile_node(c, n->child[t]);
+            if(t < n->num_children-1) {
+                emit(c, op_pop, 0, -1);
+            }
+        }
+    } else if(type == &node_if) {
+        compile_node(c, n->child[0]);
+        int jump_to_else = emit(c, op_jump_if_false, 0, -1);
+        compile_node(c, n->child[1]);
+        int jump_to_end = emit(c, op_jump, 0, -1);
+        c->p->code[jump_to_else].arg = c->p->num_instructions;
+        compile_node(c, n->child[2]);
+        c->p->code[jump_to_end].arg = c->p->num_instructions;
+    } else if(type == &node_add) {
+        compile_children(c, n);
+        emit(c, op_add, n->num_children, 1 - n->num_children);
+    } else if(type == &node_sub) {
+        compile_children(c, n);
+        emit(c, op_sub, 0, -1);
+    } else if(type == &node_mul) {
+        compile_children(c, n);
+        emit(c, op_mul, 0, -1);
+    } else if(type == &node_div) {
+        compile_children(c, n);
+        emit(c, op_div, 0, -1);
+    } else if(type == &node_lt) {
+        compile_compare(c, n, op_lt, op_lt_const);
+    } else if(type == &node_lte) {
+        compile_compare(c, n, op_lte, op_lte_const);
+    } else if(type == &node_gt) {
+        compile_compare(c, n, op_gt, op_gt_const);
+    } else if(type == &node_gte) {
+        compile_compare(c, n, op_gte, op_gte_const);
+    } else if(type == &node_equals) {
+        compile_children(c, n);
+        emit(c, op_equals, 0, -1);
+    } else if(type == &node_in) {
+        compile_node(c, n->child[0]);
+        node_t*array = n->child[1];
+        if(array->type != &node_zero_int_array && (array->type->flags & NODE_FLAG_ARRAY)) {
+            emit(c, op_in_const, add_constant(c, array->value), 0);
+        } else {
+            compile_node(c, array);
+            emit(c, op_in, 0, -1);
+        }
+    } else if(type == &node_not) {
+        compile_children(c, n);
+        emit(c, op_not, 0, 0);
+    } else if(type == &node_neg) {
+        compile_children(c, n);
+        emit(c, op_neg, 0, 0);
+    } else if(type == &node_exp) {
+        compile_children(c, n);
+        emit(c, op_exp, 0, 0);
+    } else if(type == &node_sqr) {
+        compile_children(c, n);
+        emit(c, op_sqr, 0, 0);
+    } else if(type == &node_abs) {
+        compile_children(c, n);
+        emit(c, op_abs, 0, 0);
+    } else if(type == &node_bool_to_float) {
+        compile_children(c, n);
+        emit(c, op_bool_to_float, 0, 0);
+    } else if(type == &node_param) {
+        emit(c, op_param, n->value.i, 1);
+    } else if(type == &node_nop) {
+        emit(c, op_push, add_constant(c, missing_constant()), 1);
+    } else if(type == &node_category) {
+        emit(c, op_push, add_constant(c, category_constant(n->value.c)), 1);
+    } else if(type == &node_zero_int_array) {
+        emit(c, op_zero_int_array, add_scratch_array(c, n->value.a->size), 1);
+    } else if(type->flags & NODE_FLAG_ARRAY) {
+        emit(c, op_push, add_constant(c, n->value), 1);
+    } else if(type == &node_float || type == &node_int || type == &node_string ||
+              type == &node_bool || type == &node_missing || type == &node_constant) {
+        emit(c, op_push, add_constant(c, n->value), 1);
+    } else if(type == &node_getlocal) {
+        emit(c, op_getlocal, n->value.i, 1);
+    } else if(type == &node_setlocal) {
+        compile_children(c, n);
+        emit(c, op_setlocal, n->value.i, 0);
+    } else if(type == &node_inclocal) {
+        emit(c, op_inclocal, n->value.i, 1);
+    } else if(type == &node_arg_max) {
+        compile_children(c, n);
+        emit(c, op_arg_max, n->num_children, 1 - n->num_children);
+    } else if(type == &node_arg_max_i) {
+        compile_children(c, n);
+        emit(c, op_arg_max_i, n->num_children, 1 - n->num_children);
+    } else if(type == &node_array_at_pos) {
+        compile_children(c, n);
+        emit(c, op_array_at_pos, 0, -1);
+    } else if(type == &node_array_at_pos_inc) {
+        compile_children(c, n);
+        emit(c, op_array_at_pos_inc, 0, -1);
+    } else if(type == &node_array_arg_max_i) {
+        compile_children(c, n);
+        emit(c, op_array_arg_max_i, 0, 0);
+    } else if(type == &node_forest) {
+        emit(c, op_forest, add_constant(c, n->value), 1);
+    } else if(type == &node_lookup) {
+        /* keys and values are always literal arrays, see node_read() */
+        compile_node(c, n->child[0]);
+        array_t*table = node_lookup_table(n);
+        if(table) {
+            emit(c, op_lookup_table, add_constant(c, float_array_constant(table)), 0);
+            array_destroy(table);
+        } else {
+            int keys = add_constant(c, n->child[1]->value);
+            add_constant(c, n->child[2]->value);
+            emit(c, op_lookup, keys, 0);
+        }
+    } else if(type == &node_dot) {
+        /* the weights are always a literal array, see node_read() */
+        int t;
+        for(t=1;t<n->num_children;t++) {
+            compile_node(c, n->child[t]);
+        }
+        emit(c, op_dot, add_dot_weights(c, n->child[0]->value.a), 2 - n->num_children);
+    } else if(type == &node_return || type == &node_brackets) {
+        /* like in node_eval(), these only pass through their child's value */
+        compile_children(c, n);
+    } else {
+        fprintf(stderr, "Can't compile node type %s\n", type->name);
+        exit(1);
+    }
+}
+
+program_t* program_compile(node_t*node)
+{
+    compiler_t c;
+    memset(&c, 0, sizeof(c));
+    c.p = (program_t*)calloc(1, sizeof(program_t));
+    compile_node(&c, node);
+    emit(&c, op_end, 0, 0);
+    assert(c.stack == 1);
+    c.p->num_locals = node_highest_local(node);
+
+    /* a program that does nothing but evaluate a forest can run
+       many rows at once, see program_run_batch() */
+    if(c.p->num_instructions == 2 && c.p->code[0].op == op_forest) {
+        c.p->forest = c.p->constants[c.p->code[0].arg].forest;
+    }
+    return c.p;
+}
+
+void program_destroy(program_t*p)
+{
+    int t;
+    for(t=0;t<p->num_constants;t++) {
+        if(p->constants[t].type == CONSTANT_FOREST) {
+            forest_destroy(p->constants[t].forest);
+        } else if(p->constants[t].type >= CONSTANT_INT_ARRAY) {
+            array_destroy(p->constants[t].a);
+        }
+    }
+    free(p->constants);
+    free(p->scratch_arrays);
+    free(p->dots);
+    free(p->weights);
+    free(p->code);
+    free(p);
+}
+
+void program_print(program_t*p)
+{
+    int t;
+    for(t=0;t<p->num_instructions;t++) {
+        instruction_t*i = &p->code[t];
+        printf("%4d %-16s %d", t, op_names[i->op], i->arg);
+        if(i->op == op_push || i->op == op_in_const || i->op == op_forest ||
+           i->op == op_lookup || i->op == op_lookup_table ||
+           (i->op >= op_lt_const && i->op <= op_gte_const)) {
+            printf("\t");
+            constant_print(&p->constants[i->arg]);
+        }
+        if(i->op == op_dot) {
+            printf("\t(%d weights)", p->dots[i->arg].size);
+        }
+        printf("\n");
+    }
+}
+
+// ---------------------------- interpreter -------------------------------
+
+/* inlined versions of float_constant() etc. */
+static inline void set_float(constant_t*c, float f)
+{
+    c->type = CONSTANT_FLOAT;
+    c->f = f;
+}
+static inline void set_bool(constant_t*c, bool b)
+{
+    c->type = CONSTANT_BOOL;
+    c->b = b;
+}
+static inline void set_int(constant_t*c, int i)
+{
+    c->type = CONSTANT_INT;
+    c->i = i;
+}
+
+static inline void set_param(constant_t*c, row_t*row, int i)
+{
+    assert(i >= 0 && i < row->num_inputs);
+    variable_t*v = &row->inputs[i];
+    switch(v->type) {
+        case CATEGORICAL:
+            c->type = CONSTANT_CATEGORY;
+            c->c = v->category;
+        break;
+        case CONTINUOUS:
+            set_float(c, v->value);
+        break;
+        case TEXT:
+            /* row strings are already registered, see variable_new_text() */
+            c->type = CONSTANT_STRING;
+            c->s = v->text;
+        break;
+        default:
+            c->type = CONSTANT_MISSING;
+        break;
+    }
+}
+
+static inline int arg_max_f(constant_t*values, int num)
+{
+    float max = values[0].f;
+    int index = 0;
+    int t;
+    for(t=1;t<num;t++) {
+        if(values[t].f > max) {
+            max = values[t].f;
+            index = t;
+        }
+    }
+    return index;
+}
+
+static inline int arg_max_i(constant_t*values, int num)
+{
+    int max = values[0].i;
+    int index = 0;
+    int t;
+    for(t=1;t<num;t++) {
+        if(values[t].i > max) {
+            max = values[t].i;
+            index = t;
+        }
+    }
+    return index;
+}
+
+static inline bool array_contains(array_t*a, constant_t*c)
+{
+    int t;
+    for(t=0;t<a->size;t++) {
+        if(constant_equals(c, &a->entries[t]))
+            return true;
+    }
+    return false;
+}
+
+static constant_t program_execute(program_t*p, row_t*row, constant_t*stack, constant_t*locals, constant_t*scratch)
+{
+    memset(locals, 0, sizeof(constant_t)*p->num_locals);
+
+    constant_t*sp = stack - 1;
+    constant_t*constants = p->constants;
+    instruction_t*code = p->code;
+    instruction_t*i = code;
+
+    while(1) {
+        switch(i->op) {
+            case op_end:
+                return *sp;
+            case op_push:
+                *++sp = constants[i->arg];
+            break;
+            case op_pop:
+                sp--;
+            break;
+            case op_param:
+                set_param(++sp, row, i->arg);
+            break;
+            case op_jump:
+                i = &code[i->arg];
+            continue;
+            case op_jump_if_false:
+                if(!(sp--)->b) {
+                    i = &code[i->arg];
+                    continue;
+                }
+            break;
+            case op_add: {
+                sp -= i->arg - 1;
+                double sum = 0;
+                int t;
+                for(t=0;t<i->arg;t++) {
+                    sum += sp[t].f;
+                }
+                set_float(sp, sum);
+            }
+            break;
+            case op_sub:
+                sp--;
+                set_float(sp, sp[0].f - sp[1].f);
+            break;
+            case op_mul:
+                sp--;
+                set_float(sp, sp[0].f * sp[1].f);
+            break;
+            case op_div:
+                sp--;
+                set_float(sp, sp[0].f / sp[1].f);
+            break;
+            case op_lt:
+                sp--;
+                set_bool(sp, sp[0].f < sp[1].f);
+            break;
+            case op_lte:
+                sp--;
+                set_bool(sp, sp[0].f <= sp[1].f);
+            break;
+            case op_gt:
+                sp--;
+                set_bool(sp, sp[0].f > sp[1].f);
+            break;
+            case op_gte:
+                sp--;
+                set_bool(sp, sp[0].f >= sp[1].f);
+            break;
+            case op_lt_const:
+                set_bool(sp, sp->f < constants[i->arg].f);
+            break;
+            case op_lte_const:
+                set_bool(sp, sp->f <= constants[i->arg].f);
+            break;
+            case op_gt_const:
+                set_bool(sp, sp->f > constants[i->arg].f);
+            break;
+            case op_gte_const:
+                set_bool(sp, sp->f >= constants[i->arg].f);
+            break;
+            case op_equals:
+                sp--;
+                set_bool(sp, constant_equals(&sp[0], &sp[1]));
+            break;
+            case op_in:
+                sp--;
+                set_bool(sp, array_contains(sp[1].a, &sp[0]));
+            break;
+            case op_in_const:
+                set_bool(sp, array_contains(constants[i->arg].a, sp));
+            break;
+            case op_not:
+                set_bool(sp, !sp->b);
+            break;
+            case op_neg:
+                set_float(sp, -sp->f);
+            break;
+            case op_exp:
+                set_float(sp, exp(sp->f));
+            break;
+            case op_sqr: {
+                double v = sp->f;
+                set_float(sp, v*v);
+            }
+            break;
+            case op_abs:
+                set_float(sp, fabs(sp->f));
+            break;
+            case op_bool_to_float:
+                set_float(sp, sp->b);
+            break;
+            case op_getlocal:
+                assert(locals[i->arg].type);
+                *++sp = locals[i->arg];
+            break;
+            case op_setlocal:
+                locals[i->arg] = *sp;
+            break;
+            case op_inclocal:
+                assert(locals[i->arg].type == CONSTANT_INT);
+                locals[i->arg].i++;
+                *++sp = locals[i->arg];
+            break;
+            case op_arg_max:
+                sp -= i->arg - 1;
+                set_int(sp, arg_max_f(sp, i->arg));
+            break;
+            case op_arg_max_i:
+                sp -= i->arg - 1;
+                set_int(sp, arg_max_i(sp, i->arg));
+            break;
+            case op_array_at_pos:
+                sp--;
+                *sp = sp[0].a->entries[sp[1].i];
+            break;
+            case op_array_at_pos_inc: {
+                sp--;
+                constant_t*e = &sp[0].a->entries[sp[1].i];
+                e->i++;
+                *sp = *e;
+            }
+            break;
+            case op_array_arg_max_i: {
+                array_t*a = sp->a;
+                set_int(sp, arg_max_i(a->entries, a->size));
+            }
+            break;
+            case op_zero_int_array: {
+                scratch_array_t*s = &p->scratch_arrays[i->arg];
+                array_t*a = (array_t*)&scratch[s->offset];
+                a->size = s->size;
+                array_fill(a, int_constant(0));
+                *++sp = int_array_constant(a);
+            }
+            break;
+            case op_forest: {
+                forest_t*f = constants[i->arg].forest;
+                *++sp = f->classes->entries[forest_predict(f, row)];
+            }
+            break;
+            case op_lookup: {
+                /* values are stored right after the keys */
+                array_t*keys = constants[i->arg].a;
+                array_t*values = constants[i->arg+1].a;
+                int t;
+                for(t=0;t<keys->size;t++) {
+                    if(constant_equals(sp, &keys->entries[t]))
+                        break;
+                }
+                if(t < keys->size) {
+                    *sp = values->entries[t];
+                } else {
+                    set_float(sp, 0.0);
+                }
+            }
+            break;
+            case op_lookup_table: {
+                array_t*table = constants[i->arg].a;
+                if(sp->type == CONSTANT_CATEGORY && (uint32_t)sp->c < table->size) {
+                    *sp = table->entries[sp->c];
+                } else {
+                    set_float(sp, 0.0);
+                }
+            }
+            break;
+            case op_dot: {
+                dot_weights_t*d = &p->dots[i->arg];
+                float x[d->size];
+                sp -= d->size - 1;
+                int t;
+                for(t=0;t<d->size;t++) {
+                    x[t] = sp[t].f;
+                }
+                set_float(sp, dot_product(&p->weights[d->offset], x, d->size));
+            }
+            break;
+            default:
+                fprintf(stderr, "Invalid opcode %d\n", i->op);
+                exit(1);
+        }
+        i++;
+    }
+}
+
+constant_t program_run(program_t*p, row_t*row)
+{
+    constant_t stack[p->max_stack];
+    constant_t locals[p->num_locals + 1];
+    constant_t scratch[p->scratch_size + 1];
+    return program_execute(p, row, stack, locals, scratch);
+}
+
+/* Rows are converted from the dataset's columns one tile at a time.
+   That way we read every column sequentially, while the rows we
+   convert into stay in the cache until the program consumes them. */
+#define TILE_SIZE 64
+
+static void forest_run_rows(forest_t*f, row_t**rows, int num_rows, constant_t*out)
+{
+    int classes[num_rows];
+    forest_predict_rows(f, rows, num_rows, classes);
+    int t;
+    for(t=0;t<num_rows;t++) {
+        out[t] = f->classes->entries[classes[t]];
+    }
+}
+
+void program_run_batch(program_t*p, row_t**rows, int num_rows, constant_t*out)
+{
+    if(p->forest) {
+        int pos;
+        for(pos=0;pos<num_rows;pos+=TILE_SIZE) {
+            int num = num_rows - pos < TILE_SIZE ? num_rows - pos : TILE_SIZE;
+            forest_run_rows(p->forest, &rows[pos], num, &out[pos]);
+        }
+        return;
+    }
+    constant_t stack[p->max_stack];
+    constant_t locals[p->num_locals + 1];
+    constant_t scratch[p->scratch_size + 1];
+    int t;
+    for(t=0;t<num_rows;t++) {
+        out[t] = program_execute(p, rows[t], stack, locals, scratch);
+    }
+}
+
+void program_run_dataset(program_t*p, dataset_t*d, constant_t*out)
+{
+    constant_t stack[p->max_stack];
+    constant_t locals[p->num_locals + 1];
+    constant_t scratch[p->scratch_size + 1];
+    row_t*rows[TILE_SIZE];
+    int t;
+    for(t=0;t<TILE_SIZE;t++) {
+        rows[t] = row_new(d->sig->num_inputs);
+    }
+    int pos;
+    for(pos=0;pos<d->num_rows;pos+=TILE_SIZE) {
+        int num = d->num_rows - pos;
+        if(num > TILE_SIZE)
+            num = TILE_SIZE;
+        dataset_fill_rows(d, rows, pos, num);
+        if(p->forest) {
+            forest_run_rows(p->forest, rows, num, &out[pos]);
+            continue;
+        }
+        for(t=0;t<num;t++) {
+            out[pos+t] = program_execute(p, rows[t], stack, locals, scratch);
+        }
+    }
+    for(t=0;t<TILE_SIZE;t++) {
+        row_destroy(rows[t]);
+    }
+}
+
+// ------------------------------------------------------------------------
+
+program_t* model_get_program(model_t*m)
+{
+    program_t*p = (program_t*)m->program;
+    if(!p) {
+        p = program_compile((node_t*)m->code);
+        /* another thread might have compiled the program at the same
+           time. Only one of them gets to keep it */
+        if(!__sync_bool_compare_and_swap(&m->program, NULL, p)) {
+            program_destroy(p);
+            p = (program_t*)m->program;
+        }
+    }
+    return p;
+}
+
+variable_t model_predict_compiled(model_t*m, row_t*row)
+{
+    program_t*p = model_get_program(m);
+    constant_t c = program_run(p, row);
+    return constant_to_variable(&c);
+}
+
+void model_predict_batch(model_t*m, row_t**rows, int num_rows, variable_t*out)
+{
+    program_t*p = model_get_program(m);
+    constant_t*results = (constant_t*)malloc(sizeof(constant_t)*num_rows);
+    program_run_batch(p, rows, num_rows, results);
+    int t;
+    for(t=0;t<num_rows;t++) {
+        out[t] = constant_to_variable(&results[t]);
+    }
+    free(results);
+}
+
+void model_predict_dataset(model_t*m, dataset_t*d, variable_t*out)
+{
+    program_t*p = model_get_program(m);
+    constant_t*results = (constant_t*)malloc(sizeof(constant_t)*d->num_rows);
+    program_run_dataset(p, d, results);
+    int t;
+    for(t=0;t<d->num_rows;t++) {
+        out[t] = constant_to_variable(&results[t]);
+    }
+    free(results);
+}
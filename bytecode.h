@@ -0,0 +1,90 @@
+/* bytecode.h
+   Flat bytecode for fast AST evaluation.
+
+   Part of the data prediction package.
+
+   Copyright (c) 2011 Matthias Kramm <kramm@quiss.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __bytecode_h__
+#define __bytecode_h__
+
+#include "ast.h"
+#include "dataset.h"
+#include "forest.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _instruction {
+    uint8_t op;
+    int32_t arg;
+} instruction_t;
+
+typedef struct _scratch_array {
+    int offset;
+    int size;
+} scratch_array_t;
+
+typedef struct _dot_weights {
+    int offset;
+    int size;
+} dot_weights_t;
+
+/* A compiled AST. Programs are immutable once compiled, and can
+   be run from several threads at once. */
+typedef struct _program {
+    instruction_t*code;
+    int num_instructions;
+
+    constant_t*constants;
+    int num_constants;
+
+    /* arrays modified during evaluation (zero_int_array) live on the
+       stack of program_run(), not in the program */
+    scratch_array_t*scratch_arrays;
+    int num_scratch_arrays;
+    int scratch_size;
+
+    /* the weights of dot products, as plain floats which can be loaded
+       into SIMD registers directly */
+    dot_weights_t*dots;
+    int num_dots;
+    float*weights;
+    int num_weights;
+
+    int max_stack;
+    int num_locals;
+
+    /* set if the program is a single forest (owned by constants[]) */
+    forest_t*forest;
+} program_t;
+
+program_t* program_compile(node_t*node);
+constant_t program_run(program_t*p, row_t*row);
+void program_run_batch(program_t*p, row_t**rows, int num_rows, constant_t*out);
+void program_run_dataset(program_t*p, dataset_t*d, constant_t*out);
+void program_print(program_t*p);
+void program_destroy(program_t*p);
+
+program_t* model_get_program(model_t*m);
+void model_predict_dataset(model_t*m, dataset_t*d, variable_t*out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //__bytecode_h__
@@ -120,17 +120,22 @@ void dedent(state_t*s)
 
 char*generate_code(codegen_t*codegen, model_t*m)
 {
-    node_t*n = (node_t*)m->code;
+    /* the transformations below are destructive, and the model
+       should keep its (faster) packed forests */
+    node_t*n = node_duplicate((node_t*)m->code);
     state_t s;
     s.model = m;
     s.codegen = codegen;
     s.indent = 0;
     s.writer = growingmemwriter_new();
+    n = node_expand_forests(n, codegen->writes_forest);
     n = node_prepare_for_code_generation(n);
+    s.code = n;
     codegen->write_header(m, &s);
     write_node(&s, n);
     codegen->write_footer(m, &s);
     write_uint8(s.writer, 0);
+    node_destroy(n);
 
     char*result = writer_growmemwrite_getmem(s.writer, 0);
     s.writer->finish(s.writer);
@@ -146,6 +151,8 @@ char*model_generate_code(model_t*m, const char*language)
         return generate_code(&codegen_python, m);
     } else if(!strcmp(language,"c")) {
         return generate_code(&codegen_c, m);
+    } else if(!strcmp(language,"c-fast")) {
+        return generate_code(&codegen_c_fast, m);
     } else if(!strcmp(language,"c++")) {
         return generate_code(&codegen_c, m);
     } else if(!strcmp(language,"ruby")) {
@@ -34,12 +34,17 @@ LIST_NODES
 #undef NODE
     void (*write_header)(model_t*model, state_t*s);
     void (*write_footer)(model_t*model, state_t*s);
+
+    /* if set, forests it returns true for are passed to
+       write_node_forest. All others are expanded into plain trees */
+    bool (*writes_forest)(struct _forest*f);
 } codegen_t;
 
 struct _state {
     int indent;
     bool after_newline;
     model_t*model;
+    node_t*code;  // the code being written, a prepared copy of model->code
     writer_t*writer;
     codegen_t*codegen;
 };
@@ -51,6 +56,7 @@ void indent(state_t*s);
 void dedent(state_t*s);
 
 codegen_t codegen_c;
+codegen_t codegen_c_fast;
 codegen_t codegen_js;
 codegen_t codegen_ruby;
 codegen_t codegen_python;
@@ -20,8 +20,13 @@
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
 
 #include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "codegen.h"
 #include "ast_transforms.h"
+#include "forest.h"
 
 char* c_type_name(constant_type_t c)
 {
@@ -148,35 +153,26 @@ void c_write_node_gte(node_t*n, state_t*s)
 }
 void c_write_node_in(node_t*n, state_t*s)
 {
-    if(node_is_array(n->child[1])) {
-        array_t*a = n->child[1]->value.a;
-        if(!a->size) {
-            strf(s, "false");
-            return;
-        } else {
-            constant_type_t etype = constant_array_subtype(&n->child[1]->value);
-            switch(etype) {
-                case CONSTANT_STRING:
-                    strf(s, "!!strstr(\"");
-                    int t;
-                    for(t=0;t<a->size;t++) {
-                        assert(a->entries[t].type == CONSTANT_STRING);
-                        if(t) 
-                            strf(s, "\\x7f");
-                        write_escaped_string(s, a->entries[t].s);
-                    }
-                    strf(s, "\",");
-                    write_node(s, n->child[0]);
-                    strf(s, ")");
-                    return;
-            }
-        }
+    if(node_is_array(n->child[1]) && !n->child[1]->value.a->size) {
+        strf(s, "false");
+        return;
+    }
+    /* the array is declared by c_enumerate_arrays() */
+    switch(node_array_element_type(n->child[1])) {
+        case CONSTANT_STRING:
+            strf(s, "in_s(");
+            break;
+        case CONSTANT_FLOAT:
+            strf(s, "in_f(");
+            break;
+        default:
+            strf(s, "in_i(");
+            break;
     }
-    strf(s, "find_in(");
     write_node(s, n->child[0]);
-    strf(s, ",");
+    strf(s, ", ");
     write_node(s, n->child[1]);
-    strf(s, ")");
+    strf(s, ", %d)", node_array_size(n->child[1]));
 }
 void c_write_node_not(node_t*n, state_t*s)
 {
@@ -207,24 +203,43 @@ void c_write_node_abs(node_t*n, state_t*s)
     write_node(s, n->child[0]);
     strf(s, ")");
 }
-void c_write_node_param(node_t*n, state_t*s)
+static void c_write_param_name(state_t*s, int index)
 {
-    if(s->model->sig->column_names) {
-        strf(s, "%s", s->model->sig->column_names[n->value.i]);
+    if(s->model->sig->has_column_names) {
+        strf(s, "%s", s->model->sig->column_names[index]);
     } else {
-        strf(s, "p%d", n->value.i);
+        strf(s, "p%d", index);
     }
 }
+void c_write_node_param(node_t*n, state_t*s)
+{
+    c_write_param_name(s, n->value.i);
+}
 void c_write_node_nop(node_t*n, state_t*s)
 {
     strf(s, "(void)");
 }
+static void c_write_float(state_t*s, float f)
+{
+    char buf[32];
+    if(isnan(f)) {
+        strf(s, "NAN");
+    } else if(isinf(f)) {
+        strf(s, f<0 ? "-INFINITY" : "INFINITY");
+    } else {
+        /* enough digits to read back the same float, as a float
+           literal, so that comparisons with inputs aren't done in
+           double precision */
+        sprintf(buf, "%.9g", f);
+        strf(s, "%s%sf", buf, strpbrk(buf, ".e") ? "" : ".0");
+    }
+}
 void c_write_constant(constant_t*c, state_t*s)
 {
     int t;
     switch(c->type) {
         case CONSTANT_FLOAT:
-            strf(s, "%f", c->f);
+            c_write_float(s, c->f);
             break;
         case CONSTANT_INT:
         case CONSTANT_CATEGORY:
@@ -232,12 +247,13 @@ void c_write_constant(constant_t*c, state_t*s)
             break;
         case CONSTANT_BOOL:
             if(c->b)
-                strf(s, "True");
+                strf(s, "true");
             else
-                strf(s, "False");
+                strf(s, "false");
+            break;
         case CONSTANT_STRING:
             strf(s, "\"");
-            strf(s, "%s", c->s);
+            write_escaped_string(s, c->s);
             strf(s, "\"");
             break;
         case CONSTANT_MISSING:
@@ -393,6 +409,55 @@ void c_write_node_return(node_t*n, state_t*s)
     strf(s, "return ");
     write_node(s, n->child[0]);
 }
+void c_write_node_forest(node_t*n, state_t*s)
+{
+    /* forests are expanded by generate_code() */
+    assert(0);
+}
+static array_t* c_lookup_table(node_t*n)
+{
+    /* the input is written twice, so only do this for plain params */
+    if(n->child[0]->type != &node_param)
+        return NULL;
+    return node_lookup_table(n);
+}
+void c_write_node_lookup(node_t*n, state_t*s)
+{
+    array_t*table = c_lookup_table(n);
+    if(table) {
+        /* indexed by category, declared by c_enumerate_arrays() */
+        strf(s, "((unsigned)");
+        write_node(s, n->child[0]);
+        strf(s, "<%d?l%x[", table->size, (long)n);
+        write_node(s, n->child[0]);
+        strf(s, "]:0.0)");
+        array_destroy(table);
+        return;
+    }
+    if(node_array_element_type(n->child[1]) == CONSTANT_STRING) {
+        strf(s, "lookup_s(");
+    } else {
+        strf(s, "lookup_i(");
+    }
+    write_node(s, n->child[0]);
+    strf(s, ", ");
+    write_node(s, n->child[1]);
+    strf(s, ", ");
+    write_node(s, n->child[2]);
+    strf(s, ", %d)", n->child[1]->value.a->size);
+}
+void c_write_node_dot(node_t*n, state_t*s)
+{
+    strf(s, "dot(");
+    write_node(s, n->child[0]);
+    strf(s, ", (float[]){");
+    int t;
+    for(t=1;t<n->num_children;t++) {
+        if(t>1) strf(s, ", ");
+        write_node(s, n->child[t]);
+    }
+    strf(s, "}, %d)", n->num_children-1);
+}
 void c_write_node_brackets(node_t*n, state_t*s)
 {
     strf(s, "(");
@@ -407,11 +472,11 @@ static void c_write_function_arg_max(state_t*s, char*suffix, char*type)
 "    va_list arglist;\n"
 "    va_start(arglist, count);\n"
 "    int i;\n"
-"    double max = va_arg(arglist,%s)\n"
+"    double max = va_arg(arglist,%s);\n"
 "    int best = 0;\n"
 "    for(i=1;i<count;i++) {\n"
-"        double a = va_arg(arglist,%s)\n"
-"        if(a>best) {\n"
+"        double a = va_arg(arglist,%s);\n"
+"        if(a>max) {\n"
 "            best = i;\n"
 "            max = a;\n"
 "        }\n"
@@ -424,7 +489,7 @@ static void c_write_function_arg_max(state_t*s, char*suffix, char*type)
 static void c_write_function_array_arg_max_i(state_t*s)
 {
     strf(s, "%s",
-"int array_arg_max_i(int*array, int count)\n"
+"int array_arg_max_i(const int*array, int count)\n"
 "{\n"
 "    int max = array[0];\n"
 "    int best = 0;\n"
@@ -439,18 +504,95 @@ static void c_write_function_array_arg_max_i(state_t*s)
 "}\n"
     );
 }
+static void c_write_function_lookup(state_t*s)
+{
+    strf(s, "%s",
+"static inline float lookup_i(int key, const int*keys, const float*values, int count)\n"
+"{\n"
+"    int i;\n"
+"    for(i=0;i<count;i++) {\n"
+"        if(keys[i] == key)\n"
+"            return values[i];\n"
+"    }\n"
+"    return 0.0;\n"
+"}\n"
+"static inline float lookup_s(const char*key, char*const*keys, const float*values, int count)\n"
+"{\n"
+"    int i;\n"
+"    for(i=0;i<count;i++) {\n"
+"        if(!strcmp(keys[i], key))\n"
+"            return values[i];\n"
+"    }\n"
+"    return 0.0;\n"
+"}\n"
+    );
+}
+static void c_write_function_in(state_t*s)
+{
+    strf(s, "%s",
+"static inline bool in_s(const char*value, char*const*set, int count)\n"
+"{\n"
+"    int i;\n"
+"    for(i=0;i<count;i++) {\n"
+"        if(!strcmp(set[i], value))\n"
+"            return true;\n"
+"    }\n"
+"    return false;\n"
+"}\n"
+"static inline bool in_i(int value, const int*set, int count)\n"
+"{\n"
+"    int i;\n"
+"    for(i=0;i<count;i++) {\n"
+"        if(set[i] == value)\n"
+"            return true;\n"
+"    }\n"
+"    return false;\n"
+"}\n"
+"static inline bool in_f(float value, const float*set, int count)\n"
+"{\n"
+"    int i;\n"
+"    for(i=0;i<count;i++) {\n"
+"        if(set[i] == value)\n"
+"            return true;\n"
+"    }\n"
+"    return false;\n"
+"}\n"
+    );
+}
+static void c_write_function_dot(state_t*s)
+{
+    /* sums up in the same order as dot_product() in ast.c */
+    strf(s, "%s",
+"static inline float dot(const float*w, const float*x, int count)\n"
+"{\n"
+"    double sum = 0.0;\n"
+"    int i;\n"
+"    for(i=0;i<count;i++) {\n"
+"        sum += (double)w[i]*x[i];\n"
+"    }\n"
+"    return sum;\n"
+"}\n"
+    );
+}
 static void c_write_function_sqr(state_t*s)
 {
     strf(s, "%s",
 "static inline double sqr(const double v)\n"
 "{\n"
-"    return v*v\n"
+"    return v*v;\n"
 "}\n"
     );
 }
 void c_enumerate_arrays(node_t*node, state_t*s)
 {
-    if(node_is_array(node)) {
+    array_t*table;
+    if(node->type == &node_lookup && (table = c_lookup_table(node))) {
+        constant_t c = float_array_constant(table);
+        strf(s, "float l%x[%d] = ", (long)node, table->size);
+        c_write_constant(&c, s);
+        strf(s, ";\n");
+        array_destroy(table);
+    } else if(node_is_array(node)) {
         strf(s, "%s a%x[%d] = ", 
                 c_type_name(constant_array_subtype(&node->value)),
                 (long)(node->value.a),
@@ -465,11 +607,14 @@ void c_enumerate_arrays(node_t*node, state_t*s)
         }
     }
 }
-void c_write_header(model_t*model, state_t*s)
+static void c_write_functions(node_t*root, state_t*s)
 {
-    node_t*root = (node_t*)model->code;
-    constant_type_t type = node_type(root, model);
-
+    strf(s, "#include <math.h>\n");
+    strf(s, "#include <stdarg.h>\n");
+    strf(s, "#include <stdbool.h>\n");
+    strf(s, "#include <stdint.h>\n");
+    strf(s, "#include <string.h>\n");
+    strf(s, "\n");
     if(node_has_child(root, &node_arg_max)) {
         c_write_function_arg_max(s, "", "double");
     }
@@ -482,16 +627,26 @@ void c_write_header(model_t*model, state_t*s)
     if(node_has_child(root, &node_sqr)) {
         c_write_function_sqr(s);
     }
-
+    if(node_has_child(root, &node_lookup)) {
+        c_write_function_lookup(s);
+    }
+    if(node_has_child(root, &node_in)) {
+        c_write_function_in(s);
+    }
+    if(node_has_child(root, &node_dot)) {
+        c_write_function_dot(s);
+    }
+}
+static void c_write_function_start(model_t*model, state_t*s)
+{
+    node_t*root = s->code;
+    constant_type_t type = node_type(root, model);
     strf(s, "%s predict(", c_type_name(type));
     int t;
     for(t=0;t<model->sig->num_inputs;t++) {
         if(t) strf(s, ", ");
-        if(s->model->sig->has_column_names) {
-            strf(s, "%s %s", c_type_name(model_param_type(s->model,t)), s->model->sig->column_names[t]);
-        } else {
-            strf(s, "%s p%d", c_type_name(model_param_type(s->model,t)), t);
-        }
+        strf(s, "%s ", c_type_name(model_param_type(s->model,t)));
+        c_write_param_name(s, t);
     }
     strf(s, ")\n");
     strf(s, "{\n");
@@ -503,14 +658,47 @@ void c_write_header(model_t*model, state_t*s)
             strf(s, "%s v%d;\n", c_type_name(types[t]), t);
         }
     }
+    free(types);
+}
+void c_write_header(model_t*model, state_t*s)
+{
+    node_t*root = s->code;
+    c_write_functions(root, s);
+    c_write_function_start(model, s);
     c_enumerate_arrays(root, s);
-
+}
+/* the inputs of many rows, as one array per column */
+static void c_write_predict_n_start(model_t*model, state_t*s)
+{
+    node_t*root = s->code;
+    constant_type_t type = node_type(root, model);
+    strf(s, "void predict_n(int count");
+    int t;
+    for(t=0;t<model->sig->num_inputs;t++) {
+        strf(s, ", %s*", c_type_name(model_param_type(s->model,t)));
+        c_write_param_name(s, t);
+    }
+    strf(s, ", %s*out)\n", c_type_name(type));
+    strf(s, "{\n");
 }
 void c_write_footer(model_t*model, state_t*s)
 {
-    node_t*root = model->code;
+    int t;
     dedent(s);
     strf(s, "\n}\n");
+
+    c_write_predict_n_start(model, s);
+    strf(s, "    int i;\n");
+    strf(s, "    for(i=0;i<count;i++) {\n");
+    strf(s, "        out[i] = predict(");
+    for(t=0;t<model->sig->num_inputs;t++) {
+        if(t) strf(s, ", ");
+        c_write_param_name(s, t);
+        strf(s, "[i]");
+    }
+    strf(s, ");\n");
+    strf(s, "    }\n");
+    strf(s, "}\n");
 }
 
 
@@ -522,3 +710,654 @@ LIST_NODES
     write_footer: c_write_footer,
 };
 
+// -------------------------------- c-fast --------------------------------
+
+/* The same, but for speed rather than readability: constant arrays are
+   static, set tests on categorical inputs are bit tests on the number
+   of the input's value, and forests stay packed, as tables of nodes
+   which a loop walks. */
+
+typedef struct _c_values {
+    constant_t*entries;
+    int num;
+    int size;
+} c_values_t;
+
+static void c_values_add(c_values_t*v, constant_t*c, constant_type_t type)
+{
+    int t;
+    /* other values can't be passed to predict() */
+    if(c->type != type)
+        return;
+    for(t=0;t<v->num;t++) {
+        if(constant_equals(&v->entries[t], c))
+            return;
+    }
+    if(v->num == v->size) {
+        v->size = v->size ? v->size*2 : 16;
+        v->entries = realloc(v->entries, sizeof(constant_t)*v->size);
+    }
+    v->entries[v->num++] = *c;
+}
+static int c_values_find(c_values_t*v, constant_t*c)
+{
+    int t;
+    for(t=0;t<v->num;t++) {
+        if(constant_equals(&v->entries[t], c))
+            return t;
+    }
+    return -1;
+}
+/* the number of mask words: the values, plus one for all others */
+static int c_values_words(c_values_t*v)
+{
+    return (v->num + 1 + 63) / 64;
+}
+
+/* in nodes which can be written as a bit test: the input, or -1 */
+static int c_fast_set_input(node_t*n)
+{
+    if(n->child[0]->type != &node_param ||
+       !node_is_array(n->child[1]) ||
+       n->child[1]->type == &node_zero_int_array)
+        return -1;
+    return n->child[0]->value.i;
+}
+static void c_fast_collect_values(node_t*n, int input, constant_type_t type, c_values_t*v)
+{
+    int t,i;
+    if(n->type == &node_in && c_fast_set_input(n) == input) {
+        array_t*a = n->child[1]->value.a;
+        for(t=0;t<a->size;t++) {
+            c_values_add(v, &a->entries[t], type);
+        }
+    } else if(n->type == &node_forest) {
+        forest_t*f = n->value.forest;
+        for(t=0;t<f->num_nodes;t++) {
+            if(f->feature[t] == input && (f->flags[t] & FOREST_FLAG_CATEGORICAL)) {
+                array_t*a = f->sets[f->set[t]];
+                for(i=0;i<a->size;i++) {
+                    c_values_add(v, &a->entries[i], type);
+                }
+            }
+        }
+    }
+    for(t=0;t<n->num_children;t++) {
+        c_fast_collect_values(n->child[t], input, type, v);
+    }
+}
+/* the values the code tests the input for. Their number (or v->num,
+   for all others) is what sets are bitmasks over. */
+static c_values_t c_fast_values(state_t*s, int input)
+{
+    c_values_t v;
+    memset(&v, 0, sizeof(v));
+    c_fast_collect_values(s->code, input, model_param_type(s->model, input), &v);
+    return v;
+}
+static void c_fast_write_mask(state_t*s, c_values_t*values, array_t*set)
+{
+    int words = c_values_words(values);
+    uint64_t bits[words];
+    memset(bits, 0, sizeof(bits));
+    int t;
+    for(t=0;t<set->size;t++) {
+        int i = c_values_find(values, &set->entries[t]);
+        if(i >= 0)
+            bits[i>>6] |= (uint64_t)1 << (i&63);
+    }
+    for(t=0;t<words;t++) {
+        strf(s, "%s0x%016llxull", t ? "," : "", (unsigned long long)bits[t]);
+    }
+}
+
+void c_fast_write_node_in(node_t*n, state_t*s)
+{
+    int input = c_fast_set_input(n);
+    if(input < 0) {
+        c_write_node_in(n, s);
+        return;
+    }
+    c_values_t values = c_fast_values(s, input);
+    free(values.entries);
+    if(!values.num) {
+        strf(s, "false");
+        return;
+    }
+    /* the mask is declared by c_fast_enumerate_tables() */
+    strf(s, "in_set(m%x, category%d(", (long)n, input);
+    write_node(s, n->child[0]);
+    strf(s, "))");
+}
+void c_fast_write_node_forest(node_t*n, state_t*s)
+{
+    /* x[] and c[] are filled by c_fast_write_header() */
+    forest_t*f = n->value.forest;
+    strf(s, "classes%x[forest%x(x, c)]", (long)f, (long)f);
+}
+
+static void c_fast_write_function_category(state_t*s, int input, c_values_t*v)
+{
+    constant_type_t type = model_param_type(s->model, input);
+    constant_t values = {type: CONSTANT_MIXED_ARRAY};
+    values.a = array_new(v->num);
+    memcpy(values.a->entries, v->entries, sizeof(constant_t)*v->num);
+    if(type == CONSTANT_STRING) {
+        strf(s, "static inline int category%d(const char*v)\n", input);
+        strf(s, "{\n");
+        strf(s, "    static char*const values[%d] = ", v->num);
+    } else {
+        strf(s, "static inline int category%d(%s v)\n", input, c_type_name(type));
+        strf(s, "{\n");
+        strf(s, "    static const %s values[%d] = ", c_type_name(type), v->num);
+    }
+    c_write_constant(&values, s);
+    strf(s, ";\n");
+    strf(s, "    int i;\n");
+    strf(s, "    for(i=0;i<%d;i++) {\n", v->num);
+    if(type == CONSTANT_STRING) {
+        strf(s, "        if(!strcmp(values[i], v))\n");
+    } else {
+        strf(s, "        if(values[i] == v)\n");
+    }
+    strf(s, "            break;\n");
+    strf(s, "    }\n");
+    strf(s, "    return i;\n");
+    strf(s, "}\n");
+    array_destroy(values.a);
+}
+static void c_fast_write_function_in_set(state_t*s)
+{
+    strf(s, "%s",
+"static inline bool in_set(const uint64_t*set, int i)\n"
+"{\n"
+"    return (set[i>>6] >> (i&63)) & 1;\n"
+"}\n"
+    );
+}
+/* Trees are walked TREE_GROUP at a time, in lockstep, for as many steps
+   as the deepest tree of the group needs. Leaves lead back to themselves
+   (x <= NAN is false, so they go "right"), and there's no branch on which
+   way a split went. Walking independent trees side by side keeps the CPU
+   busy while it waits for the next nodes; one tree at a time, every
+   step would wait for the one before it.
+   predict_n() instead walks every tree for TREE_GROUP rows at a time,
+   ROW_TILE rows in all, so that the nodes of a tree stay in the cache. */
+#define TREE_GROUP 8
+#define ROW_TILE 64
+
+static void c_fast_write_function_walk(state_t*s)
+{
+    strf(s, "%s",
+"typedef struct _tree_node {\n"
+"    int feature;\n"
+"    int flags;   // 1: categorical, 2: inversed\n"
+"    int right;   // leaves: the leaf itself\n"
+"    float value; // threshold. leaves: NAN\n"
+"    int set;     // categorical: the mask, in sets[]\n"
+"} tree_node_t;\n"
+    );
+    strf(s,
+"static inline int tree_step(const tree_node_t*nodes, int n, const float*x, const int*c, const uint64_t*sets)\n"
+"{\n"
+"    const tree_node_t*node = &nodes[n];\n"
+"    bool left;\n"
+"    if(node->flags & 1)\n"
+"        left = in_set(&sets[node->set], c[node->feature]);\n"
+"    else\n"
+"        left = x[node->feature] <= node->value;\n"
+"    left ^= node->flags >> 1;\n"
+"    /* n+1 if left, right if not, without a branch */\n"
+"    return node->right ^ ((n+1 ^ node->right) & -(int)left);\n"
+"}\n"
+    );
+    /* several trees for one row */
+    strf(s,
+"static inline void tree_walk(const tree_node_t*nodes, const int*roots, const int*depth, int num_trees,\n"
+"                             const float*x, const int*c, const uint64_t*sets, int*leaves)\n"
+"{\n"
+"    int k, g, d;\n"
+"    for(k=0;k<num_trees;k+=%d) {\n"
+"        int n[%d];\n"
+"        for(g=0;g<%d;g++) {\n"
+"            n[g] = roots[k+g];\n"
+"        }\n"
+"        for(d=depth[k/%d];d>0;d--) {\n"
+"            for(g=0;g<%d;g++) {\n"
+"                n[g] = tree_step(nodes, n[g], x, c, sets);\n"
+"            }\n"
+"        }\n"
+"        for(g=0;g<%d;g++) {\n"
+"            leaves[k+g] = n[g];\n"
+"        }\n"
+"    }\n"
+"}\n", TREE_GROUP, TREE_GROUP, TREE_GROUP, TREE_GROUP, TREE_GROUP, TREE_GROUP
+    );
+    /* ... and one tree for several rows, see forest_predict_rows() */
+    strf(s,
+"static inline void tree_walk_rows(const tree_node_t*nodes, int root, int depth, const float*x, const int*c,\n"
+"                                  int num_inputs, const uint64_t*sets, int*leaves)\n"
+"{\n"
+"    int g, d;\n"
+"    int n[%d];\n"
+"    for(g=0;g<%d;g++) {\n"
+"        n[g] = root;\n"
+"    }\n"
+"    for(d=depth;d>0;d--) {\n"
+"        for(g=0;g<%d;g++) {\n"
+"            n[g] = tree_step(nodes, n[g], &x[g*num_inputs], &c[g*num_inputs], sets);\n"
+"        }\n"
+"    }\n"
+"    for(g=0;g<%d;g++) {\n"
+"        leaves[g] = n[g];\n"
+"    }\n"
+"}\n", TREE_GROUP, TREE_GROUP, TREE_GROUP, TREE_GROUP
+    );
+    strf(s, "%s",
+"static inline int most_votes(const int*votes, int count)\n"
+"{\n"
+"    int best = 0;\n"
+"    int i;\n"
+"    for(i=1;i<count;i++) {\n"
+"        if(votes[i] > votes[best])\n"
+"            best = i;\n"
+"    }\n"
+"    return best;\n"
+"}\n"
+    );
+    strf(s, "%s",
+"static inline int highest_sum(const double*sums, int count)\n"
+"{\n"
+"    float max = sums[0];\n"
+"    int best = 0;\n"
+"    int i;\n"
+"    for(i=1;i<count;i++) {\n"
+"        float v = sums[i];\n"
+"        if(v > max) {\n"
+"            max = v;\n"
+"            best = i;\n"
+"        }\n"
+"    }\n"
+"    return best;\n"
+"}\n"
+    );
+}
+static void c_fast_declare_array(state_t*s, const char*prefix, long id, constant_type_t type, constant_t*c)
+{
+    if(type == CONSTANT_STRING) {
+        strf(s, "static char*const %s%x[%d] = ", prefix, id, c->a->size);
+    } else {
+        strf(s, "static const %s %s%x[%d] = ", c_type_name(type), prefix, id, c->a->size);
+    }
+    c_write_constant(c, s);
+    strf(s, ";\n");
+}
+static void c_fast_write_forest(state_t*s, forest_t*f)
+{
+    int num_inputs = s->model->sig->num_inputs;
+    c_values_t*values = calloc(num_inputs, sizeof(c_values_t));
+    bool*have_values = calloc(num_inputs, sizeof(bool));
+    int*mask = calloc(f->num_nodes, sizeof(int));
+    int*depth = calloc(f->num_nodes, sizeof(int));
+    int num_groups = (f->num_trees + TREE_GROUP - 1) / TREE_GROUP;
+    int*group_depth = calloc(num_groups, sizeof(int));
+    int k,n,pos = 0;
+
+    strf(s, "static const uint64_t sets%x[] = {", (long)f);
+    for(n=0;n<f->num_nodes;n++) {
+        int i = f->feature[n];
+        if(i == FOREST_LEAF || !(f->flags[n] & FOREST_FLAG_CATEGORICAL))
+            continue;
+        if(!have_values[i]) {
+            values[i] = c_fast_values(s, i);
+            have_values[i] = true;
+        }
+        if(pos) strf(s, ",");
+        c_fast_write_mask(s, &values[i], f->sets[f->set[n]]);
+        mask[n] = pos;
+        pos += c_values_words(&values[i]);
+    }
+    strf(s, "%s};\n", pos ? "" : "0");
+
+    /* nodes are in preorder, so parents come before their children */
+    for(k=0;k<f->num_trees;k++) {
+        int end = k+1<f->num_trees ? f->tree_root[k+1] : f->num_nodes;
+        for(n=f->tree_root[k];n<end;n++) {
+            if(f->feature[n] != FOREST_LEAF) {
+                depth[n+1] = depth[f->right[n]] = depth[n] + 1;
+            } else if(depth[n] > group_depth[k/TREE_GROUP]) {
+                group_depth[k/TREE_GROUP] = depth[n];
+            }
+        }
+    }
+
+    strf(s, "static const tree_node_t nodes%x[%d] = {\n", (long)f, f->num_nodes);
+    for(n=0;n<f->num_nodes;n++) {
+        if(f->feature[n] == FOREST_LEAF) {
+            strf(s, "    {0,0,%d,NAN,0},\n", n);
+        } else {
+            strf(s, "    {%d,%d,%d,", f->feature[n], f->flags[n], f->right[n]);
+            c_write_float(s, f->threshold[n]);
+            strf(s, ",%d},\n", mask[n]);
+        }
+    }
+    strf(s, "};\n");
+    if(f->kind == FOREST_VOTE) {
+        strf(s, "static const int leaf%x[%d] = {", (long)f, f->num_nodes);
+        for(n=0;n<f->num_nodes;n++) {
+            strf(s, "%s%d", n ? "," : "", f->feature[n] == FOREST_LEAF ? f->right[n] : 0);
+        }
+    } else {
+        strf(s, "static const float leaf%x[%d] = {", (long)f, f->num_nodes);
+        for(n=0;n<f->num_nodes;n++) {
+            if(n) strf(s, ",");
+            c_write_float(s, f->feature[n] == FOREST_LEAF ? f->threshold[n] : 0.0);
+        }
+    }
+    strf(s, "};\n");
+
+    /* the last group is filled up with the first tree's root, which
+       costs no more steps than the trees of the group need anyway */
+    int num_roots = num_groups * TREE_GROUP;
+    strf(s, "static const int roots%x[%d] = {", (long)f, num_roots);
+    for(k=0;k<num_roots;k++) {
+        strf(s, "%s%d", k ? "," : "", f->tree_root[k < f->num_trees ? k : 0]);
+    }
+    strf(s, "};\n");
+    strf(s, "static const int depth%x[%d] = {", (long)f, num_groups);
+    for(k=0;k<num_groups;k++) {
+        strf(s, "%s%d", k ? "," : "", group_depth[k]);
+    }
+    strf(s, "};\n");
+    strf(s, "static const int tree_depth%x[%d] = {", (long)f, f->num_trees);
+    for(k=0;k<f->num_trees;k++) {
+        int end = k+1<f->num_trees ? f->tree_root[k+1] : f->num_nodes;
+        int max = 0;
+        for(n=f->tree_root[k];n<end;n++) {
+            if(depth[n] > max)
+                max = depth[n];
+        }
+        strf(s, "%s%d", k ? "," : "", max);
+    }
+    strf(s, "};\n");
+    if(f->kind == FOREST_SUM) {
+        strf(s, "static const int tree_class%x[%d] = {", (long)f, f->num_trees);
+        for(k=0;k<f->num_trees;k++) {
+            strf(s, "%s%d", k ? "," : "", f->tree_class[k]);
+        }
+        strf(s, "};\n");
+    }
+    /* the same type node_type() returns for the forest */
+    constant_t classes = {type: CONSTANT_MIXED_ARRAY};
+    classes.a = f->classes;
+    c_fast_declare_array(s, "classes", (long)f, f->classes->size ? f->classes->entries[0].type : CONSTANT_MISSING, &classes);
+
+    int num_classes = f->classes->size;
+    strf(s, "static int forest%x(const float*x, const int*c)\n", (long)f);
+    strf(s, "{\n");
+    strf(s, "    int leaves[%d];\n", num_roots);
+    strf(s, "    int k;\n");
+    strf(s, "    tree_walk(nodes%x, roots%x, depth%x, %d, x, c, sets%x, leaves);\n",
+            (long)f, (long)f, (long)f, num_roots, (long)f);
+    if(f->kind == FOREST_VOTE) {
+        strf(s, "    int votes[%d] = {0};\n", num_classes);
+        strf(s, "    for(k=0;k<%d;k++) {\n", f->num_trees);
+        strf(s, "        votes[leaf%x[leaves[k]]]++;\n", (long)f);
+        strf(s, "    }\n");
+        strf(s, "    return most_votes(votes, %d);\n", num_classes);
+    } else {
+        /* summed up in the same order as forest_predict() does */
+        strf(s, "    double sums[%d] = {0};\n", num_classes);
+        strf(s, "    for(k=0;k<%d;k++) {\n", f->num_trees);
+        strf(s, "        sums[tree_class%x[k]] += leaf%x[leaves[k]];\n", (long)f, (long)f);
+        strf(s, "    }\n");
+        strf(s, "    return highest_sum(sums, %d);\n", num_classes);
+    }
+    strf(s, "}\n");
+
+    /* num_rows <= ROW_TILE. The rows after num_rows, up to the next
+       multiple of TREE_GROUP, are walked, too */
+    strf(s, "static void forest%x_rows(const float*x, const int*c, int num_rows, int*out)\n", (long)f);
+    strf(s, "{\n");
+    strf(s, "    int leaves[%d];\n", TREE_GROUP);
+    strf(s, "    int k, r, g;\n");
+    if(f->kind == FOREST_VOTE) {
+        strf(s, "    int votes[%d][%d];\n", ROW_TILE + TREE_GROUP, num_classes);
+        strf(s, "    memset(votes, 0, sizeof(votes));\n");
+    } else {
+        strf(s, "    double sums[%d][%d];\n", ROW_TILE + TREE_GROUP, num_classes);
+        strf(s, "    memset(sums, 0, sizeof(sums));\n");
+    }
+    strf(s, "    for(k=0;k<%d;k++) {\n", f->num_trees);
+    strf(s, "        for(r=0;r<num_rows;r+=%d) {\n", TREE_GROUP);
+    strf(s, "            tree_walk_rows(nodes%x, roots%x[k], tree_depth%x[k], &x[r*%d], &c[r*%d], %d, sets%x, leaves);\n",
+            (long)f, (long)f, (long)f, num_inputs, num_inputs, num_inputs, (long)f);
+    strf(s, "            for(g=0;g<%d;g++) {\n", TREE_GROUP);
+    if(f->kind == FOREST_VOTE) {
+        strf(s, "                votes[r+g][leaf%x[leaves[g]]]++;\n", (long)f);
+    } else {
+        strf(s, "                sums[r+g][tree_class%x[k]] += leaf%x[leaves[g]];\n", (long)f, (long)f);
+    }
+    strf(s, "            }\n");
+    strf(s, "        }\n");
+    strf(s, "    }\n");
+    strf(s, "    for(r=0;r<num_rows;r++) {\n");
+    if(f->kind == FOREST_VOTE) {
+        strf(s, "        out[r] = most_votes(votes[r], %d);\n", num_classes);
+    } else {
+        strf(s, "        out[r] = highest_sum(sums[r], %d);\n", num_classes);
+    }
+    strf(s, "    }\n");
+    strf(s, "}\n");
+
+    for(k=0;k<num_inputs;k++) {
+        free(values[k].entries);
+    }
+    free(values);
+    free(have_values);
+    free(mask);
+    free(depth);
+    free(group_depth);
+}
+/* Rough cost per row of the nested ifs a forest expands to: the splits
+   on the way to the average leaf, with an in_set() costing three times
+   as much as a comparison. And of walking the trees with tree_step():
+   a tree takes as many steps as its deepest leaf needs, plus the
+   in_set()s on the way. Measured on the agaricus, letter and waveform
+   data sets. A comparison in an if is cheaper than a step, so forests
+   of continuous inputs, and forests of many small trees, always end up
+   as nested ifs. */
+static bool c_fast_writes_forest(forest_t*f)
+{
+    int*depth = (int*)calloc(f->num_nodes, sizeof(int));
+    int*in_sets = (int*)calloc(f->num_nodes, sizeof(int));
+    double if_cost = 0, walk_cost = 0;
+    int k,n;
+    for(k=0;k<f->num_trees;k++) {
+        int start = f->tree_root[k];
+        int end = k+1<f->num_trees ? f->tree_root[k+1] : f->num_nodes;
+        double sum_depth = 0, sum_in_sets = 0;
+        int leaves = 0, max_depth = 0;
+        for(n=start;n<end;n++) {
+            if(f->feature[n] == FOREST_LEAF) {
+                sum_depth += depth[n];
+                sum_in_sets += in_sets[n];
+                leaves++;
+                if(depth[n] > max_depth)
+                    max_depth = depth[n];
+            } else {
+                int in_set = (f->flags[n] & FOREST_FLAG_CATEGORICAL) ? 1 : 0;
+                depth[n+1] = depth[f->right[n]] = depth[n] + 1;
+                in_sets[n+1] = in_sets[f->right[n]] = in_sets[n] + in_set;
+            }
+        }
+        double avg_depth = sum_depth / leaves;
+        double avg_in_sets = sum_in_sets / leaves;
+        if_cost += 3.5 * (avg_depth - avg_in_sets) + 11 * avg_in_sets;
+        walk_cost += 2 + 6 * max_depth + 4 * avg_in_sets;
+    }
+    free(depth);
+    free(in_sets);
+    return walk_cost < if_cost;
+}
+/* static tables: constant arrays, masks of sets, forests */
+static void c_fast_enumerate_tables(node_t*node, state_t*s)
+{
+    array_t*table;
+    int t;
+    if(node->type == &node_lookup && (table = c_lookup_table(node))) {
+        constant_t c = float_array_constant(table);
+        c_fast_declare_array(s, "l", (long)node, CONSTANT_FLOAT, &c);
+        array_destroy(table);
+    } else if(node->type == &node_in && c_fast_set_input(node) >= 0) {
+        c_values_t values = c_fast_values(s, c_fast_set_input(node));
+        strf(s, "static const uint64_t m%x[%d] = {", (long)node, c_values_words(&values));
+        c_fast_write_mask(s, &values, node->child[1]->value.a);
+        strf(s, "};\n");
+        free(values.entries);
+        c_fast_enumerate_tables(node->child[0], s);
+    } else if(node->type == &node_forest) {
+        c_fast_write_forest(s, node->value.forest);
+    } else if(node->type == &node_zero_int_array) {
+        /* modified by the code, see c_fast_enumerate_scratch() */
+    } else if(node_is_array(node)) {
+        c_fast_declare_array(s, "a", (long)node->value.a, constant_array_subtype(&node->value), &node->value);
+    } else {
+        for(t=0;t<node->num_children;t++) {
+            c_fast_enumerate_tables(node->child[t], s);
+        }
+    }
+}
+static void c_fast_enumerate_scratch(node_t*node, state_t*s)
+{
+    if(node->type == &node_zero_int_array) {
+        c_enumerate_arrays(node, s);
+    } else {
+        int t;
+        for(t=0;t<node->num_children;t++) {
+            c_fast_enumerate_scratch(node->child[t], s);
+        }
+    }
+}
+/* for input numbers which are tested for sets of values */
+static bool* c_fast_categorical_inputs(model_t*model, state_t*s)
+{
+    int num_inputs = model->sig->num_inputs;
+    bool*categorical = calloc(num_inputs, sizeof(bool));
+    int t;
+    for(t=0;t<num_inputs;t++) {
+        c_values_t values = c_fast_values(s, t);
+        categorical[t] = values.num > 0;
+        free(values.entries);
+    }
+    return categorical;
+}
+/* fill x[] and c[] from the parameters (each followed by suffix) */
+static void c_fast_write_inputs(model_t*model, state_t*s, bool*categorical, const char*prefix, const char*suffix)
+{
+    int t;
+    for(t=0;t<model->sig->num_inputs;t++) {
+        strf(s, "%sx[%d] = ", prefix, t);
+        if(model_param_type(model, t) == CONSTANT_FLOAT) {
+            c_write_param_name(s, t);
+            strf(s, "%s;\n", suffix);
+        } else {
+            strf(s, "NAN;\n");
+        }
+        strf(s, "%sc[%d] = ", prefix, t);
+        if(categorical[t]) {
+            strf(s, "category%d(", t);
+            c_write_param_name(s, t);
+            strf(s, "%s);\n", suffix);
+        } else {
+            strf(s, "0;\n");
+        }
+    }
+}
+void c_fast_write_header(model_t*model, state_t*s)
+{
+    node_t*root = s->code;
+    int num_inputs = model->sig->num_inputs;
+    bool*categorical = c_fast_categorical_inputs(model, s);
+    int t;
+    c_write_functions(root, s);
+    if(node_has_child(root, &node_in) || node_has_child(root, &node_forest)) {
+        c_fast_write_function_in_set(s);
+    }
+    for(t=0;t<num_inputs;t++) {
+        if(categorical[t]) {
+            c_values_t values = c_fast_values(s, t);
+            c_fast_write_function_category(s, t, &values);
+            free(values.entries);
+        }
+    }
+    if(node_has_child(root, &node_forest)) {
+        c_fast_write_function_walk(s);
+    }
+    c_fast_enumerate_tables(root, s);
+
+    c_write_function_start(model, s);
+    c_fast_enumerate_scratch(root, s);
+    if(node_has_child(root, &node_forest)) {
+        /* the inputs, for walking the trees of forests */
+        strf(s, "float x[%d];\n", num_inputs);
+        strf(s, "int c[%d];\n", num_inputs);
+        c_fast_write_inputs(model, s, categorical, "", "");
+    }
+    free(categorical);
+}
+
+/* the forest, if the code is nothing else but a forest */
+static forest_t* c_fast_sole_forest(node_t*n)
+{
+    while((n->type == &node_block || n->type == &node_return) && n->num_children == 1) {
+        n = n->child[0];
+    }
+    return n->type == &node_forest ? n->value.forest : NULL;
+}
+void c_fast_write_footer(model_t*model, state_t*s)
+{
+    forest_t*f = c_fast_sole_forest(s->code);
+    if(!f) {
+        c_write_footer(model, s);
+        return;
+    }
+    int num_inputs = model->sig->num_inputs;
+    bool*categorical = c_fast_categorical_inputs(model, s);
+    dedent(s);
+    strf(s, "\n}\n");
+
+    c_write_predict_n_start(model, s);
+    strf(s, "    float rows_x[%d];\n", (ROW_TILE + TREE_GROUP) * num_inputs);
+    strf(s, "    int rows_c[%d];\n", (ROW_TILE + TREE_GROUP) * num_inputs);
+    strf(s, "    int result[%d];\n", ROW_TILE);
+    strf(s, "    int i, r;\n");
+    strf(s, "    for(i=0;i<count;i+=%d) {\n", ROW_TILE);
+    strf(s, "        int num = count-i < %d ? count-i : %d;\n", ROW_TILE, ROW_TILE);
+    strf(s, "        for(r=0;r<num;r++) {\n");
+    strf(s, "            float*x = &rows_x[r*%d];\n", num_inputs);
+    strf(s, "            int*c = &rows_c[r*%d];\n", num_inputs);
+    c_fast_write_inputs(model, s, categorical, "            ", "[i+r]");
+    strf(s, "        }\n");
+    strf(s, "        /* rows walked along with the last ones */\n");
+    strf(s, "        memset(&rows_x[num*%d], 0, sizeof(float)*%d*%d);\n", num_inputs, TREE_GROUP, num_inputs);
+    strf(s, "        memset(&rows_c[num*%d], 0, sizeof(int)*%d*%d);\n", num_inputs, TREE_GROUP, num_inputs);
+    strf(s, "        forest%x_rows(rows_x, rows_c, num, result);\n", (long)f);
+    strf(s, "        for(r=0;r<num;r++) {\n");
+    strf(s, "            out[i+r] = classes%x[result[r]];\n", (long)f);
+    strf(s, "        }\n");
+    strf(s, "    }\n");
+    strf(s, "}\n");
+    free(categorical);
+}
+
+codegen_t codegen_c_fast = {
+#define NODE(opcode, name) write_##name: c_write_##name,
+LIST_NODES
+#undef NODE
+    write_node_in: c_fast_write_node_in,
+    write_node_forest: c_fast_write_node_forest,
+    write_header: c_fast_write_header,
+    write_footer: c_fast_write_footer,
+    writes_forest: c_fast_writes_forest,
+};
@@ -319,6 +319,41 @@ void js_write_node_return(node_t*n, state_t*s)
     strf(s, "return ");
     write_node(s, n->child[0]);
 }
+void js_write_node_forest(node_t*n, state_t*s)
+{
+    /* forests are expanded by generate_code() */
+    assert(0);
+}
+void js_write_node_lookup(node_t*n, state_t*s)
+{
+    array_t*keys = n->child[1]->value.a;
+    array_t*values = n->child[2]->value.a;
+    /* no prototype, so that keys like "toString" don't match */
+    strf(s, "({__proto__:null");
+    int t;
+    for(t=0;t<keys->size;t++) {
+        strf(s, ",");
+        js_write_constant(&keys->entries[t], s);
+        strf(s, ":");
+        js_write_constant(&values->entries[t], s);
+    }
+    strf(s, "}[");
+    write_node(s, n->child[0]);
+    strf(s, "]||0.0)");
+}
+void js_write_node_dot(node_t*n, state_t*s)
+{
+    array_t*weights = n->child[0]->value.a;
+    strf(s, "(");
+    int t;
+    for(t=0;t<weights->size;t++) {
+        if(t) strf(s, "+");
+        js_write_constant(&weights->entries[t], s);
+        strf(s, "*");
+        write_node(s, n->child[t+1]);
+    }
+    strf(s, ")");
+}
 void js_write_node_brackets(node_t*n, state_t*s)
 {
     strf(s, "(");
@@ -335,7 +370,7 @@ static void js_write_function_arg_max(state_t*s, char*suffix, char*type)
 }
 void js_write_header(model_t*model, state_t*s)
 {
-    node_t*root = (node_t*)model->code;
+    node_t*root = s->code;
     constant_type_t type = node_type(root, model);
 
     if(node_has_child(root, &node_arg_max) ||
@@ -357,7 +392,7 @@ void js_write_header(model_t*model, state_t*s)
 }
 void js_write_footer(model_t*model, state_t*s)
 {
-    node_t*root = model->code;
+    node_t*root = s->code;
     dedent(s);
     strf(s, "\n}\n");
 }
@@ -19,6 +19,7 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
 
+#include <assert.h>
 #include "codegen.h"
 
 void python_write_node_block(node_t*n, state_t*s)
@@ -302,6 +303,40 @@ void python_write_node_return(node_t*n, state_t*s)
     strf(s, "return ");
     write_node(s, n->child[0]);
 }
+void python_write_node_forest(node_t*n, state_t*s)
+{
+    /* forests are expanded by generate_code() */
+    assert(0);
+}
+void python_write_node_lookup(node_t*n, state_t*s)
+{
+    array_t*keys = n->child[1]->value.a;
+    array_t*values = n->child[2]->value.a;
+    strf(s, "{");
+    int t;
+    for(t=0;t<keys->size;t++) {
+        if(t) strf(s, ",");
+        python_write_constant(&keys->entries[t], s);
+        strf(s, ":");
+        python_write_constant(&values->entries[t], s);
+    }
+    strf(s, "}.get(");
+    write_node(s, n->child[0]);
+    strf(s, ",0.0)");
+}
+void python_write_node_dot(node_t*n, state_t*s)
+{
+    array_t*weights = n->child[0]->value.a;
+    strf(s, "(");
+    int t;
+    for(t=0;t<weights->size;t++) {
+        if(t) strf(s, "+");
+        python_write_constant(&weights->entries[t], s);
+        strf(s, "*");
+        write_node(s, n->child[t+1]);
+    }
+    strf(s, ")");
+}
 void python_write_node_brackets(node_t*n, state_t*s)
 {
     strf(s, "(");
@@ -313,7 +348,7 @@ void python_write_header(model_t*model, state_t*s)
     strf(s, "def predict(");
     if(s->model->sig->has_column_names) {
         int t;
-        node_t*root = (node_t*)model->code;
+        node_t*root = s->code;
         for(t=0;t<model->sig->num_inputs;t++) {
             if(t) strf(s, ", ");
             strf(s, "%s", s->model->sig->column_names[t]);
@@ -0,0 +1 @@
+#define HAVE_ZLIB 1
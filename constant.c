@@ -26,9 +26,10 @@
 #include <string.h>
 #include "constant.h"
 #include "stringpool.h"
+#include "forest.h"
 
 char*type_name[] = {"undefined","float","category","int","bool","missing","deprecated array","string",
-                    "int_array", "float_array", "category_array", "string_array", "mixed_array"};
+                    "int_array", "float_array", "category_array", "string_array", "mixed_array", "forest"};
 
 
 array_t* array_new(int size)
@@ -97,7 +98,7 @@ unsigned int constant_hash(const constant_t*o)
         case CONSTANT_BOOL:
             return hash_block(&o->b, sizeof(o->b));
         case CONSTANT_STRING:
-            return hash_block(&o->s, strlen(o->s));
+            return hash_block(o->s, strlen(o->s));
         case CONSTANT_MISSING:
             return 0;
         default:
@@ -227,6 +228,13 @@ constant_t string_constant(const char*s)
     v.s = register_string(s);
     return v;
 }
+constant_t forest_constant(forest_t*f)
+{
+    constant_t v;
+    v.type = CONSTANT_FOREST;
+    v.forest = f;
+    return v;
+}
 void constant_print(constant_t*v)
 {
     int t;
@@ -263,6 +271,9 @@ void constant_print(constant_t*v)
             }
             printf("]");
         break;
+        case CONSTANT_FOREST:
+            forest_print(v->forest);
+        break;
         default:
             printf("<bad value>");
         break;
@@ -284,6 +295,10 @@ void constant_clear(constant_t*v)
             //free(v->s);
             v->s = 0;
         break;
+        case CONSTANT_FOREST:
+            forest_destroy(v->forest);
+            v->forest = 0;
+        break;
     }
 }
 
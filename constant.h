@@ -33,6 +33,7 @@ extern "C" {
 
 typedef struct _constant constant_t;
 typedef struct _array array_t;
+struct _forest;
 
 typedef enum constant_type {
     CONSTANT_FLOAT=1,
@@ -46,6 +47,7 @@ typedef enum constant_type {
     CONSTANT_CATEGORY_ARRAY=10,
     CONSTANT_STRING_ARRAY=11,
     CONSTANT_MIXED_ARRAY=12,
+    CONSTANT_FOREST=13,
 } constant_type_t;
 
 extern char*type_name[];
@@ -58,6 +60,7 @@ struct _constant {
 	bool b;
         array_t* a;
         const char* s;
+        struct _forest* forest;
     };
     uint8_t type;
 };
@@ -75,6 +78,7 @@ constant_t string_array_constant(array_t*a);
 constant_t mixed_array_constant(array_t*a);
 constant_t category_array_constant(array_t*a);
 constant_t string_constant(const char*s);
+constant_t forest_constant(struct _forest*f);
 
 bool constant_equals(const constant_t*c1, const constant_t*c2);
 void constant_print(constant_t*v);
@@ -107,6 +111,7 @@ variable_t constant_to_variable(constant_t* c);
 #define AS_MIXED_ARRAY(v) (CONSTANT_CHECK_TYPE((v),CONSTANT_MIXED_ARRAY),(v).a)
 #define AS_ARRAY(v) (CONSTANT_CHECK_TYPE((v),CONSTANT_MIXED_ARRAY),(v).a)
 #define AS_STRING(v) (CONSTANT_CHECK_TYPE((v),CONSTANT_STRING),(v).s)
+#define AS_FOREST(v) (CONSTANT_CHECK_TYPE((v),CONSTANT_FOREST),(v).forest)
 
 #ifdef __cplusplus
 }
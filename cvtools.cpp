@@ -19,6 +19,7 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
 
+#include <pthread.h>
 #include "cvtools.h"
 #include "dataset.h"
 #include "model_select.h"
@@ -42,6 +43,11 @@ float cvmGetF(const CvMat*m, int y, int x)
     return CV_MAT_ELEM((*m), float, y, x);
 }
 
+void reset_random_number_generator()
+{
+    cv::theRNG() = cv::RNG();
+}
+
 CvMLDataFromExamples::CvMLDataFromExamples(dataset_t*dataset)
     :CvMLData()
 {
@@ -90,6 +96,188 @@ CvMLDataFromExamples::~CvMLDataFromExamples()
 {
 }
 
+/* Everything in here is built under the lock, the first time a model
+   asks for it, and never written to again. Models read it without
+   locking. */
+typedef struct _cv_cache {
+    pthread_mutex_t mutex;
+
+    /* for the tree models, column-major */
+    bool have_columns;
+    CvMat columns;
+    CvMat column_responses;
+    CvMat*column_var_types;
+    CvMat*column_var_idx;
+    CvMat*train_sample_idx;
+    uint64 columns_rng_state;
+
+    /* for the tree models, row-major */
+    CvMLDataFromExamples*data;
+    const CvMat*responses;
+    const CvMat*var_types;
+    const CvMat*var_idx;
+    uint64 rng_state;
+
+    /* for the svm, ann and linear models. Covers the training rows. */
+    int multicolumn_rows;
+    CvMat*multicolumn_in;
+    CvMat*multicolumn_out;
+    CvMat*multicolumn_out_per_class;
+} cv_cache_t;
+
+static pthread_mutex_t cv_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static cv_cache_t* cv_cache_get(dataset_t*d)
+{
+    pthread_mutex_lock(&cv_cache_mutex);
+    if(!d->cv_cache) {
+        d->cv_cache = (cv_cache_t*)calloc(1, sizeof(cv_cache_t));
+        pthread_mutex_init(&d->cv_cache->mutex, 0);
+        d->cv_cache->multicolumn_rows = training_set_size(d->num_rows);
+    }
+    cv_cache_t*c = d->cv_cache;
+    pthread_mutex_unlock(&cv_cache_mutex);
+    return c;
+}
+
+void dataset_cv_cache_destroy(dataset_t*d)
+{
+    cv_cache_t*c = d->cv_cache;
+    if(!c)
+        return;
+    delete c->data;
+    cvReleaseMat(&c->column_var_types);
+    cvReleaseMat(&c->column_var_idx);
+    cvReleaseMat(&c->train_sample_idx);
+    cvReleaseMat(&c->multicolumn_in);
+    cvReleaseMat(&c->multicolumn_out);
+    cvReleaseMat(&c->multicolumn_out_per_class);
+    pthread_mutex_destroy(&c->mutex);
+    free(c);
+    d->cv_cache = 0;
+}
+
+/* the same random choice of training rows that CvMLDataFromExamples makes */
+static CvMat* pick_train_sample_idx(int num_rows)
+{
+    int train_sample_count = training_set_size(num_rows);
+    if(train_sample_count <= 0 || train_sample_count >= num_rows)
+        return 0;
+    int*sample_idx = (int*)malloc(sizeof(int)*num_rows);
+    int i;
+    for(i=0;i<num_rows;i++) {
+        sample_idx[i] = i;
+    }
+    cv::RNG&rng = cv::theRNG();
+    for(i=0;i<num_rows;i++) {
+        int a = rng((unsigned)num_rows);
+        int b = rng((unsigned)num_rows);
+        int t;
+        CV_SWAP(sample_idx[a], sample_idx[b], t);
+    }
+    CvMat*idx = cvCreateMat(1, train_sample_count, CV_32SC1);
+    memcpy(idx->data.i, sample_idx, sizeof(int)*train_sample_count);
+    free(sample_idx);
+    return idx;
+}
+
+/* Every variable of the matrix is a slot of the dataset's column block.
+   Only the slots holding continuous columns, or the float version of
+   categorical columns, are used, so the variables OpenCV trains on are
+   still our columns, in order. */
+static void cv_cache_build_columns(cv_cache_t*c, dataset_t*d)
+{
+    cvInitMatHeader(&c->columns, d->num_slots, d->num_rows, CV_32FC1,
+                    (char*)d->column_block + offsetof(column_t, entries), d->column_stride);
+
+    c->column_var_types = cvCreateMat(1, d->num_columns+1, CV_8UC1);
+    c->column_var_idx = cvCreateMat(1, d->num_columns, CV_32SC1);
+    int t;
+    for(t=0;t<d->num_columns;t++) {
+        int slot = dataset_column_slot(d, d->columns[t]);
+        if(d->columns[t]->is_categorical) {
+            c->column_var_types->data.ptr[t] = CV_VAR_CATEGORICAL;
+            slot++;
+        } else {
+            c->column_var_types->data.ptr[t] = CV_VAR_ORDERED;
+        }
+        c->column_var_idx->data.i[t] = slot;
+    }
+    c->column_var_types->data.ptr[d->num_columns] = CV_VAR_CATEGORICAL;
+    cvGetRow(&c->columns, &c->column_responses, dataset_column_slot(d, d->desired_response)+1);
+
+    c->train_sample_idx = pick_train_sample_idx(d->num_rows);
+    c->columns_rng_state = cv::theRNG().state;
+    c->have_columns = true;
+}
+
+CvDatasetView::CvDatasetView(dataset_t*dataset, bool row_major)
+{
+    /* The training rows are picked randomly. The cached choice was made
+       with a freshly reset random number generator, so we can only use
+       it if ours is fresh, too (as it is for every model trained through
+       train_model()). */
+    tflag = CV_ROW_SAMPLE;
+    if(cv::theRNG().state != cv::RNG().state) {
+        data = new CvMLDataFromExamples(dataset);
+        values = data->get_values();
+        responses = data->get_responses();
+        missing = data->get_missing();
+        var_types = data->get_var_types();
+        var_idx = data->get_var_idx();
+        train_sample_idx = data->get_train_sample_idx();
+        return;
+    }
+    data = 0;
+
+    cv_cache_t*c = cv_cache_get(dataset);
+    if(dataset->column_block && !row_major) {
+        pthread_mutex_lock(&c->mutex);
+        if(!c->have_columns) {
+            cv_cache_build_columns(c, dataset);
+        }
+        pthread_mutex_unlock(&c->mutex);
+        cv::theRNG().state = c->columns_rng_state;
+
+        tflag = CV_COL_SAMPLE;
+        values = &c->columns;
+        responses = &c->column_responses;
+        missing = 0;
+        var_types = c->column_var_types;
+        var_idx = c->column_var_idx;
+        train_sample_idx = c->train_sample_idx;
+        return;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    if(!c->data) {
+        c->data = new CvMLDataFromExamples(dataset);
+        /* these build their result on first call */
+        c->responses = c->data->get_responses();
+        c->var_types = c->data->get_var_types();
+        c->var_idx = c->data->get_var_idx();
+        c->rng_state = cv::theRNG().state;
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    /* leave the random number generator where picking the training
+       rows would have left it, so that models don't depend on whether
+       the conversion was cached */
+    cv::theRNG().state = c->rng_state;
+
+    values = c->data->get_values();
+    responses = c->responses;
+    missing = c->data->get_missing();
+    var_types = c->var_types;
+    var_idx = c->var_idx;
+    train_sample_idx = c->data->get_train_sample_idx();
+}
+
+CvDatasetView::~CvDatasetView()
+{
+    delete data;
+}
+
 int cvmat_get_max_index(CvMat*mat)
 {
     assert(CV_MAT_TYPE(mat->type) == CV_32FC1);
@@ -211,26 +399,93 @@ int count_multiclass_columns(dataset_t*d)
     return width;
 }
 
-void make_ml_multicolumn(dataset_t*d, CvMat**in, CvMat**out, int num_rows, bool multicolumn_response)
+static CvMat* make_multicolumn_input(dataset_t*d, int num_rows)
 {
-    int x,y;
+    int x;
     int width = count_multiclass_columns(d);
-    *in = cvCreateMat(num_rows, width, CV_32FC1);
+    CvMat*in = cvCreateMat(num_rows, width, CV_32FC1);
     int xpos = 0;
     for(x=0;x<d->num_columns;x++) {
-        xpos += set_column_in_matrix(d->columns[x], *in, xpos, num_rows);
+        xpos += set_column_in_matrix(d->columns[x], in, xpos, num_rows);
     }
     assert(xpos == width);
+    return in;
+}
+
+static CvMat* make_multicolumn_response(dataset_t*d, int num_rows, bool multicolumn_response)
+{
+    CvMat*out;
     if(multicolumn_response) {
-        *out = cvCreateMat(num_rows, d->desired_response->num_classes, CV_32FC1);
-        set_column_in_matrix(d->desired_response, *out, 0, num_rows);
+        out = cvCreateMat(num_rows, d->desired_response->num_classes, CV_32FC1);
+        set_column_in_matrix(d->desired_response, out, 0, num_rows);
     } else {
-        *out = cvCreateMat(num_rows, 1, CV_32SC1);
+        out = cvCreateMat(num_rows, 1, CV_32SC1);
         int y;
         for(y=0;y<num_rows;y++) {
-            int32_t*e = (int32_t*)(CV_MAT_ELEM_PTR(**out, y, 0));
+            int32_t*e = (int32_t*)(CV_MAT_ELEM_PTR(*out, y, 0));
             *e =  d->desired_response->entries[y].c;
         }
     }
+    return out;
+}
+
+void make_ml_multicolumn(dataset_t*d, CvMat**in, CvMat**out, int num_rows, bool multicolumn_response)
+{
+    *in = make_multicolumn_input(d, num_rows);
+    *out = make_multicolumn_response(d, num_rows, multicolumn_response);
+}
+
+/* Build all of the cache up front. Models trained in forked children
+   fill only their own copy of it, so for those to share anything, the
+   parent has to do the work before it forks. */
+void dataset_cv_cache_fill(dataset_t*d)
+{
+    cv_cache_t*c = cv_cache_get(d);
+    /* everything is built from a freshly reset generator, like in
+       CvDatasetView, and the caller's generator is left alone */
+    uint64 state = cv::theRNG().state;
+    pthread_mutex_lock(&c->mutex);
+    if(d->column_block && !c->have_columns) {
+        cv::theRNG() = cv::RNG();
+        cv_cache_build_columns(c, d);
+    }
+    if(!c->data) {
+        cv::theRNG() = cv::RNG();
+        c->data = new CvMLDataFromExamples(d);
+        c->responses = c->data->get_responses();
+        c->var_types = c->data->get_var_types();
+        c->var_idx = c->data->get_var_idx();
+        c->rng_state = cv::theRNG().state;
+    }
+    if(!c->multicolumn_in) {
+        c->multicolumn_in = make_multicolumn_input(d, c->multicolumn_rows);
+    }
+    if(!c->multicolumn_out) {
+        c->multicolumn_out = make_multicolumn_response(d, c->multicolumn_rows, false);
+    }
+    if(!c->multicolumn_out_per_class) {
+        c->multicolumn_out_per_class = make_multicolumn_response(d, c->multicolumn_rows, true);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    cv::theRNG().state = state;
+}
+
+void cv_multicolumn_rows(dataset_t*d, CvMat*in, CvMat*out, int num_rows, bool multicolumn_response)
+{
+    cv_cache_t*c = cv_cache_get(d);
+    assert(num_rows <= c->multicolumn_rows);
+
+    pthread_mutex_lock(&c->mutex);
+    if(!c->multicolumn_in) {
+        c->multicolumn_in = make_multicolumn_input(d, c->multicolumn_rows);
+    }
+    CvMat**response = multicolumn_response ? &c->multicolumn_out_per_class : &c->multicolumn_out;
+    if(!*response) {
+        *response = make_multicolumn_response(d, c->multicolumn_rows, multicolumn_response);
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    cvGetRows(c->multicolumn_in, in, 0, num_rows);
+    cvGetRows(*response, out, 0, num_rows);
 }
 
@@ -42,6 +42,34 @@ class CvMLDataFromExamples: public CvMLData
     ~CvMLDataFromExamples();
 };
 
+/* The training data for the tree trainers. If the dataset's columns
+   are packed, this is a column-major view on them (tflag CV_COL_SAMPLE),
+   otherwise, or if row_major is set, what CvMLDataFromExamples would pass.
+   Either way, it's only set up once per dataset, and shared (read-only)
+   by all models trained on it, also by models that are trained at
+   the same time. */
+class CvDatasetView
+{
+    public:
+    CvDatasetView(dataset_t*dataset, bool row_major=false);
+    ~CvDatasetView();
+
+    int tflag;
+    const CvMat*values;
+    const CvMat*responses;
+    const CvMat*missing;
+    const CvMat*var_types;
+    const CvMat*var_idx;
+    const CvMat*train_sample_idx;
+
+    private:
+    CvMLDataFromExamples*data;
+};
+
+/* Like make_ml_multicolumn(), but in and out are views on matrices
+   that are shared between all models trained on the dataset */
+void cv_multicolumn_rows(dataset_t*d, CvMat*in, CvMat*out, int num_rows, bool multicolumn_response);
+
 CvMat*cvmat_from_row(dataset_t*dataset, row_t*row, bool expand_categories, bool add_one);
 int cvmat_get_max_index(CvMat*mat);
 void cvmat_print(CvMat*mat);
@@ -29,97 +29,6 @@
 #include "easy_ast.h"
 #include "stringpool.h"
 
-trainingdata_t* trainingdata_new()
-{
-    trainingdata_t*d = (trainingdata_t*)calloc(1,sizeof(trainingdata_t));
-    return d;
-}
-void trainingdata_add_example(trainingdata_t*d, example_t*e)
-{
-    e->prev = d->last_example;
-    if(d->last_example) {
-        d->last_example->next = e;
-    }
-    d->last_example = e;
-    e->next = 0;
-    if(!d->first_example) {
-        d->first_example = e;
-    }
-    d->num_examples++;
-}
-bool trainingdata_check_format(trainingdata_t*trainingdata)
-{
-    if(!trainingdata || !trainingdata->first_example)
-        return false;
-    int t;
-    example_t*e;
-    int pos = 0;
-    char has_names = 0;
-    char has_no_names = 0;
-    for(e=trainingdata->first_example;e;e=e->next) {
-        if(e->input_names)
-            has_names = 1;
-        if(!e->input_names)
-            has_no_names = 1;
-        if(has_names && has_no_names) {
-            fprintf(stderr, "Please specify examples as either arrays or as name->value mappings, but not both at once\n");
-            return false;
-        }
-        if(trainingdata->first_example->num_inputs != e->num_inputs) {
-            fprintf(stderr, "Bad configuration: row %d has %d inputs, row %d has %d.\n", t, trainingdata->first_example->num_inputs, 0, e->num_inputs);
-            return false;
-        }
-        int s;
-        for(s=0;s<e->num_inputs;s++) {
-            if(trainingdata->first_example->inputs[s].type != e->inputs[s].type) {
-                fprintf(stderr, "Bad configuration: item %d in row %d is %s, item %d in row %d is %s\n",
-                         s, pos, variable_type(&e->inputs[s]),
-                         s,   0, variable_type(&trainingdata->first_example->inputs[s])
-                        );
-                return false;
-            }
-        }
-        pos++;
-    }
-    return true;
-}
-void trainingdata_print(trainingdata_t*trainingdata)
-{
-    example_t*e;
-    for(e=trainingdata->first_example;e;e=e->next) {
-        int s;
-        for(s=0;s<e->num_inputs;s++) {
-            variable_t v = e->inputs[s];
-            if(e->input_names) {
-                printf("%s=", e->input_names[s]);
-            }
-            if(v.type == CATEGORICAL) {
-                printf("C%d\t", v.category);
-            } else if(v.type == CONTINUOUS) {
-                printf("%.2f\t", v.value);
-            } else if(v.type == TEXT) {
-                printf("\"%s\"\t", v.text);
-            }
-        }
-        if(e->desired_response.type == TEXT) {
-            printf("|\t\"%s\"", e->desired_response.text);
-        } else {
-            printf("|\tC%d", e->desired_response.category);
-        }
-        printf("\n");
-    }
-}
-void trainingdata_destroy(trainingdata_t*trainingdata)
-{
-    example_t*e = trainingdata->first_example;
-    while(e) {
-        example_t*next = e->next;
-        example_destroy(e);
-        e = next;
-    }
-    free(trainingdata);
-}
-
 column_t*column_new(int num_rows, bool is_categorical, int x)
 {
     column_t*c = calloc(1, sizeof(column_t)+sizeof(c->entries[0])*num_rows);
@@ -127,7 +36,7 @@ column_t*column_new(int num_rows, bool is_categorical, int x)
     c->index = x;
     return c;
 }
-void column_destroy(column_t*c)
+static void column_free_classes(column_t*c)
 {
     if(c->classes) {
         free(c->classes);
@@ -135,11 +44,18 @@ void column_destroy(column_t*c)
     if(c->class_occurence_count) {
         free(c->class_occurence_count);
     }
+}
+void column_destroy(column_t*c)
+{
+    column_free_classes(c);
     free(c);
 }
 
+/* a column of the training data, growing as rows are added */
 typedef struct _columnbuilder {
     column_t*column;
+    columntype_t type;
+    int size;
     int category_memsize;
     dict_t*string2pos;
     dict_t*int2pos;
@@ -154,6 +70,25 @@ columnbuilder_t*columnbuilder_new(column_t*column)
     builder->int2pos = dict_new(&int_type);
     return builder;
 }
+static columnbuilder_t*columnbuilder_new_growing(bool is_categorical, columntype_t type, int x)
+{
+    columnbuilder_t*builder = columnbuilder_new(column_new(0, is_categorical, x));
+    builder->type = type;
+    return builder;
+}
+static void columnbuilder_grow(columnbuilder_t*builder, int num_rows)
+{
+    if(num_rows <= builder->size)
+        return;
+    int size = builder->size ? builder->size : 64;
+    while(size < num_rows) {
+        size *= 2;
+    }
+    column_t*c = realloc(builder->column, sizeof(column_t)+sizeof(c->entries[0])*size);
+    memset(&c->entries[builder->size], 0, sizeof(c->entries[0])*(size - builder->size));
+    builder->column = c;
+    builder->size = size;
+}
 void columnbuilder_add(columnbuilder_t*builder, int y, constant_t e)
 {
     column_t*column = builder->column;
@@ -205,6 +140,14 @@ void columnbuilder_add(columnbuilder_t*builder, int y, constant_t e)
     column->class_occurence_count[pos]++;
     column->entries[y].c = pos;
 }
+static variable_t columnbuilder_get(columnbuilder_t*builder, int y)
+{
+    column_t*column = builder->column;
+    if(!column->is_categorical) {
+        return variable_new_continuous(column->entries[y].f);
+    }
+    return constant_to_variable(&column->classes[column->entries[y].c]);
+}
 void columnbuilder_destroy(columnbuilder_t*builder)
 {
     dict_destroy(builder->string2pos);
@@ -212,60 +155,192 @@ void columnbuilder_destroy(columnbuilder_t*builder)
     free(builder);
 }
 
-dict_t*extract_column_names(trainingdata_t*dataset)
+trainingdata_t* trainingdata_new()
+{
+    trainingdata_t*d = (trainingdata_t*)calloc(1,sizeof(trainingdata_t));
+    return d;
+}
+static int trainingdata_find_column(trainingdata_t*d, example_t*e, int s)
+{
+    if(!e->input_names)
+        return s;
+    if(!d->column_names)
+        return -1;
+    return PTR_TO_INT(dict_lookup(d->column_names, e->input_names[s])) - 1;
+}
+static bool trainingdata_check_example(trainingdata_t*d, example_t*e)
 {
-    dict_t*d = 0;
-    example_t*e = dataset->first_example;
-    int pos = 1;
-    while(e) {
+    int y = d->num_examples;
+    if(y && (e->input_names != 0) != (d->column_names != 0)) {
+        fprintf(stderr, "Please specify examples as either arrays or as name->value mappings, but not both at once\n");
+        return false;
+    }
+    if(y && d->num_inputs != e->num_inputs) {
+        fprintf(stderr, "Bad configuration: row %d has %d inputs, row %d has %d.\n", y, e->num_inputs, 0, d->num_inputs);
+        return false;
+    }
+    int num_columns = d->column_names ? dict_count(d->column_names) : 0;
+    int s;
+    for(s=0;s<e->num_inputs;s++) {
+        int x = trainingdata_find_column(d, e, s);
+        if(x < 0) {
+            if(++num_columns > e->num_inputs) {
+                fprintf(stderr, "Mixup between column names. (Row %d has a column \"%s\" the previous rows don't have).\n", y, e->input_names[s]);
+                return false;
+            }
+            continue;
+        }
+        columnbuilder_t*b = y ? d->columns[x] : 0;
+        if(b && b->type != e->inputs[s].type) {
+            variable_t first = {type: b->type};
+            fprintf(stderr, "Bad configuration: item %d in row %d is %s, item %d in row %d is %s\n",
+                     s, y, variable_type(&e->inputs[s]),
+                     x, 0, variable_type(&first));
+            return false;
+        }
+    }
+    return true;
+}
+void trainingdata_add_example(trainingdata_t*d, example_t*e)
+{
+    if(d->bad_format || !trainingdata_check_example(d, e)) {
+        d->bad_format = true;
+        example_destroy(e);
+        return;
+    }
+
+    int y = d->num_examples;
+    if(!y) {
+        d->num_inputs = e->num_inputs;
+        d->columns = calloc(e->num_inputs, sizeof(columnbuilder_t*));
+        d->desired_response = columnbuilder_new_growing(true, e->desired_response.type, -1);
+        if(e->input_names) {
+            d->column_names = dict_new(&charptr_type);
+        }
+    }
+    int s;
+    for(s=0;s<e->num_inputs;s++) {
+        int x = trainingdata_find_column(d, e, s);
+        if(x < 0) {
+            const char*name = register_string(e->input_names[s]);
+            x = dict_count(d->column_names);
+            dict_put(d->column_names, name, INT_TO_PTR(x + 1));
+            d->columns[x] = columnbuilder_new_growing(e->inputs[s].type!=CONTINUOUS, e->inputs[s].type, x);
+            d->columns[x]->column->name = name;
+        } else if(!d->columns[x]) {
+            d->columns[x] = columnbuilder_new_growing(e->inputs[s].type!=CONTINUOUS, e->inputs[s].type, x);
+        }
+        columnbuilder_grow(d->columns[x], y+1);
+        columnbuilder_add(d->columns[x], y, variable_to_constant(&e->inputs[s]));
+    }
+    columnbuilder_grow(d->desired_response, y+1);
+    columnbuilder_add(d->desired_response, y, variable_to_constant(&e->desired_response));
+    d->num_examples++;
+
+    example_destroy(e);
+}
+bool trainingdata_check_format(trainingdata_t*trainingdata)
+{
+    if(!trainingdata || !trainingdata->num_examples || trainingdata->bad_format)
+        return false;
+    int x;
+    for(x=0;x<trainingdata->num_inputs;x++) {
+        columnbuilder_t*b = trainingdata->columns[x];
+        if(!b || b->count != trainingdata->num_examples) {
+            fprintf(stderr, "Mixup between column names. (Column %d has only %d entries).\n", x, b ? b->count : 0);
+            return false;
+        }
+    }
+    return true;
+}
+/* reassemble row y. The caller frees the result with example_destroy(). */
+example_t* trainingdata_get_example(trainingdata_t*d, int y)
+{
+    example_t*e = example_new(d->num_inputs);
+    if(d->column_names) {
+        e->input_names = (const char**)malloc(sizeof(const char*)*d->num_inputs);
+    }
+    int x;
+    for(x=0;x<d->num_inputs;x++) {
+        e->inputs[x] = columnbuilder_get(d->columns[x], y);
         if(e->input_names) {
-            if(!d) {
-                d = dict_new(&charptr_type);
+            e->input_names[x] = d->columns[x]->column->name;
+        }
+    }
+    e->desired_response = columnbuilder_get(d->desired_response, y);
+    return e;
+}
+void trainingdata_print(trainingdata_t*trainingdata)
+{
+    int y;
+    for(y=0;y<trainingdata->num_examples;y++) {
+        example_t*e = trainingdata_get_example(trainingdata, y);
+        int s;
+        for(s=0;s<e->num_inputs;s++) {
+            variable_t v = e->inputs[s];
+            if(e->input_names) {
+                printf("%s=", e->input_names[s]);
             }
-            int x;
-            for(x=0;x<e->num_inputs;x++) {
-                const char*name = e->input_names[x];
-                if(!dict_lookup(d, name)) {
-                    dict_put(d, name, INT_TO_PTR(pos));
-                    pos++;
-                }
+            if(v.type == CATEGORICAL) {
+                printf("C%d\t", v.category);
+            } else if(v.type == CONTINUOUS) {
+                printf("%.2f\t", v.value);
+            } else if(v.type == TEXT) {
+                printf("\"%s\"\t", v.text);
             }
         }
-        e = e->next;
+        if(e->desired_response.type == TEXT) {
+            printf("|\t\"%s\"", e->desired_response.text);
+        } else {
+            printf("|\tC%d", e->desired_response.category);
+        }
+        printf("\n");
+        example_destroy(e);
     }
-    return d;
+}
+static void columnbuilder_destroy_all(columnbuilder_t*builder)
+{
+    if(builder) {
+        column_destroy(builder->column);
+        columnbuilder_destroy(builder);
+    }
+}
+void trainingdata_destroy(trainingdata_t*trainingdata)
+{
+    int x;
+    if(trainingdata->columns) {
+        for(x=0;x<trainingdata->num_inputs;x++) {
+            columnbuilder_destroy_all(trainingdata->columns[x]);
+        }
+        free(trainingdata->columns);
+    }
+    columnbuilder_destroy_all(trainingdata->desired_response);
+    if(trainingdata->column_names) {
+        dict_destroy(trainingdata->column_names);
+    }
+    free(trainingdata);
 }
 
 #define DATASET_SHUFFLE 1
 #define DATASET_EVEN_OUT_CLASS_COUNT 2
 
-example_t**example_list_to_array(trainingdata_t*d, int*_num_examples, int flags)
+/* pick the rows of the training data that go into the dataset, in
+   the order they go in */
+static int* trainingdata_pick_rows(trainingdata_t*d, int*_num_rows, int flags)
 {
     int pos = 0;
-    int num_examples = 0;
-    example_t**examples = 0;
+    int num_rows = 0;
+    int*rows = 0;
+    int y;
     if(!(flags&DATASET_EVEN_OUT_CLASS_COUNT)) {
-        example_t*i = d->first_example;
-        num_examples = d->num_examples;
-        examples = (example_t**)malloc(sizeof(example_t*)*num_examples);
-        while(i) {
-            examples[pos++] = i;
-            i = i->next;
+        num_rows = d->num_examples;
+        rows = (int*)malloc(sizeof(int)*num_rows);
+        for(y=0;y<num_rows;y++) {
+            rows[y] = y;
         }
     } else {
-        /* build a column out of the response column, thus making
-           the column build process count the classes for us */
-        int num_columns = d->first_example->num_inputs;
-        column_t*c = column_new(d->num_examples, true, -1);
-        columnbuilder_t*b = columnbuilder_new(c);
-        int y;
-        example_t*i = d->first_example;
-        for(y=0;y<d->num_examples;y++) {
-            columnbuilder_add(b,y,variable_to_constant(&i->desired_response));
-            i = i->next;
-        }
-        columnbuilder_destroy(b);
-
+        /* the response column already counted the classes for us */
+        column_t*c = d->desired_response->column;
         int t;
         int max = c->class_occurence_count[0];
         int*multiply = malloc(sizeof(int)*c->num_classes);
@@ -277,36 +352,60 @@ example_t**example_list_to_array(trainingdata_t*d, int*_num_examples, int flags)
         }
         for(t=0;t<c->num_classes;t++) {
             multiply[t] = max / c->class_occurence_count[t];
-            num_examples += multiply[t]*c->class_occurence_count[t];
-            assert(multiply);
+            num_rows += multiply[t]*c->class_occurence_count[t];
         }
-        examples = (example_t**)malloc(sizeof(example_t*)*num_examples);
-        i = d->first_example;
-        int pos = 0;
+        rows = (int*)malloc(sizeof(int)*num_rows);
         for(y=0;y<d->num_examples;y++) {
             int cls = c->entries[y].c;
-            int t;
             for(t=0;t<multiply[cls];t++) {
-                examples[pos++] = i;
+                rows[pos++] = y;
             }
-            i = i->next;
         }
-        assert(pos == num_examples);
+        assert(pos == num_rows);
         free(multiply);
-        column_destroy(c);
     }
 
     if(flags&DATASET_SHUFFLE) {
         int t;
-        for(t=0;t<num_examples;t++) {
-            example_t*old = examples[t];
-            int from = t+lrand48()%(num_examples-t);
-            examples[t] = examples[from];
-            examples[from] = old;
+        for(t=0;t<num_rows;t++) {
+            int old = rows[t];
+            int from = t+lrand48()%(num_rows-t);
+            rows[t] = rows[from];
+            rows[from] = old;
         }
     }
-    *_num_examples = num_examples;
-    return examples;
+    *_num_rows = num_rows;
+    return rows;
+}
+
+/* copy the given rows of a training data column into a new column,
+   numbering the categories in the order they now appear in */
+static column_t* column_pick_rows(column_t*src, int*rows, int num_rows, int x)
+{
+    column_t*c = column_new(num_rows, src->is_categorical, x);
+    c->name = src->name;
+    int y;
+    if(!c->is_categorical) {
+        for(y=0;y<num_rows;y++) {
+            c->entries[y].f = src->entries[rows[y]].f;
+        }
+        return c;
+    }
+    int*map = malloc(sizeof(int)*src->num_classes);
+    memset(map, -1, sizeof(int)*src->num_classes);
+    c->classes = malloc(sizeof(constant_t)*src->num_classes);
+    c->class_occurence_count = calloc(src->num_classes, sizeof(c->class_occurence_count[0]));
+    for(y=0;y<num_rows;y++) {
+        int cls = src->entries[rows[y]].c;
+        if(map[cls] < 0) {
+            map[cls] = c->num_classes++;
+            c->classes[map[cls]] = src->classes[cls];
+        }
+        c->entries[y].c = map[cls];
+        c->class_occurence_count[map[cls]]++;
+    }
+    free(map);
+    return c;
 }
 
 signature_t* signature_from_columns(column_t**columns, int num_columns, bool has_column_names)
@@ -334,72 +433,30 @@ signature_t* signature_from_columns(column_t**columns, int num_columns, bool has
 
 dataset_t* dataset_sanitize(trainingdata_t*dataset)
 {
-    dataset_t*s = malloc(sizeof(dataset_t));
-
     if(!trainingdata_check_format(dataset))
         return 0;
 
-    dict_t*column_names = extract_column_names(dataset);
-
-    int num_examples = 0;
-    example_t** examples = example_list_to_array(dataset, &num_examples,
+    int num_rows = 0;
+    int*rows = trainingdata_pick_rows(dataset, &num_rows,
                                       DATASET_SHUFFLE | DATASET_EVEN_OUT_CLASS_COUNT
                                       );
 
-    s->num_columns = dataset->first_example->num_inputs;
-    s->num_rows = num_examples;
+    dataset_t*s = calloc(1, sizeof(dataset_t));
+    s->num_columns = dataset->num_inputs;
+    s->num_rows = num_rows;
     s->columns = malloc(sizeof(column_t)*s->num_columns);
-    example_t*first_row = dataset->first_example;
 
-    /* copy columns from the old to the new dataset, mapping categories
-       to numbers. */
-    int x,y;
-    columnbuilder_t**builders = malloc(sizeof(columnbuilder_t*)*s->num_columns);
-    for(x=0;x<s->num_columns;x++) {
-        columntype_t ltype = first_row->inputs[x].type;
-        bool is_categorical = ltype!=CONTINUOUS;
-        s->columns[x] = column_new(s->num_rows, is_categorical, x);
-        builders[x] = columnbuilder_new(s->columns[x]);
-    }
-    example_t*example = dataset->first_example;
-    for(y=0;y<num_examples;y++) {
-        example_t*example = examples[y];
-        for(x=0;x<s->num_columns;x++) {
-            int col = x;
-            if(example->input_names) {
-                col = PTR_TO_INT(dict_lookup(column_names,example->input_names[x]))-1;
-            }
-            variable_t*var = &example->inputs[x];
-            columnbuilder_add(builders[col],y,variable_to_constant(var));
-        }
-    }
+    /* copy columns from the training data to the dataset, renumbering
+       categories in the order of the (shuffled) rows */
+    int x;
     for(x=0;x<s->num_columns;x++) {
-        if(builders[x]->count != s->num_rows) {
-            fprintf(stderr, "Mixup between column names. (Column %d has only %d entries).\n", x, builders[x]->count);
-        }
-        columnbuilder_destroy(builders[x]);
-    }
-    free(builders);
-
-    /* copy response column to the new dataset */
-    s->desired_response = column_new(s->num_rows, true, -1);
-    columnbuilder_t*builder = columnbuilder_new(s->desired_response);
-    for(y=0;y<num_examples;y++) {
-        example_t*example = examples[y];
-        columnbuilder_add(builder,y,variable_to_constant(&example->desired_response));
+        s->columns[x] = column_pick_rows(dataset->columns[x]->column, rows, num_rows, x);
     }
-    columnbuilder_destroy(builder);
-    free(examples);
+    s->desired_response = column_pick_rows(dataset->desired_response->column, rows, num_rows, -1);
+    free(rows);
 
-    bool has_column_names = false;
-    if(column_names) {
-        DICT_ITERATE_ITEMS(column_names, char*, name, void*, _column) {
-            int column = PTR_TO_INT(_column)-1;
-            s->columns[column]->name = register_string(name);
-        }
-        dict_destroy(column_names);
-        has_column_names = 1;
-    } else {
+    bool has_column_names = dataset->column_names != 0;
+    if(!has_column_names) {
         for(x=0;x<s->num_columns;x++) {
             char name[80];
             sprintf(name, "data[%d]", x);
@@ -407,6 +464,7 @@ dataset_t* dataset_sanitize(trainingdata_t*dataset)
         }
     }
     s->sig = signature_from_columns(s->columns, s->num_columns, has_column_names);
+    dataset_pack_columns(s);
     return s;
 }
 void dataset_print(dataset_t*s)
@@ -466,11 +524,77 @@ constant_t dataset_map_response_class(dataset_t*dataset, int i)
 void dataset_destroy(dataset_t*s)
 {
     int t;
-    for(t=0;t<s->num_columns;t++) {
-        column_destroy(s->columns[t]);
+    if(s->column_block) {
+        for(t=0;t<s->num_columns;t++) {
+            column_free_classes(s->columns[t]);
+        }
+        column_free_classes(s->desired_response);
+        free(s->column_block);
+    } else {
+        for(t=0;t<s->num_columns;t++) {
+            column_destroy(s->columns[t]);
+        }
+        column_destroy(s->desired_response);
     }
     free(s->columns);
-    column_destroy(s->desired_response);
+    dataset_cv_cache_destroy(s);
+    free(s);
+}
+
+static column_t* column_move_to_slot(column_t*c, int num_rows, char*slot, int stride)
+{
+    column_t*n = (column_t*)slot;
+    memcpy(n, c, sizeof(column_t)+sizeof(c->entries[0])*num_rows);
+    free(c);
+    if(n->is_categorical) {
+        column_t*copy = (column_t*)(slot + stride);
+        memset(copy, 0, sizeof(column_t));
+        int y;
+        for(y=0;y<num_rows;y++) {
+            copy->entries[y].f = n->entries[y].c;
+        }
+    }
+    return n;
+}
+
+/* Move the columns of a freshly built dataset into one block (see
+   dataset_t). Every column is freed as soon as it has been moved, so
+   this needs little more memory than the dataset itself. */
+void dataset_pack_columns(dataset_t*d)
+{
+    int stride = sizeof(column_t)+sizeof(d->columns[0]->entries[0])*d->num_rows;
+    stride = (stride + 15) & ~15;
+
+    int num_slots = 2; // response, and its categories as floats
+    int t;
+    for(t=0;t<d->num_columns;t++) {
+        num_slots += d->columns[t]->is_categorical ? 2 : 1;
+    }
+    char*block = malloc((size_t)stride*num_slots);
+    if(!block) {
+        return;
+    }
+    char*slot = block;
+    for(t=0;t<d->num_columns;t++) {
+        d->columns[t] = column_move_to_slot(d->columns[t], d->num_rows, slot, stride);
+        slot += d->columns[t]->is_categorical ? 2*stride : stride;
+    }
+    d->desired_response = column_move_to_slot(d->desired_response, d->num_rows, slot, stride);
+
+    d->column_block = block;
+    d->column_stride = stride;
+    d->num_slots = num_slots;
+}
+
+int dataset_column_slot(dataset_t*d, column_t*c)
+{
+    return ((char*)c - (char*)d->column_block) / d->column_stride;
+}
+
+/* free a dataset returned by dataset_pick_columns() or dataset_first_rows() */
+void dataset_view_destroy(dataset_t*s)
+{
+    dataset_cv_cache_destroy(s);
     free(s);
 }
 
@@ -543,6 +667,47 @@ node_t* expanded_columns_parameter_code(expanded_columns_t*e, int num)
         return program;
     }
 }
+/* Append weights[0]*column 0 + weights[1]*column 1 + ... to the children
+   of sum, which is an add node. The continuous columns are multiplied in
+   a single dot product. One-hot encoded categories stay separate terms,
+   so that node_fuse_one_hot() can turn them into a lookup. */
+void expanded_columns_append_dot(expanded_columns_t*e, node_t*sum, const float*weights)
+{
+    int num = 0;
+    int t;
+    for(t=0;t<e->num;t++) {
+        if(!e->dataset->columns[e->columns[t].source_column]->is_categorical && weights[t])
+            num++;
+    }
+    if(num) {
+        array_t*a = array_new(num);
+        num = 0;
+        for(t=0;t<e->num;t++) {
+            if(!e->dataset->columns[e->columns[t].source_column]->is_categorical && weights[t]) {
+                a->entries[num++] = float_constant(weights[t]);
+            }
+        }
+        node_t*dot = node_new(&node_dot, sum);
+        node_append_child(dot, node_new_array(a));
+        for(t=0;t<e->num;t++) {
+            if(!e->dataset->columns[e->columns[t].source_column]->is_categorical && weights[t]) {
+                node_append_child(dot, expanded_columns_parameter_code(e, t));
+            }
+        }
+        node_append_child(sum, dot);
+    }
+    for(t=0;t<e->num;t++) {
+        if(e->dataset->columns[e->columns[t].source_column]->is_categorical) {
+            node_t*mul = node_new(&node_mul, sum);
+            node_append_child(mul, expanded_columns_parameter_code(e, t));
+            node_append_child(mul, node_new_with_args(&node_float, (double)weights[t]));
+            node_append_child(sum, mul);
+        }
+    }
+    if(!sum->num_children) {
+        node_append_child(sum, node_new_with_args(&node_float, 0.0));
+    }
+}
 void expanded_columns_destroy(expanded_columns_t*e)
 {
     free(e->columns);
@@ -574,11 +739,36 @@ void dataset_fill_row(dataset_t*s, row_t*row, int y)
         }
     }
 }
+void dataset_fill_rows(dataset_t*s, row_t**rows, int start, int num)
+{
+    int x,y;
+    for(y=0;y<num;y++) {
+        row_t*row = rows[y];
+        for(x=0;x<row->num_inputs;x++) {
+            row->inputs[x].type = MISSING;
+        }
+    }
+    /* go through the data column by column */
+    for(x=0;x<s->num_columns;x++) {
+        column_t*c = s->columns[x];
+        int index = c->index;
+        if(c->is_categorical) {
+            for(y=0;y<num;y++) {
+                rows[y]->inputs[index] = constant_to_variable(&c->classes[c->entries[start+y].c]);
+            }
+        } else {
+            for(y=0;y<num;y++) {
+                rows[y]->inputs[index] = variable_new_continuous(c->entries[start+y].f);
+            }
+        }
+    }
+}
 
 model_t* model_new(dataset_t*dataset)
 {
     model_t*m = (model_t*)calloc(1,sizeof(model_t));
     m->sig = dataset->sig;
+    m->num_locals = -1;
 
     return m;
 }
@@ -588,6 +778,8 @@ dataset_t* dataset_pick_columns(dataset_t*data, int*index, int num)
     dataset_t*newdata = malloc(sizeof(dataset_t)+sizeof(column_t*)*num);
     memcpy(newdata, data, sizeof(dataset_t));
     newdata->num_columns = num;
+    newdata->column_block = 0;
+    newdata->cv_cache = 0;
     newdata->columns = (column_t**)(&newdata[1]);
     int t;
     for(t=0;t<num;t++) {
@@ -596,4 +788,14 @@ dataset_t* dataset_pick_columns(dataset_t*data, int*index, int num)
     return newdata;
 }
 
-
+/* Like dataset_pick_columns(), the result shares its columns with
+   the original dataset, and is freed with dataset_view_destroy(). */
+dataset_t* dataset_first_rows(dataset_t*data, int num)
+{
+    dataset_t*newdata = malloc(sizeof(dataset_t));
+    memcpy(newdata, data, sizeof(dataset_t));
+    newdata->cv_cache = 0;
+    if(num < newdata->num_rows)
+        newdata->num_rows = num;
+    return newdata;
+}
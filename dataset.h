@@ -32,6 +32,7 @@ extern "C" {
 
 struct _column;
 typedef struct _column column_t;
+struct _cv_cache;
 
 typedef struct _dataset {
 
@@ -42,6 +43,19 @@ typedef struct _dataset {
     column_t**columns;
 
     column_t*desired_response;
+
+    /* If set, the columns (and, last, the response) are stored in this
+       one block, as slots of column_stride bytes each. A categorical
+       column is followed by a slot holding its categories as floats.
+       The block is thus one column-major float matrix, which OpenCV
+       can train on directly (see dataset_pack_columns()). */
+    void*column_block;
+    int column_stride;
+    int num_slots;
+
+    /* OpenCV versions of the data, built when a model first needs
+       them (see cvtools.cpp) */
+    struct _cv_cache*cv_cache;
 } dataset_t;
 
 struct _column {
@@ -62,11 +76,18 @@ struct _column {
 };
 
 dataset_t* dataset_sanitize(trainingdata_t*dataset);
+signature_t* signature_from_columns(column_t**columns, int num_columns, bool has_column_names);
 void dataset_print(dataset_t*s);
 constant_t dataset_map_response_class(dataset_t*dataset, int i);
 void dataset_destroy(dataset_t*dataset);
+void dataset_view_destroy(dataset_t*dataset);
+void dataset_pack_columns(dataset_t*dataset);
+int dataset_column_slot(dataset_t*dataset, column_t*column);
+void dataset_cv_cache_destroy(dataset_t*dataset);
+void dataset_cv_cache_fill(dataset_t*dataset);
 int dataset_count_expanded_columns(dataset_t*s);
 dataset_t* dataset_pick_columns(dataset_t*data, int*index, int num);
+dataset_t* dataset_first_rows(dataset_t*data, int num);
 bool dataset_has_categorical_columns(dataset_t*data);
 
 /* structure for storing "exploded" version of columns where every class
@@ -84,15 +105,16 @@ typedef struct _expanded_columns {
 expanded_columns_t* expanded_columns_new(dataset_t*s);
 node_t* expanded_columns_parameter_init(expanded_columns_t*e);
 node_t* expanded_columns_parameter_code(expanded_columns_t*e, int num);
+void expanded_columns_append_dot(expanded_columns_t*e, node_t*sum, const float*weights);
 void expanded_columns_destroy(expanded_columns_t*e);
 
 column_t*column_new(int num_rows, bool is_categorical, int x);
 
 model_t* model_new(dataset_t*dataset);
-example_t**example_list_to_array(trainingdata_t*d, int*_num_examples, int flags);
 node_t* parameter_code(dataset_t*d, int num);
 array_t* dataset_classes_as_array(dataset_t*d);
 void dataset_fill_row(dataset_t*s, row_t*row, int y);
+void dataset_fill_rows(dataset_t*s, row_t**rows, int start, int num);
 
 #ifdef __cplusplus
 }
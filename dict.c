@@ -19,6 +19,7 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
 
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -30,9 +31,8 @@ static char crc32_initialized=0;
 static void crc32_init(void)
 {
     int t;
-    if(crc32_initialized)
+    if(__atomic_load_n(&crc32_initialized, __ATOMIC_ACQUIRE))
         return;
-    crc32_initialized = 1;
     for(t=0; t<256; t++) {
         unsigned int c = t;
         int s;
@@ -41,6 +41,9 @@ static void crc32_init(void)
         }
         crc32[t] = c;
     }
+    /* only flag the table as initialized once it's complete- other
+       threads might be hashing at the same time */
+    __atomic_store_n(&crc32_initialized, 1, __ATOMIC_RELEASE);
 }
 // ------------------------------- hash function -----------------------
 unsigned int crc32_add_byte(unsigned int checksum, unsigned char b) 
@@ -71,6 +74,71 @@ unsigned int crc32_add_bytes(unsigned int checksum, const void*_s, int len)
     } while(--len);
     return checksum;
 }
+// ------------------------------- sha256 ------------------------------
+static const uint32_t sha256_k[64] = {
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2,
+};
+#define ROR32(x,n) (((x)>>(n))|((x)<<(32-(n))))
+static void sha256_block(uint32_t*h, const unsigned char*p)
+{
+    uint32_t w[64];
+    int t;
+    for(t=0;t<16;t++) {
+        w[t] = (uint32_t)p[t*4]<<24 | p[t*4+1]<<16 | p[t*4+2]<<8 | p[t*4+3];
+    }
+    for(t=16;t<64;t++) {
+        uint32_t s0 = ROR32(w[t-15],7) ^ ROR32(w[t-15],18) ^ (w[t-15]>>3);
+        uint32_t s1 = ROR32(w[t-2],17) ^ ROR32(w[t-2],19) ^ (w[t-2]>>10);
+        w[t] = w[t-16] + s0 + w[t-7] + s1;
+    }
+    uint32_t a=h[0],b=h[1],c=h[2],d=h[3],e=h[4],f=h[5],g=h[6],k=h[7];
+    for(t=0;t<64;t++) {
+        uint32_t t1 = k + (ROR32(e,6) ^ ROR32(e,11) ^ ROR32(e,25)) + ((e&f) ^ (~e&g)) + sha256_k[t] + w[t];
+        uint32_t t2 = (ROR32(a,2) ^ ROR32(a,13) ^ ROR32(a,22)) + ((a&b) ^ (a&c) ^ (b&c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0]+=a;h[1]+=b;h[2]+=c;h[3]+=d;h[4]+=e;h[5]+=f;h[6]+=g;h[7]+=k;
+}
+void sha256(const void*_data, int len, unsigned char digest[32])
+{
+    const unsigned char*data = (const unsigned char*)_data;
+    uint32_t h[8] = {0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,
+                     0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19};
+    int pos;
+    for(pos=0;pos+64<=len;pos+=64) {
+        sha256_block(h, data+pos);
+    }
+    /* the rest, a 1 bit, zeros, and the length in bits */
+    unsigned char tail[128];
+    int rest = len - pos;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data+pos, rest);
+    tail[rest] = 0x80;
+    int tail_len = rest+1+8 <= 64 ? 64 : 128;
+    uint64_t bits = (uint64_t)len*8;
+    int t;
+    for(t=0;t<8;t++) {
+        tail[tail_len-1-t] = bits>>(t*8);
+    }
+    for(t=0;t<tail_len;t+=64) {
+        sha256_block(h, tail+t);
+    }
+    for(t=0;t<8;t++) {
+        digest[t*4] = h[t]>>24;
+        digest[t*4+1] = h[t]>>16;
+        digest[t*4+2] = h[t]>>8;
+        digest[t*4+3] = h[t];
+    }
+}
+#undef ROR32
 unsigned int hash_block(const unsigned char*data, int len)
 {
     int t;
@@ -42,6 +42,9 @@ extern type_t stringstruct_type;
 extern type_t ptr_type;
 extern type_t int_type;
 
+void* ptr_dup(const void*o);
+void ptr_free(void*o);
+
 #define PTR_TO_INT(p) (((char*)(p))-((char*)NULL))
 #define INT_TO_PTR(i) (((char*)NULL)+(int)(i))
 
@@ -59,6 +62,10 @@ typedef struct _dict {
     int num;
 } dict_t;
 
+unsigned int crc32_add_string(unsigned int checksum, const char*s);
+unsigned int crc32_add_bytes(unsigned int checksum, const void*s, int len);
+void sha256(const void*data, int len, unsigned char digest[32]);
+
 dict_t*dict_new(type_t*type);
 void dict_init(dict_t*dict, int size);
 void dict_init2(dict_t*dict, type_t*type, int size);
@@ -109,6 +109,9 @@
 #define ARRAY_AT_POS_INC NODE_BEGIN(&node_array_at_pos_inc)
 #define ARRAY_ARG_MAX_I NODE_BEGIN(&node_array_arg_max_i)
 #define ARRAY_NEW(size) NODE_BEGIN(&node_zero_int_array, size)
+#define FOREST(f) NODE_BEGIN(&node_forest, f)
+#define LOOKUP NODE_BEGIN(&node_lookup)
+#define DOT(weights) NODE_BEGIN(&node_dot) ARRAY_CONSTANT(weights)
 
 #define VERIFY_INT(n) do{if(0)(((char*)0)[(n)]);}while(0)
 #define VERIFY_STRING(s) do{if(0){(s)[0];};}while(0)
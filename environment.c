@@ -23,16 +23,28 @@
 #include <memory.h>
 #include "environment.h"
 #include "ast.h"
+#include "ast_transforms.h"
 
 environment_t* environment_new(void*node, row_t*row)
+{
+    return environment_new_with_locals(node_highest_local((node_t*)node), row);
+}
+
+environment_t* environment_new_with_locals(int num_locals, row_t*row)
 {
     environment_t*e = (environment_t*)malloc(sizeof(environment_t));
-    e->num_locals = node_highest_local((node_t*)node);
+    e->num_locals = num_locals;
     e->locals = (constant_t*)calloc(sizeof(constant_t), e->num_locals);
     e->row = row;
     return e;
 }
 
+void environment_reset(environment_t*e, row_t*row)
+{
+    memset(e->locals, 0, sizeof(constant_t)*e->num_locals);
+    e->row = row;
+}
+
 void environment_destroy(environment_t*e)
 {
     free(e->locals);
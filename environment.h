@@ -32,5 +32,7 @@ typedef struct _environment {
 } environment_t;
 
 environment_t* environment_new(void*node, row_t*row);
+environment_t* environment_new_with_locals(int num_locals, row_t*row);
+void environment_reset(environment_t*e, row_t*row);
 void environment_destroy(environment_t*e);
 #endif
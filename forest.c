@@ -0,0 +1,791 @@
+/* forest.c
+   Packed tree ensembles (random trees, extremely random trees,
+   gradient boosted trees).
+
+   Part of the data prediction package.
+
+   Copyright (c) 2011 Matthias Kramm <kramm@quiss.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include "forest.h"
+#include "dict.h"
+#include "easy_ast.h"
+
+static array_t* array_clone(array_t*a)
+{
+    array_t*c = array_new(a->size);
+    memcpy(c->entries, a->entries, sizeof(constant_t)*a->size);
+    return c;
+}
+
+forest_t* forest_new(forest_kind_t kind, array_t*classes)
+{
+    forest_t*f = (forest_t*)calloc(1, sizeof(forest_t));
+    f->kind = kind;
+    f->classes = classes;
+    return f;
+}
+
+forest_t* forest_clone(forest_t*f)
+{
+    forest_t*c = (forest_t*)calloc(1, sizeof(forest_t));
+    c->kind = f->kind;
+    c->classes = array_clone(f->classes);
+
+    c->num_trees = c->trees_size = f->num_trees;
+    c->tree_root = malloc(sizeof(int32_t)*f->num_trees);
+    c->tree_class = malloc(sizeof(int32_t)*f->num_trees);
+    memcpy(c->tree_root, f->tree_root, sizeof(int32_t)*f->num_trees);
+    memcpy(c->tree_class, f->tree_class, sizeof(int32_t)*f->num_trees);
+
+    c->num_nodes = c->nodes_size = f->num_nodes;
+    c->feature = malloc(sizeof(int32_t)*f->num_nodes);
+    c->flags = malloc(sizeof(uint8_t)*f->num_nodes);
+    c->threshold = malloc(sizeof(float)*f->num_nodes);
+    c->right = malloc(sizeof(int32_t)*f->num_nodes);
+    c->set = malloc(sizeof(int32_t)*f->num_nodes);
+    memcpy(c->feature, f->feature, sizeof(int32_t)*f->num_nodes);
+    memcpy(c->flags, f->flags, sizeof(uint8_t)*f->num_nodes);
+    memcpy(c->threshold, f->threshold, sizeof(float)*f->num_nodes);
+    memcpy(c->right, f->right, sizeof(int32_t)*f->num_nodes);
+    memcpy(c->set, f->set, sizeof(int32_t)*f->num_nodes);
+
+    c->num_sets = c->sets_size = f->num_sets;
+    c->sets = malloc(sizeof(array_t*)*f->num_sets);
+    int t;
+    for(t=0;t<f->num_sets;t++) {
+        c->sets[t] = array_clone(f->sets[t]);
+    }
+    return c;
+}
+
+static void quickscorer_destroy(quickscorer_t*qs)
+{
+    int t;
+    for(t=0;t<qs->num_inputs;t++) {
+        if(qs->values[t])
+            dict_destroy(qs->values[t]);
+    }
+    free(qs->values);
+    free(qs->bucket);
+    free(qs->start);
+    free(qs->split);
+    free(qs->leaf_start);
+    free(qs->leaf);
+    free(qs);
+}
+
+void forest_destroy(forest_t*f)
+{
+    int t;
+    if(f->qs) {
+        quickscorer_destroy(f->qs);
+    }
+    for(t=0;t<f->num_sets;t++) {
+        array_destroy(f->sets[t]);
+    }
+    free(f->sets);
+    free(f->tree_root);
+    free(f->tree_class);
+    free(f->feature);
+    free(f->flags);
+    free(f->threshold);
+    free(f->right);
+    free(f->set);
+    array_destroy(f->classes);
+    free(f);
+}
+
+// ------------------------------ building --------------------------------
+
+void forest_start_tree(forest_t*f, int tree_class)
+{
+    if(f->num_trees == f->trees_size) {
+        f->trees_size = f->trees_size ? f->trees_size*2 : 16;
+        f->tree_root = realloc(f->tree_root, sizeof(int32_t)*f->trees_size);
+        f->tree_class = realloc(f->tree_class, sizeof(int32_t)*f->trees_size);
+    }
+    f->tree_root[f->num_trees] = f->num_nodes;
+    f->tree_class[f->num_trees] = tree_class;
+    f->num_trees++;
+}
+
+static int add_node(forest_t*f, int feature, uint8_t flags)
+{
+    assert(f->num_trees);
+    if(f->num_nodes == f->nodes_size) {
+        f->nodes_size = f->nodes_size ? f->nodes_size*2 : 256;
+        f->feature = realloc(f->feature, sizeof(int32_t)*f->nodes_size);
+        f->flags = realloc(f->flags, sizeof(uint8_t)*f->nodes_size);
+        f->threshold = realloc(f->threshold, sizeof(float)*f->nodes_size);
+        f->right = realloc(f->right, sizeof(int32_t)*f->nodes_size);
+        f->set = realloc(f->set, sizeof(int32_t)*f->nodes_size);
+    }
+    int n = f->num_nodes++;
+    f->feature[n] = feature;
+    f->flags[n] = flags;
+    f->threshold[n] = 0;
+    f->right[n] = 0;
+    f->set[n] = 0;
+    return n;
+}
+
+int forest_add_split(forest_t*f, int feature, float threshold, bool inversed)
+{
+    int n = add_node(f, feature, inversed?FOREST_FLAG_INVERSED:0);
+    f->threshold[n] = threshold;
+    return n;
+}
+
+int forest_add_category_split(forest_t*f, int feature, array_t*set, bool inversed)
+{
+    int n = add_node(f, feature, FOREST_FLAG_CATEGORICAL|(inversed?FOREST_FLAG_INVERSED:0));
+    if(f->num_sets == f->sets_size) {
+        f->sets_size = f->sets_size ? f->sets_size*2 : 16;
+        f->sets = realloc(f->sets, sizeof(array_t*)*f->sets_size);
+    }
+    f->set[n] = f->num_sets;
+    f->sets[f->num_sets++] = set;
+    return n;
+}
+
+void forest_set_right(forest_t*f, int split)
+{
+    assert(f->feature[split] != FOREST_LEAF);
+    f->right[split] = f->num_nodes;
+}
+
+void forest_add_leaf(forest_t*f, int c, float value)
+{
+    int n = add_node(f, FOREST_LEAF, 0);
+    f->right[n] = c;
+    f->threshold[n] = value;
+}
+
+bool forest_sanitycheck(forest_t*f)
+{
+    int num_classes = f->classes->size;
+    if(!num_classes)
+        return false;
+    int k,n;
+    for(k=0;k<f->num_trees;k++) {
+        int start = f->tree_root[k];
+        int end = k+1<f->num_trees ? f->tree_root[k+1] : f->num_nodes;
+        if(start >= end)
+            return false;
+        if(f->kind == FOREST_SUM && (f->tree_class[k] < 0 || f->tree_class[k] >= num_classes))
+            return false;
+        /* all branches point forward, so every walk ends at the last
+           node of the tree at the latest. Make sure that one is a leaf. */
+        if(f->feature[end-1] != FOREST_LEAF)
+            return false;
+        for(n=start;n<end;n++) {
+            if(f->feature[n] == FOREST_LEAF) {
+                if(f->kind == FOREST_VOTE && (f->right[n] < 0 || f->right[n] >= num_classes))
+                    return false;
+            } else {
+                if(f->feature[n] < 0)
+                    return false;
+                if(f->right[n] <= n+1 || f->right[n] >= end)
+                    return false;
+                if((f->flags[n] & FOREST_FLAG_CATEGORICAL) &&
+                   (f->set[n] < 0 || f->set[n] >= f->num_sets))
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+// ------------------------------ QuickScorer -----------------------------
+
+/* Number the leaves of every tree from left to right. A split which
+   sends a row to the right rules out all leaves of its left subtree,
+   and the leftmost leaf which isn't ruled out by any split is the one
+   a walk from the root would have reached. So instead of walking the
+   trees, we can go through the splits which send the row right, and
+   clear the bits of the leaves they rule out, in one 64 bit mask per
+   tree. None of this branches on which way a split went.
+   (Lucchese et al., "QuickScorer: a fast algorithm to rank documents
+   with additive ensembles of regression trees")
+
+   For a continuous input, the splits are sorted by threshold, so the
+   ones sending x right (x > threshold) are a prefix. For a categorical
+   input, there's a list of splits sending a row right for every value
+   the splits test for, plus one list for all other values.
+
+   This is only done if every tree has at most 64 leaves, there are
+   no inversed splits on continuous inputs, and the tables promise to
+   be faster than walking the trees. Few, small trees are cheaper to
+   walk than the lookups of all categorical inputs. */
+#define QUICKSCORER_MAX_LEAVES 64
+
+/* don't let categorical inputs with many values blow up the tables */
+#define QUICKSCORER_MAX_SPLITS_PER_NODE 64
+
+static int compare_splits(const void*o1, const void*o2)
+{
+    const quickscorer_split_t*s1 = (const quickscorer_split_t*)o1;
+    const quickscorer_split_t*s2 = (const quickscorer_split_t*)o2;
+    if(s1->threshold != s2->threshold)
+        return s1->threshold < s2->threshold ? -1 : 1;
+    return s1->tree - s2->tree;
+}
+
+static uint64_t leaf_bits(int from, int to)
+{
+    uint64_t upto = to < 64 ? ((uint64_t)1 << to) - 1 : ~(uint64_t)0;
+    return upto & ~(((uint64_t)1 << from) - 1);
+}
+
+/* whether split n sends a row with the given value right. value is
+   NULL for values none of the splits on the input test for. */
+static bool split_sends_right(forest_t*f, int n, constant_t*value)
+{
+    if(!(f->flags[n] & FOREST_FLAG_CATEGORICAL))
+        return true;
+    bool inversed = !!(f->flags[n] & FOREST_FLAG_INVERSED);
+    if(!value)
+        return !inversed;
+    array_t*set = f->sets[f->set[n]];
+    int t;
+    for(t=0;t<set->size;t++) {
+        if(constant_equals(&set->entries[t], value))
+            return inversed;
+    }
+    return !inversed;
+}
+
+/* Rough cost per row of walking the trees: two steps to enter a tree,
+   one per continuous split and four per in_set() on the way to the
+   average leaf. Measured on the agaricus and letter data sets. */
+static double walk_cost(forest_t*f)
+{
+    double*depth = (double*)malloc(sizeof(double)*f->num_nodes);
+    double cost = 0;
+    int k,n;
+    for(k=0;k<f->num_trees;k++) {
+        int start = f->tree_root[k];
+        int end = k+1<f->num_trees ? f->tree_root[k+1] : f->num_nodes;
+        double sum = 0;
+        int leaves = 0;
+        depth[start] = 2;
+        for(n=start;n<end;n++) {
+            if(f->feature[n] == FOREST_LEAF) {
+                sum += depth[n];
+                leaves++;
+            } else {
+                double step = (f->flags[n] & FOREST_FLAG_CATEGORICAL) ? 4 : 1;
+                depth[n+1] = depth[f->right[n]] = depth[n] + step;
+            }
+        }
+        cost += sum / leaves;
+    }
+    free(depth);
+    return cost;
+}
+
+/* ... and for the QuickScorer: a hash lookup per categorical input,
+   the splits sending the row right, and finding the leaf of every tree */
+static double quickscorer_cost(forest_t*f, quickscorer_t*qs)
+{
+    double cost = f->num_trees;
+    int i;
+    for(i=0;i<qs->num_inputs;i++) {
+        int num_buckets = qs->bucket[i+1] - qs->bucket[i];
+        int num_splits = qs->start[qs->bucket[i+1]] - qs->start[qs->bucket[i]];
+        if(qs->values[i]) {
+            cost += 8 + (double)num_splits / num_buckets;
+        } else {
+            cost += 1 + num_splits / 2.0;
+        }
+    }
+    return cost;
+}
+
+bool forest_build_quickscorer(forest_t*f)
+{
+    if(f->qs)
+        return true;
+
+    int num_inputs = 0;
+    int num_leaves = 0;
+    int k,n,i,t;
+    for(n=0;n<f->num_nodes;n++) {
+        if(f->feature[n] >= num_inputs)
+            num_inputs = f->feature[n] + 1;
+    }
+    /* -1: no splits, 0: continuous, 1: categorical */
+    int8_t*kind = (int8_t*)malloc(num_inputs+1);
+    memset(kind, -1, num_inputs+1);
+    bool ok = true;
+    for(k=0;k<f->num_trees;k++) {
+        int start = f->tree_root[k];
+        int end = k+1<f->num_trees ? f->tree_root[k+1] : f->num_nodes;
+        int leaves = 0;
+        for(n=start;n<end;n++) {
+            if(f->feature[n] == FOREST_LEAF) {
+                leaves++;
+                continue;
+            }
+            i = f->feature[n];
+            int8_t split_kind = (f->flags[n] & FOREST_FLAG_CATEGORICAL) ? 1 : 0;
+            if(kind[i] >= 0 && kind[i] != split_kind)
+                ok = false;
+            kind[i] = split_kind;
+            /* inversed splits on continuous inputs send x right for
+               x <= threshold (and never for missing values), so they'd
+               need a list of their own */
+            if(!split_kind && (f->flags[n] & FOREST_FLAG_INVERSED))
+                ok = false;
+        }
+        if(leaves > QUICKSCORER_MAX_LEAVES)
+            ok = false;
+        num_leaves += leaves;
+    }
+    if(!ok) {
+        free(kind);
+        return false;
+    }
+
+    /* the values of every categorical input, and their bucket */
+    quickscorer_t*qs = (quickscorer_t*)calloc(1, sizeof(quickscorer_t));
+    qs->num_inputs = num_inputs;
+    qs->values = (dict_t**)calloc(num_inputs+1, sizeof(dict_t*));
+    qs->bucket = (int32_t*)malloc(sizeof(int32_t)*(num_inputs+1));
+    for(i=0;i<num_inputs;i++) {
+        if(kind[i] == 1)
+            qs->values[i] = dict_new(&constant_hash_type);
+    }
+    free(kind);
+    for(n=0;n<f->num_nodes;n++) {
+        if(f->feature[n] == FOREST_LEAF || !(f->flags[n] & FOREST_FLAG_CATEGORICAL))
+            continue;
+        dict_t*values = qs->values[f->feature[n]];
+        array_t*set = f->sets[f->set[n]];
+        for(t=0;t<set->size;t++) {
+            if(!dict_contains(values, &set->entries[t]))
+                dict_put(values, &set->entries[t], (void*)(ptrdiff_t)(dict_count(values)+1));
+        }
+    }
+    int num_buckets = 0;
+    for(i=0;i<num_inputs;i++) {
+        qs->bucket[i] = num_buckets;
+        num_buckets += qs->values[i] ? dict_count(qs->values[i]) + 1 : 1;
+    }
+    qs->bucket[num_inputs] = num_buckets;
+    constant_t**bucket_value = (constant_t**)calloc(num_buckets+1, sizeof(constant_t*));
+    for(i=0;i<num_inputs;i++) {
+        if(!qs->values[i])
+            continue;
+        DICT_ITERATE_ITEMS(qs->values[i], constant_t*, value, void*, index) {
+            bucket_value[qs->bucket[i] + (ptrdiff_t)index - 1] = value;
+        }
+    }
+
+    /* count, then fill, the splits of every bucket */
+    qs->start = (int32_t*)calloc(num_buckets+1, sizeof(int32_t));
+    int b;
+    for(n=0;n<f->num_nodes;n++) {
+        if(f->feature[n] == FOREST_LEAF)
+            continue;
+        i = f->feature[n];
+        for(b=qs->bucket[i];b<qs->bucket[i+1];b++) {
+            if(split_sends_right(f, n, bucket_value[b]))
+                qs->start[b+1]++;
+        }
+    }
+    for(b=0;b<num_buckets;b++) {
+        qs->start[b+1] += qs->start[b];
+    }
+    if(qs->start[num_buckets] > QUICKSCORER_MAX_SPLITS_PER_NODE * f->num_nodes ||
+       quickscorer_cost(f, qs) >= walk_cost(f)) {
+        free(bucket_value);
+        quickscorer_destroy(qs);
+        return false;
+    }
+    qs->split = (quickscorer_split_t*)malloc(sizeof(quickscorer_split_t)*qs->start[num_buckets]);
+    int32_t*pos = (int32_t*)malloc(sizeof(int32_t)*(num_buckets+1));
+    memcpy(pos, qs->start, sizeof(int32_t)*(num_buckets+1));
+
+    /* leaves_before[n]: the number of leaves of n's tree in front of n */
+    int32_t*leaves_before = (int32_t*)malloc(sizeof(int32_t)*(f->num_nodes+1));
+    qs->leaf_start = (int32_t*)malloc(sizeof(int32_t)*f->num_trees);
+    qs->leaf = (int32_t*)malloc(sizeof(int32_t)*num_leaves);
+    num_leaves = 0;
+    for(k=0;k<f->num_trees;k++) {
+        int start = f->tree_root[k];
+        int end = k+1<f->num_trees ? f->tree_root[k+1] : f->num_nodes;
+        qs->leaf_start[k] = num_leaves;
+        int leaves = 0;
+        for(n=start;n<end;n++) {
+            leaves_before[n] = leaves;
+            if(f->feature[n] == FOREST_LEAF) {
+                qs->leaf[num_leaves++] = n;
+                leaves++;
+            }
+        }
+        leaves_before[end] = leaves;
+        for(n=start;n<end;n++) {
+            if(f->feature[n] == FOREST_LEAF)
+                continue;
+            /* the left subtree are the nodes n+1 .. right[n]-1 */
+            uint64_t mask = ~leaf_bits(leaves_before[n+1], leaves_before[f->right[n]]);
+            i = f->feature[n];
+            for(b=qs->bucket[i];b<qs->bucket[i+1];b++) {
+                if(split_sends_right(f, n, bucket_value[b])) {
+                    quickscorer_split_t*split = &qs->split[pos[b]++];
+                    split->threshold = f->threshold[n];
+                    split->tree = k;
+                    split->mask = mask;
+                }
+            }
+        }
+    }
+    for(i=0;i<num_inputs;i++) {
+        if(!qs->values[i]) {
+            b = qs->bucket[i];
+            qsort(&qs->split[qs->start[b]], qs->start[b+1] - qs->start[b], sizeof(quickscorer_split_t), compare_splits);
+        }
+    }
+    free(leaves_before);
+    free(bucket_value);
+    free(pos);
+    f->qs = qs;
+    return true;
+}
+
+/* Find the leaf of every tree which row ends up in */
+static void quickscorer_walk(forest_t*f, row_t*row, int32_t*leaves)
+{
+    quickscorer_t*qs = f->qs;
+    assert(qs->num_inputs <= row->num_inputs);
+    uint64_t remaining[f->num_trees];
+    memset(remaining, 0xff, sizeof(remaining));
+    int i;
+    for(i=0;i<qs->num_inputs;i++) {
+        variable_t*v = &row->inputs[i];
+        int b = qs->bucket[i];
+        quickscorer_split_t*split;
+        quickscorer_split_t*end;
+        if(qs->values[i]) {
+            /* the same values in_set() compares */
+            constant_t value;
+            switch(v->type) {
+                case CATEGORICAL: value.type = CONSTANT_CATEGORY; value.c = v->category; break;
+                case CONTINUOUS: value.type = CONSTANT_FLOAT; value.f = v->value; break;
+                case TEXT: value.type = CONSTANT_STRING; value.s = (char*)v->text; break;
+                default: value.type = CONSTANT_MISSING; break;
+            }
+            ptrdiff_t index = (ptrdiff_t)dict_lookup(qs->values[i], &value);
+            b += index ? index-1 : qs->bucket[i+1] - b - 1;
+            split = &qs->split[qs->start[b]];
+            end = &qs->split[qs->start[b+1]];
+            for(;split < end;split++) {
+                remaining[split->tree] &= split->mask;
+            }
+        } else {
+            /* walk_tree() sends rows right on non-continuous values,
+               which !(x <= threshold) does for NaN */
+            float x = v->type == CONTINUOUS ? v->value : NAN;
+            split = &qs->split[qs->start[b]];
+            end = &qs->split[qs->start[b+1]];
+            for(;split < end && !(x <= split->threshold);split++) {
+                remaining[split->tree] &= split->mask;
+            }
+        }
+    }
+    int k;
+    for(k=0;k<f->num_trees;k++) {
+        leaves[k] = qs->leaf[qs->leaf_start[k] + __builtin_ctzll(remaining[k])];
+    }
+}
+
+// ------------------------------ evaluation ------------------------------
+
+static inline bool in_set(array_t*a, variable_t*v)
+{
+    /* same as constant_equals(), without converting v to a constant first */
+    int t;
+    for(t=0;t<a->size;t++) {
+        constant_t*c = &a->entries[t];
+        switch(v->type) {
+            case CATEGORICAL:
+                if(c->type == CONSTANT_CATEGORY && c->c == v->category)
+                    return true;
+            break;
+            case CONTINUOUS:
+                if(c->type == CONSTANT_FLOAT && c->f == v->value)
+                    return true;
+            break;
+            case TEXT:
+                if(c->type == CONSTANT_STRING && !strcmp(c->s, v->text))
+                    return true;
+            break;
+            case MISSING:
+                if(c->type == CONSTANT_MISSING)
+                    return true;
+            break;
+        }
+    }
+    return false;
+}
+
+static inline int walk_tree(forest_t*f, int n, row_t*row)
+{
+    const int32_t*feature = f->feature;
+    while(feature[n] != FOREST_LEAF) {
+        assert(feature[n] < row->num_inputs);
+        variable_t*v = &row->inputs[feature[n]];
+        uint8_t flags = f->flags[n];
+        bool left;
+        if(flags & FOREST_FLAG_CATEGORICAL) {
+            left = in_set(f->sets[f->set[n]], v);
+        } else {
+            left = v->type == CONTINUOUS && v->value <= f->threshold[n];
+        }
+        if(flags & FOREST_FLAG_INVERSED) {
+            left = !left;
+        }
+        n = left ? n+1 : f->right[n];
+    }
+    return n;
+}
+
+/* like node_array_arg_max_i: the first of several maxima wins */
+static inline int most_votes(int*votes, int num_classes)
+{
+    int index = 0;
+    int c;
+    for(c=1;c<num_classes;c++) {
+        if(votes[c] > votes[index])
+            index = c;
+    }
+    return index;
+}
+
+/* like node_add followed by node_arg_max: sums are rounded to float
+   before comparing them */
+static inline int highest_sum(double*sums, int num_classes)
+{
+    float max = sums[0];
+    int index = 0;
+    int c;
+    for(c=1;c<num_classes;c++) {
+        float v = sums[c];
+        if(v > max) {
+            max = v;
+            index = c;
+        }
+    }
+    return index;
+}
+
+static void quickscorer_predict_rows(forest_t*f, row_t**rows, int num_rows, int*out)
+{
+    int num_classes = f->classes->size;
+    int votes[num_classes];
+    double sums[num_classes];
+    int32_t leaves[f->num_trees];
+    int k,t;
+    for(t=0;t<num_rows;t++) {
+        quickscorer_walk(f, rows[t], leaves);
+        if(f->kind == FOREST_VOTE) {
+            memset(votes, 0, sizeof(votes));
+            for(k=0;k<f->num_trees;k++) {
+                votes[f->right[leaves[k]]]++;
+            }
+            out[t] = most_votes(votes, num_classes);
+        } else {
+            /* summed up in the same order as below */
+            memset(sums, 0, sizeof(sums));
+            for(k=0;k<f->num_trees;k++) {
+                sums[f->tree_class[k]] += f->threshold[leaves[k]];
+            }
+            out[t] = highest_sum(sums, num_classes);
+        }
+    }
+}
+
+/* Rows are pushed through the ensemble one tile at a time, tree by
+   tree, so that the nodes of a tree stay in the cache while all rows
+   of the tile walk it. */
+#define FOREST_TILE 64
+
+void forest_predict_rows(forest_t*f, row_t**rows, int num_rows, int*out)
+{
+    if(f->qs) {
+        quickscorer_predict_rows(f, rows, num_rows, out);
+        return;
+    }
+    int num_classes = f->classes->size;
+    int tile = num_rows < FOREST_TILE ? num_rows : FOREST_TILE;
+    int votes[f->kind == FOREST_VOTE ? tile*num_classes : 1];
+    double sums[f->kind == FOREST_SUM ? tile*num_classes : 1];
+    int pos;
+    for(pos=0;pos<num_rows;pos+=FOREST_TILE) {
+        int num = num_rows - pos;
+        if(num > FOREST_TILE)
+            num = FOREST_TILE;
+        row_t**r = &rows[pos];
+        int k,t;
+        if(f->kind == FOREST_VOTE) {
+            memset(votes, 0, sizeof(int)*num*num_classes);
+            for(k=0;k<f->num_trees;k++) {
+                int root = f->tree_root[k];
+                for(t=0;t<num;t++) {
+                    int leaf = walk_tree(f, root, r[t]);
+                    votes[t*num_classes + f->right[leaf]]++;
+                }
+            }
+            for(t=0;t<num;t++) {
+                out[pos+t] = most_votes(&votes[t*num_classes], num_classes);
+            }
+        } else {
+            memset(sums, 0, sizeof(double)*num*num_classes);
+            for(k=0;k<f->num_trees;k++) {
+                int root = f->tree_root[k];
+                double*s = &sums[f->tree_class[k]];
+                for(t=0;t<num;t++) {
+                    int leaf = walk_tree(f, root, r[t]);
+                    s[t*num_classes] += f->threshold[leaf];
+                }
+            }
+            for(t=0;t<num;t++) {
+                out[pos+t] = highest_sum(&sums[t*num_classes], num_classes);
+            }
+        }
+    }
+}
+
+int forest_predict(forest_t*f, row_t*row)
+{
+    int c;
+    forest_predict_rows(f, &row, 1, &c);
+    return c;
+}
+
+// ------------------------------ conversion ------------------------------
+
+static void walk_to_node(forest_t*f, int n, node_t*current_node)
+{
+    node_t**current_program = 0;
+
+    if(f->feature[n] == FOREST_LEAF) {
+        if(f->kind == FOREST_VOTE) {
+            INT_CONSTANT(f->right[n]);
+        } else {
+            FLOAT_CONSTANT(f->threshold[n]);
+        }
+        return;
+    }
+    bool inversed = !!(f->flags[n] & FOREST_FLAG_INVERSED);
+    IF
+        if(inversed) {
+            NOT
+        }
+        if(f->flags[n] & FOREST_FLAG_CATEGORICAL) {
+            IN
+                RAW_PARAM(f->feature[n]);
+                ARRAY_CONSTANT(array_clone(f->sets[f->set[n]]));
+            END;
+        } else {
+            LTE
+                RAW_PARAM(f->feature[n]);
+                FLOAT_CONSTANT(f->threshold[n]);
+            END;
+        }
+        if(inversed) {
+            END;
+        }
+    THEN
+        walk_to_node(f, n+1, current_node);
+    ELSE
+        walk_to_node(f, f->right[n], current_node);
+    END;
+}
+
+/* Expand the forest into plain AST nodes (if/lte/in, with votes or
+   sums kept in locals), e.g. for code generation. */
+node_t* forest_to_node(forest_t*f)
+{
+    int num_classes = f->classes->size;
+    int k,c;
+
+    START_CODE(code)
+    BLOCK
+    if(f->kind == FOREST_VOTE) {
+        SETLOCAL(0)
+            ARRAY_NEW(num_classes);
+        END;
+        for(k=0;k<f->num_trees;k++) {
+            SETLOCAL(k+1)
+                walk_to_node(f, f->tree_root[k], current_node);
+            END;
+            ARRAY_AT_POS_INC
+                GETLOCAL(0);
+                GETLOCAL(k+1);
+            END;
+        }
+        ARRAY_AT_POS
+            ARRAY_CONSTANT(array_clone(f->classes));
+            ARRAY_ARG_MAX_I
+                GETLOCAL(0);
+            END;
+        END;
+    } else {
+        for(c=0;c<num_classes;c++) {
+            SETLOCAL(c)
+                ADD
+                    int count = 0;
+                    for(k=0;k<f->num_trees;k++) {
+                        if(f->tree_class[k] == c) {
+                            walk_to_node(f, f->tree_root[k], current_node);
+                            count++;
+                        }
+                    }
+                    if(!count) {
+                        FLOAT_CONSTANT(0.0);
+                    }
+                END;
+            END;
+        }
+        ARRAY_AT_POS
+            ARRAY_CONSTANT(array_clone(f->classes));
+            ARG_MAX_F
+                for(c=0;c<num_classes;c++) {
+                    GETLOCAL(c);
+                }
+            END;
+        END;
+    }
+    END;
+    END_CODE;
+    return code;
+}
+
+void forest_print(forest_t*f)
+{
+    printf("<%s forest, %d trees, %d nodes>",
+            f->kind == FOREST_VOTE ? "voting" : "summing",
+            f->num_trees, f->num_nodes);
+}
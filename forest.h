@@ -0,0 +1,118 @@
+/* forest.h
+   Packed tree ensembles (random trees, extremely random trees,
+   gradient boosted trees).
+
+   Part of the data prediction package.
+
+   Copyright (c) 2011 Matthias Kramm <kramm@quiss.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#ifndef __forest_h__
+#define __forest_h__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mrscake.h"
+#include "constant.h"
+#include "ast.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum forest_kind {
+    FOREST_VOTE=0, // every tree votes for a class (rtrees, ertrees)
+    FOREST_SUM=1,  // trees add up a score per class (gbtrees)
+} forest_kind_t;
+
+#define FOREST_LEAF -1
+
+#define FOREST_FLAG_CATEGORICAL 1
+#define FOREST_FLAG_INVERSED 2
+
+/* A split in the QuickScorer layout (see forest_build_quickscorer()) */
+typedef struct _quickscorer_split {
+    float threshold;
+    int32_t tree;
+    uint64_t mask;  // the leaves which remain possible if the split sends the row right
+} quickscorer_split_t;
+
+typedef struct _quickscorer {
+    int num_inputs;
+    /* the buckets of input i are bucket[i] .. bucket[i+1]-1: one for
+       continuous inputs. For categorical inputs, values[i] maps every
+       value to its bucket (+1), and the last one is for all others. */
+    struct _dict**values;
+    int32_t*bucket;
+    int32_t*start;  // the splits of bucket b are split[start[b]] .. split[start[b+1]-1]
+    quickscorer_split_t*split;
+    int32_t*leaf_start; // the leaves of tree k, left to right, are leaf[leaf_start[k]] ...
+    int32_t*leaf;
+} quickscorer_t;
+
+/* All trees of an ensemble, stored as one struct-of-arrays.
+   Nodes are in preorder, so the left child of a split is always
+   the node directly after it. */
+typedef struct _forest {
+    uint8_t kind;
+    array_t*classes;
+
+    int num_trees;
+    int32_t*tree_root;
+    int32_t*tree_class; // FOREST_SUM: the class a tree adds to
+
+    int num_nodes;
+    int32_t*feature;    // input index, or FOREST_LEAF
+    uint8_t*flags;
+    float*threshold;    // splits: x <= threshold goes left. FOREST_SUM leaves: value
+    int32_t*right;      // splits: right child. FOREST_VOTE leaves: class
+    int32_t*set;        // categorical splits: index into sets[]
+
+    int num_sets;
+    array_t**sets;      // categorical splits: values going left
+
+    int trees_size;
+    int nodes_size;
+    int sets_size;
+
+    quickscorer_t*qs;   // not copied by forest_clone() or serialized
+} forest_t;
+
+forest_t* forest_new(forest_kind_t kind, array_t*classes);
+forest_t* forest_clone(forest_t*f);
+void forest_destroy(forest_t*f);
+
+/* building. Add the nodes of each tree in preorder, and call
+   forest_set_right() on a split before adding its right subtree. */
+void forest_start_tree(forest_t*f, int tree_class);
+int forest_add_split(forest_t*f, int feature, float threshold, bool inversed);
+int forest_add_category_split(forest_t*f, int feature, array_t*set, bool inversed);
+void forest_set_right(forest_t*f, int split);
+void forest_add_leaf(forest_t*f, int c, float value);
+bool forest_sanitycheck(forest_t*f);
+
+bool forest_build_quickscorer(forest_t*f);
+
+int forest_predict(forest_t*f, row_t*row);
+void forest_predict_rows(forest_t*f, row_t**rows, int num_rows, int*out);
+
+node_t* forest_to_node(forest_t*f);
+void forest_print(forest_t*f);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //__forest_h__
@@ -725,7 +725,6 @@ static void writer_zlibdeflate_finish(writer_t*writer)
 {
 #ifdef HAVE_ZLIB
     zlibdeflate_t*z = (zlibdeflate_t*)writer->internal;
-    writer_t*output;
     int ret;
     if(writer->type != WRITER_TYPE_ZLIB) {
 	fprintf(stderr, "Wrong writer ID (writer not initialized?)\n");
@@ -733,7 +732,6 @@ static void writer_zlibdeflate_finish(writer_t*writer)
     }
     if(!z)
 	return;
-    output= z->output;
     while(1) {
 	ret = deflate(&z->zs, Z_FINISH);
 	if (ret != Z_OK &&
@@ -755,13 +753,17 @@ static void writer_zlibdeflate_finish(writer_t*writer)
     if (ret != Z_OK) zlib_error(ret, "bitio:deflate_end", &z->zs);
     free(writer->internal);
     free(writer);
-    //output->finish(output); 
+    //z->output->finish(z->output); 
 #else
     fprintf(stderr, "Error: swftools was compiled without zlib support");
     exit(1);
 #endif
 }
 writer_t* zlibdeflatewriter_new(writer_t*output)
+{
+    return zlibdeflatewriter_new2(output, 9);
+}
+writer_t* zlibdeflatewriter_new2(writer_t*output, int level)
 {
 #ifdef HAVE_ZLIB
     writer_t*w = (writer_t*)malloc(sizeof(writer_t));
@@ -781,7 +783,7 @@ writer_t* zlibdeflatewriter_new(writer_t*output)
     z->zs.zalloc = Z_NULL;
     z->zs.zfree  = Z_NULL;
     z->zs.opaque = Z_NULL;
-    ret = deflateInit(&z->zs, 9);
+    ret = deflateInit(&z->zs, level);
     if (ret != Z_OK) zlib_error(ret, "bitio:deflate_init", &z->zs);
     w->bitpos = 0;
     w->mybyte = 0;
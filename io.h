@@ -109,7 +109,7 @@ void write_compressed_int(writer_t*w, int32_t i);
 reader_t* filereader_new(int handle);
 reader_t* filereader_new2(const char*filename);
 reader_t* filereader_with_timeout_new(int handle, int seconds);
-reader_t* zlibinflate_new(reader_t*input);
+reader_t* zlibinflatereader_new(reader_t*input);
 reader_t* memreader_new(void*data, int length);
 reader_t* nullreader_new();
 #ifdef HAVE_ZZIP
@@ -119,6 +119,7 @@ reader_t* zzipreader_new(ZZIP_FILE*z);
 writer_t* filewriter_new(int handle);
 writer_t* filewriter_new2(const char*filename);
 writer_t* zlibdeflatewriter_new(writer_t*output);
+writer_t* zlibdeflatewriter_new2(writer_t*output, int level);
 writer_t* memwriter_new(void*data, int length);
 writer_t* nullwriter_new();
 writer_t* growingmemwriter_new();
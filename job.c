@@ -20,65 +20,188 @@
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include "job.h"
+#include "ast.h"
+#include "ast_transforms.h"
 #include "io.h"
 #include "settings.h"
 #include "net.h"
 #include "serialize.h"
 
-//#define FORK_FOR_TRAINING
-void job_process(job_t*job)
+model_t* train_model(model_factory_t*factory, dataset_t*data)
 {
-#ifndef FORK_FOR_TRAINING
-    job->model = job->factory->train(job->factory, job->data);
-    if(job->model) {
-        job->model->name = job->factory->name;
-    }
-    return;
-#else
-    int p[2];
-    int ret = pipe(p);
-    int read_fd = p[0];
-    int write_fd = p[1];
-    if(ret) {
-        perror("create pipe");
-        exit(-1);
+    /* OpenCV's random number generator is per thread. Reset it for every
+       job so that a model doesn't depend on which jobs ran before it
+       (on the same thread) */
+    reset_random_number_generator();
+
+    model_t*m = factory->train(factory, data);
+    if(m) {
+        m->name = factory->name;
+        m->code = node_optimize((node_t*)m->code);
+        m->num_locals = node_highest_local((node_t*)m->code);
     }
-    pid_t pid = fork();
-    if(!pid) {
+    return m;
+}
+
+/* With config_fork_for_training, every model is trained in a child
+   process of its own, so that a crash inside OpenCV only costs us that
+   one model. The child hands the serialized model back through an
+   anonymous shared mapping. It's large, but only the pages the child
+   actually writes to ever get allocated. */
+
+#define RESULT_AREA_SIZE (256*1024*1024)
+
+typedef struct _result_area {
+    uint32_t length;
+    unsigned char data[0];
+} result_area_t;
+
+typedef struct _forked_job {
+    job_t*job;
+    pid_t pid;
+    result_area_t*result;
+    time_t start_time;
+} forked_job_t;
+
+static void forked_job_start(forked_job_t*f, job_t*job)
+{
+    f->job = job;
+    f->start_time = time(0);
+    job->model = 0;
+    f->result = mmap(0, RESULT_AREA_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if(f->result == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    f->pid = fork();
+    if(f->pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if(!f->pid) {
         //child
-        close(read_fd); // close read
-        model_t*m = job->factory->train(job->factory, job->data);
-        if(m) {
-            m->name = job->factory->name;
-        }
-        writer_t*w = filewriter_new(write_fd);
+        model_t*m = train_model(job->factory, job->data);
+        if(!m)
+            _exit(1);
+        int size = RESULT_AREA_SIZE - sizeof(result_area_t);
+        writer_t*w = memwriter_new(f->result->data, size);
         model_write(m, w);
+        int length = w->pos;
         w->finish(w);
-        close(write_fd); // close write
+        if(length >= size) {
+            fprintf(stderr, "model %s too large (>%d bytes)\n", job->factory->name, size);
+            _exit(1);
+        }
+        f->result->length = length;
         _exit(0);
-    } else {
-        //parent
-        close(write_fd); // close write
-        reader_t*r = filereader_with_timeout_new(read_fd, config_job_wait_timeout);
+    }
+}
+
+static void forked_job_finish(forked_job_t*f, int status)
+{
+    job_t*job = f->job;
+    if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        reader_t*r = memreader_new(f->result->data, f->result->length);
         job->model = model_read(r);
+        r->dealloc(r);
         if(job->model) {
             job->model->name = job->factory->name;
+            job->model->sig = job->data->sig;
         }
-        r->dealloc(r);
-        close(read_fd); // close read
-        ret = waitpid(pid, NULL, WNOHANG);
-        if(ret < 0) {
-            kill(pid, SIGKILL);
+    } else if(WIFSIGNALED(status)) {
+        printf("\nFailed (crashed with signal %d): %s\n", WTERMSIG(status), job->factory->name);
+    }
+    munmap(f->result, RESULT_AREA_SIZE);
+    f->job = 0;
+    f->pid = 0;
+}
+
+/* train the given number of jobs, starting at first, with at most
+   num_processes children at once */
+static void process_jobs_forked(job_t*first, int num_jobs, int num_processes)
+{
+    if(num_processes > num_jobs)
+        num_processes = num_jobs;
+    forked_job_t*slots = calloc(num_processes, sizeof(forked_job_t));
+
+    /* so that the children inherit the OpenCV versions of the data,
+       instead of each of them converting it again */
+    job_t*job = first;
+    int i;
+    for(i=0;i<num_jobs;i++) {
+        dataset_cv_cache_fill(job->data);
+        job = job->next;
+    }
+
+    /* wake up as soon as a child exits */
+    sigset_t sigchld, old_mask;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, &old_mask);
+
+    job_t*next = first;
+    int num_started = 0, num_finished = 0;
+    int t;
+    while(num_finished < num_jobs) {
+        for(t=0;t<num_processes && num_started < num_jobs;t++) {
+            if(!slots[t].pid) {
+                forked_job_start(&slots[t], next);
+                next = next->next;
+                num_started++;
+            }
+        }
+        if(num_jobs > 1) {
+            printf("\rJob %d / %d", num_finished, num_jobs);fflush(stdout);
+        }
+
+        struct timespec timeout = {1, 0};
+        sigtimedwait(&sigchld, NULL, &timeout);
+
+        time_t now = time(0);
+        for(t=0;t<num_processes;t++) {
+            forked_job_t*f = &slots[t];
+            if(!f->pid)
+                continue;
+            int status;
+            pid_t ret = waitpid(f->pid, &status, WNOHANG);
+            if(!ret && now - f->start_time > config_job_wait_timeout) {
+                printf("\nFailed (timeout): %s\n", f->job->factory->name);
+                kill(f->pid, SIGKILL);
+                ret = waitpid(f->pid, &status, 0);
+            }
+            if(ret) {
+                forked_job_finish(f, status);
+                num_finished++;
+            }
         }
     }
-#endif
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    free(slots);
+}
+
+void job_process(job_t*job)
+{
+    if(config_fork_for_training) {
+        process_jobs_forked(job, 1, 1);
+    } else {
+        job->model = train_model(job->factory, job->data);
+    }
 }
 
 static void process_jobs(jobqueue_t*jobs)
@@ -93,9 +216,295 @@ static void process_jobs(jobqueue_t*jobs)
     }
 }
 
+typedef struct _threadpool {
+    pthread_mutex_t mutex;
+    pthread_cond_t job_finished;
+    job_t*next_job;
+    int num_finished;
+    int num_abandoned;
+} threadpool_t;
+
+typedef struct _worker {
+    pthread_t thread;
+    threadpool_t*pool;
+    job_t*job;
+    time_t start_time;
+    bool abandoned;
+} worker_t;
+
+static void* worker_main(void*_worker)
+{
+    worker_t*w = (worker_t*)_worker;
+    threadpool_t*pool = w->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    while(pool->next_job) {
+        job_t*job = pool->next_job;
+        pool->next_job = job->next;
+        w->job = job;
+        w->start_time = time(0);
+        model_factory_t*factory = job->factory;
+        dataset_t*data = job->data;
+        pthread_mutex_unlock(&pool->mutex);
+
+        model_t*m = train_model(factory, data);
+
+        pthread_mutex_lock(&pool->mutex);
+        if(w->abandoned) {
+            /* we took too long, and the job was already marked as failed.
+               The job might not even exist anymore. */
+            if(m) {
+                model_destroy(m);
+            }
+            break;
+        }
+        job->model = m;
+        w->job = 0;
+        pool->num_finished++;
+        pthread_cond_signal(&pool->job_finished);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+static worker_t* worker_start(threadpool_t*pool)
+{
+    worker_t*w = calloc(1, sizeof(worker_t));
+    w->pool = pool;
+    int ret = pthread_create(&w->thread, NULL, worker_main, w);
+    if(ret) {
+        fprintf(stderr, "Couldn't create thread: %s\n", strerror(ret));
+        exit(1);
+    }
+    return w;
+}
+
+static void process_jobs_threaded(jobqueue_t*jobs, int num_threads)
+{
+    /* make sure the node types are set up before any thread starts
+       creating nodes */
+    nodelist_init();
+    /* OpenCV creates the TLS key for its per thread generator the first
+       time it's used, without any locking. Do that here, before two
+       workers can race for it. */
+    reset_random_number_generator();
+
+    threadpool_t*pool = calloc(1, sizeof(threadpool_t));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->job_finished, NULL);
+    pool->next_job = jobs->first;
+
+    if(num_threads > jobs->num)
+        num_threads = jobs->num;
+
+    worker_t**workers = malloc(sizeof(worker_t*)*num_threads);
+    int t;
+    pthread_mutex_lock(&pool->mutex);
+    for(t=0;t<num_threads;t++) {
+        workers[t] = worker_start(pool);
+    }
+
+    printf("\n");
+    while(pool->num_finished + pool->num_abandoned < jobs->num) {
+        printf("\rJob %d / %d", pool->num_finished + pool->num_abandoned, jobs->num);fflush(stdout);
+
+        struct timespec wakeup;
+        clock_gettime(CLOCK_REALTIME, &wakeup);
+        wakeup.tv_sec++;
+        pthread_cond_timedwait(&pool->job_finished, &pool->mutex, &wakeup);
+
+        time_t now = time(0);
+        for(t=0;t<num_threads;t++) {
+            worker_t*w = workers[t];
+            if(w->job && now - w->start_time > config_job_wait_timeout) {
+                printf("\nFailed (timeout): %s\n", w->job->factory->name);
+                /* There's no way to interrupt a thread that's stuck inside
+                   OpenCV. Leave it running, and start a new thread in
+                   its place. */
+                w->abandoned = true;
+                w->job = 0;
+                pthread_detach(w->thread);
+                pool->num_abandoned++;
+                workers[t] = worker_start(pool);
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    for(t=0;t<num_threads;t++) {
+        pthread_join(workers[t]->thread, NULL);
+        free(workers[t]);
+    }
+    free(workers);
+
+    jobs->num_abandoned += pool->num_abandoned;
+    if(!pool->num_abandoned) {
+        pthread_cond_destroy(&pool->job_finished);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+    } else {
+        /* abandoned threads still reference the pool (and their worker_t)
+           once they finish, so those have to stay around */
+    }
+}
+
+typedef struct _pending_job {
+    job_t*job;
+    remote_dataset_t*data;
+    double cost;
+    double deadline;
+
+    remote_job_t*remote;
+    double started;
+
+    /* a copy of the job on another server, started if the first one
+       takes much longer than expected. The first result wins. */
+    remote_job_t*hedge;
+    double hedge_started;
+    double hedge_deadline;
+    bool hedged;
+
+    /* how long the job took, relative to how long we expected it to take */
+    double ratio;
+    bool finished;
+} pending_job_t;
+
+static int compare_cost(const void*_a, const void*_b)
+{
+    const pending_job_t*a = (const pending_job_t*)_a;
+    const pending_job_t*b = (const pending_job_t*)_b;
+    if(a->cost > b->cost)
+        return -1;
+    if(a->cost < b->cost)
+        return 1;
+    return 0;
+}
+
+/* binary min-heap of pending jobs, ordered by deadline */
+typedef struct _timer_heap {
+    pending_job_t**entries;
+    int num;
+} timer_heap_t;
+
+static void timer_heap_push(timer_heap_t*h, pending_job_t*p)
+{
+    int pos = h->num++;
+    while(pos > 0) {
+        int parent = (pos-1)/2;
+        if(h->entries[parent]->deadline <= p->deadline)
+            break;
+        h->entries[pos] = h->entries[parent];
+        pos = parent;
+    }
+    h->entries[pos] = p;
+}
+
+static pending_job_t* timer_heap_pop(timer_heap_t*h)
+{
+    pending_job_t*top = h->entries[0];
+    pending_job_t*last = h->entries[--h->num];
+    int pos = 0;
+    while(1) {
+        int child = pos*2+1;
+        if(child >= h->num)
+            break;
+        if(child+1 < h->num && h->entries[child+1]->deadline < h->entries[child]->deadline)
+            child++;
+        if(last->deadline <= h->entries[child]->deadline)
+            break;
+        h->entries[pos] = h->entries[child];
+        pos = child;
+    }
+    if(h->num)
+        h->entries[pos] = last;
+    return top;
+}
+
+typedef struct _duration {
+    double ratio;
+    bool finished;
+} duration_t;
+
+static int compare_duration(const void*_a, const void*_b)
+{
+    const duration_t*a = (const duration_t*)_a;
+    const duration_t*b = (const duration_t*)_b;
+    if(a->ratio != b->ratio)
+        return a->ratio < b->ratio ? -1 : 1;
+    return b->finished - a->finished;
+}
+
+/* The given percentile of how long jobs take relative to their expected
+   duration (elapsed seconds per cost unit), or -1 if we can't tell yet.
+   Jobs still running only tell us that they take at least as long as
+   they already did, so this is a Kaplan-Meier estimate: Otherwise, the
+   cheap jobs, finishing first, would make everything else look slow. */
+static double duration_percentile(pending_job_t*pending, int num, duration_t*durations, double now, double percentile)
+{
+    int t, n = 0;
+    for(t=0;t<num;t++) {
+        pending_job_t*p = &pending[t];
+        if(p->finished) {
+            durations[n].ratio = p->ratio;
+            durations[n].finished = true;
+            n++;
+        } else if(p->remote) {
+            durations[n].ratio = (now - p->started) / p->remote->expected;
+            durations[n].finished = false;
+            n++;
+        } else if(p->hedge) {
+            durations[n].ratio = (now - p->hedge_started) / p->hedge->expected;
+            durations[n].finished = false;
+            n++;
+        }
+    }
+    qsort(durations, n, sizeof(duration_t), compare_duration);
+    double survival = 1.0;
+    for(t=0;t<n;t++) {
+        if(!durations[t].finished)
+            continue;
+        survival *= 1.0 - 1.0 / (n - t);
+        if(survival <= 1.0 - percentile)
+            return durations[t].ratio;
+    }
+    return -1;
+}
+
+static bool pending_job_is_open(pending_job_t*p)
+{
+    return p->remote || p->hedge;
+}
+
+static double now_in_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
 static void process_jobs_remotely(jobqueue_t*jobs)
 {
-    remote_job_t**r = malloc(sizeof(reader_t*)*jobs->num);
+    pending_job_t*pending = calloc(jobs->num, sizeof(pending_job_t));
+    timer_heap_t timeouts;
+    timeouts.entries = malloc(sizeof(pending_job_t*)*jobs->num);
+    timeouts.num = 0;
+
+    double start_time = now_in_seconds();
+    double start_cpu = cpu_seconds();
+
+    /* every distinct dataset is only serialized once, and only sent
+       to a server if that server doesn't have it yet */
+    dataset_t**data = malloc(sizeof(dataset_t*)*jobs->num);
+    remote_dataset_t**remote_data = malloc(sizeof(remote_dataset_t*)*jobs->num);
+    int num_data = 0;
 
     /* ignore sigpipe events, causing write calls to closed network
        sockets to return an error instead of halting the program */
@@ -104,43 +513,171 @@ static void process_jobs_remotely(jobqueue_t*jobs)
     job_t*job;
     int pos = 0;
     for(job=jobs->first;job;job=job->next) {
-	r[pos] = remote_job_start(job->factory->name, job->data);
-        job->model = 0;
+        pending[pos].job = job;
+        pending[pos].cost = model_factory_cost(job->factory, job->data);
         pos++;
     }
+    /* start the most expensive jobs first, so that the cheap ones
+       can fill the gaps at the end */
+    qsort(pending, jobs->num, sizeof(pending_job_t), compare_cost);
+
+    for(pos=0;pos<jobs->num;pos++) {
+        pending_job_t*p = &pending[pos];
+        job = p->job;
+        int t;
+        for(t=0;t<num_data;t++) {
+            if(data[t] == job->data)
+                break;
+        }
+        if(t == num_data) {
+            data[num_data] = job->data;
+            remote_data[num_data] = remote_dataset_new(job->data);
+            num_data++;
+        }
+        p->data = remote_data[t];
+	p->remote = remote_job_start(job->factory->name, p->data);
+        p->remote->owner = p;
+        p->started = now_in_seconds();
+        p->deadline = p->started + config_model_timeout;
+        timer_heap_push(&timeouts, p);
+        job->model = 0;
+    }
+
+    duration_t*durations = malloc(sizeof(duration_t)*jobs->num);
+
     int open_jobs = jobs->num;
     printf("%d open jobs\n", open_jobs);
     while(open_jobs) {
-        int pos = 0;
-        for(job=jobs->first;job;job=job->next) {
-            if(r[pos]) {
-                if(!job->model && remote_job_is_ready(r[pos])) {
-                    job->model = remote_job_read_result(r[pos]);
-		    if(job->model) {
-			printf("Finished: %s\n", job->factory->name);
-		    } else {
-			printf("Failed (bad data): %s\n", job->factory->name);
-		    }
-                    r[pos] = 0;
-                    open_jobs--;
-                } else if(remote_job_age(r[pos]) > config_model_timeout) {
-                    printf("Failed (timeout): %s\n", job->factory->name);
-                    remote_job_cancel(r[pos]);
-                    r[pos] = 0;
-                    open_jobs--;
+        while(timeouts.num && !pending_job_is_open(timeouts.entries[0])) {
+            timer_heap_pop(&timeouts);
+        }
+
+        /* a job is a straggler once it ran longer, relative to its
+           expected duration, than most jobs take */
+        double slowness = -1;
+        if(config_remote_hedge_percentile > 0) {
+            slowness = duration_percentile(pending, jobs->num, durations, now_in_seconds(), config_remote_hedge_percentile);
+        }
+        bool hedging = slowness >= 0;
+
+        /* sleep until either a result comes in, the next job runs
+           out of time, or the next job turns into a straggler */
+        double wakeup = -1;
+        if(timeouts.num) {
+            wakeup = timeouts.entries[0]->deadline;
+        }
+        if(hedging) {
+            for(pos=0;pos<jobs->num;pos++) {
+                pending_job_t*p = &pending[pos];
+                if(!p->remote || p->hedged)
+                    continue;
+                double hedge_at = p->started + slowness * p->remote->expected;
+                if(wakeup < 0 || hedge_at < wakeup)
+                    wakeup = hedge_at;
+            }
+        }
+        int wait_ms = -1;
+        if(wakeup >= 0) {
+            double left = wakeup - now_in_seconds();
+            wait_ms = left > 0 ? (int)(left*1000) + 1 : 0;
+        }
+
+        remote_job_t*r = remote_job_wait(wait_ms);
+        if(r) {
+            pending_job_t*p = (pending_job_t*)r->owner;
+            job = p->job;
+            bool is_hedge = r == p->hedge;
+            double elapsed = now_in_seconds() - (is_hedge ? p->hedge_started : p->started);
+            double expected = r->expected;
+            model_t*m = remote_job_read_result(r);
+            remote_job_t*other;
+            if(is_hedge) {
+                p->hedge = 0;
+                other = p->remote;
+            } else {
+                p->remote = 0;
+                other = p->hedge;
+            }
+            if(m) {
+                p->ratio = elapsed / expected;
+                p->finished = true;
+                printf("Finished: %s%s\n", job->factory->name, is_hedge ? " (copy)" : "");
+                if(other) {
+                    remote_job_cancel(other);
+                    p->remote = p->hedge = 0;
                 }
+                job->model = m;
+                open_jobs--;
+            } else if(other) {
+                printf("Failed on one server, still waiting for the other: %s\n", job->factory->name);
+            } else {
+                printf("Failed (bad data): %s\n", job->factory->name);
+                open_jobs--;
             }
-            pos++;
         }
+
+        double now = now_in_seconds();
+        if(hedging) {
+            for(pos=0;pos<jobs->num;pos++) {
+                pending_job_t*p = &pending[pos];
+                if(!p->remote || p->hedged)
+                    continue;
+                if(now < p->started + slowness * p->remote->expected)
+                    continue;
+                p->hedged = true;
+                p->hedge = remote_job_start_elsewhere(p->job->factory->name, p->data, p->remote);
+                if(p->hedge) {
+                    printf("Starting copy of slow job: %s\n", p->job->factory->name);
+                    p->hedge->owner = p;
+                    p->hedge_started = now;
+                    p->hedge_deadline = now + config_model_timeout;
+                }
+            }
+        }
+
+        while(timeouts.num && timeouts.entries[0]->deadline <= now) {
+            pending_job_t*p = timer_heap_pop(&timeouts);
+            if(!pending_job_is_open(p))
+                continue;
+            if(p->hedge && p->hedge_deadline > now) {
+                /* the copy gets its own time */
+                p->deadline = p->hedge_deadline;
+                timer_heap_push(&timeouts, p);
+                continue;
+            }
+            printf("Failed (timeout): %s\n", p->job->factory->name);
+            if(p->remote)
+                remote_job_cancel(p->remote);
+            if(p->hedge)
+                remote_job_cancel(p->hedge);
+            p->remote = p->hedge = 0;
+            open_jobs--;
+        }
+    }
+    printf("%d remote jobs in %.2fs, %.2fs of local cpu time\n",
+            jobs->num, now_in_seconds() - start_time, cpu_seconds() - start_cpu);
+
+    int t;
+    for(t=0;t<num_data;t++) {
+        remote_dataset_destroy(remote_data[t]);
     }
-    free(r);
+    free(remote_data);
+    free(data);
+    free(durations);
+    free(timeouts.entries);
+    free(pending);
     signal(SIGPIPE, old_sigpipe);
 }
 
 void jobqueue_process(jobqueue_t*jobs)
 {
+    int num_threads = config_get_num_threads();
     if(config_do_remote_processing) {
         process_jobs_remotely(jobs);
+    } else if(config_fork_for_training && jobs->num) {
+        process_jobs_forked(jobs->first, jobs->num, num_threads);
+    } else if(num_threads > 1 && jobs->num > 1) {
+        process_jobs_threaded(jobs, num_threads);
     } else {
         process_jobs(jobs);
     }
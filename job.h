@@ -40,12 +40,17 @@ typedef struct _jobqueue {
     job_t*first;
     job_t*last;
     int num;
+
+    /* jobs that timed out, but whose thread is still running, and
+       still reading from the job's dataset */
+    int num_abandoned;
 } jobqueue_t;
 
 jobqueue_t*jobqueue_new();
 void jobqueue_append(jobqueue_t*queue, job_t*job);
 void jobqueue_delete_job(jobqueue_t*queue, job_t*job);
 void jobqueue_process(jobqueue_t*);
+void job_process(job_t*job);
 void jobqueue_print(jobqueue_t*);
 jobqueue_t*jobqueue_destroy();
 void job_destroy(job_t*j);
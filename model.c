@@ -23,6 +23,8 @@
 #include <memory.h>
 #include "mrscake.h"
 #include "ast.h"
+#include "ast_transforms.h"
+#include "bytecode.h"
 #include "io.h"
 #include "stringpool.h"
 
@@ -207,15 +209,34 @@ void signature_destroy(signature_t*s)
 variable_t model_predict(model_t*m, row_t*row)
 {
     node_t*code = (node_t*)m->code;
-    environment_t*e = environment_new(code, row);
+    if(m->num_locals < 0) {
+        m->num_locals = node_highest_local(code);
+    }
+
+    /* Borrow the cached environment. If some other thread is using it
+       right now, use a temporary one. */
+    environment_t*e = (environment_t*)__sync_lock_test_and_set(&m->environment, NULL);
+    if(e) {
+        environment_reset(e, row);
+    } else {
+        e = environment_new_with_locals(m->num_locals, row);
+    }
+
     constant_t c = node_eval(code, e);
-    environment_destroy(e);
+
+    if(!__sync_bool_compare_and_swap(&m->environment, NULL, e)) {
+        environment_destroy(e);
+    }
     return constant_to_variable(&c);
 }
 void model_destroy(model_t*m)
 {
     if(m->code)
         node_destroy(m->code);
+    if(m->program)
+        program_destroy(m->program);
+    if(m->environment)
+        environment_destroy(m->environment);
     free(m);
     /* FIXME: since the signature is originally part of the dataset,
        we can't destroy it here. */
@@ -135,13 +135,14 @@ class CodeGeneratingANN: public CvANN_MLP
 	    int o = var_offset[j];
 	    w = weights[j];
 	    for(x=0;x<w_cols;x++) {
+		array_t*column = array_new(w_rows);
+		for(y=0;y<w_rows;y++) {
+		    column->entries[y] = float_constant(w[w_cols*y+x]);
+		}
 		SETLOCAL(o+x)
-		    ADD
+		    DOT(column)
 		    for(y=0;y<w_rows;y++) {
-			MUL
-			    GETLOCAL(var_offset[j-1]+y);
-			    FLOAT_CONSTANT(w[w_cols*y+x]);
-			END;
+			GETLOCAL(var_offset[j-1]+y);
 		    }
 		    END;
 		END;
@@ -313,10 +314,10 @@ static model_t*ann_train(ann_model_factory_t*factory, dataset_t*d)
 
     CvANN_MLP_TrainParams ann_params;
     CodeGeneratingANN ann(d, input_width, output_width, layers, factory->activation_function, 0.0, 0.0);
-    CvMat* ann_input;
-    CvMat* ann_response;
-    make_ml_multicolumn(d, &ann_input, &ann_response, num_rows, true);
-    ann.train(ann_input, ann_response, NULL, NULL, ann_params, 0x0000);
+    CvMat ann_input;
+    CvMat ann_response;
+    cv_multicolumn_rows(d, &ann_input, &ann_response, num_rows, true);
+    ann.train(&ann_input, &ann_response, NULL, NULL, ann_params, 0x0000);
 
     model_t*m = model_new(d);
     m->code = ann.get_program();
@@ -326,15 +327,27 @@ static model_t*ann_train(ann_model_factory_t*factory, dataset_t*d)
 #endif
 
     cvReleaseMat(&layers);
-    cvReleaseMat(&ann_input);
-    cvReleaseMat(&ann_response);
     return m;
 }
 
+static double ann_cost(ann_model_factory_t*factory, dataset_t*d)
+{
+    double num_rows = training_set_size(d->num_rows);
+    int input_width = count_multiclass_columns(d);
+    int output_width = d->desired_response->num_classes;
+    int hidden_width = (input_width+output_width)/2;
+    double weights = factory->num_layers == 2 ?
+                         input_width * output_width :
+                         (factory->num_layers-3) * hidden_width * hidden_width +
+                         (input_width + output_width) * hidden_width;
+    return 10.0 * num_rows * weights;
+}
+
 static ann_model_factory_t ann_2sigmoid_model_factory = {
     head: {
         name: "neuronal network (sigmoid) with 2 layers",
         train: (training_function_t)ann_train,
+        cost: (cost_function_t)ann_cost,
     },
     activation_function: CvANN_MLP::SIGMOID_SYM,
     num_layers: 2,
@@ -344,6 +357,7 @@ static ann_model_factory_t ann_2gaussian_model_factory = {
     head: {
         name: "neuronal network (gaussian) with 2 layers",
         train: (training_function_t)ann_train,
+        cost: (cost_function_t)ann_cost,
     },
     activation_function: CvANN_MLP::GAUSSIAN,
     num_layers: 2,
@@ -353,6 +367,7 @@ static ann_model_factory_t ann_2identity_model_factory = {
     head: {
         name: "neuronal network (id) with 2 layers",
         train: (training_function_t)ann_train,
+        cost: (cost_function_t)ann_cost,
     },
     activation_function: CvANN_MLP::IDENTITY,
     num_layers: 2,
@@ -362,6 +377,7 @@ static ann_model_factory_t ann_3sigmoid_model_factory = {
     head: {
         name: "neuronal network (sigmoid) with 3 layers",
         train: (training_function_t)ann_train,
+        cost: (cost_function_t)ann_cost,
     },
     activation_function: CvANN_MLP::SIGMOID_SYM,
     num_layers: 3,
@@ -371,6 +387,7 @@ static ann_model_factory_t ann_3gaussian_model_factory = {
     head: {
         name: "neuronal network (gaussian) with 3 layers",
         train: (training_function_t)ann_train,
+        cost: (cost_function_t)ann_cost,
     },
     activation_function: CvANN_MLP::GAUSSIAN,
     num_layers: 3,
@@ -380,6 +397,7 @@ static ann_model_factory_t ann_3identity_model_factory = {
     head: {
         name: "neuronal network (id) with 3 layers",
         train: (training_function_t)ann_train,
+        cost: (cost_function_t)ann_cost,
     },
     activation_function: CvANN_MLP::IDENTITY,
     num_layers: 3,
@@ -23,6 +23,7 @@
 #include "mrscake.h"
 #include "dataset.h"
 #include "easy_ast.h"
+#include "forest.h"
 #include "model_select.h"
 
 //#define VERIFY 1
@@ -140,6 +141,46 @@ static void walk_dtree_node(CvDTreeTrainData* data, int pruned_tree_idx, dataset
     END;
 }
 
+static void walk_forest_node(CvDTreeTrainData* data, int pruned_tree_idx, dataset_t*dataset, CvDTreeNode*node, forest_t*forest, float scale)
+{
+    const int*vtype = data->var_type->data.i;
+
+    if(node->Tn <= pruned_tree_idx || !node->left) {
+        if(forest->kind == FOREST_VOTE) {
+            forest_add_leaf(forest, (int)floor(node->value+FLT_EPSILON), 0);
+        } else {
+            /* same rounding as MUL(FLOAT_CONSTANT(value), FLOAT_CONSTANT(scale)) */
+            forest_add_leaf(forest, 0, (float)node->value * scale);
+        }
+        return;
+    }
+
+    CvDTreeSplit* split = node->split;
+    int ci = vtype[split->var_idx];
+    int column = dataset->columns[split->var_idx]->index;
+    int n;
+    if(ci<0) { // ordered
+        n = forest_add_split(forest, column, split->ord.c, split->inversed);
+    } else { //categorical
+        array_t*a = parse_bitfield(data, dataset, split->var_idx, ci, split->subset);
+        n = forest_add_category_split(forest, column, a, split->inversed);
+    }
+    walk_forest_node(data, pruned_tree_idx, dataset, node->left, forest, scale);
+    forest_set_right(forest, n);
+    walk_forest_node(data, pruned_tree_idx, dataset, node->right, forest, scale);
+}
+
+static forest_t* voting_forest(CvForestTree**trees, int ntrees, dataset_t*dataset)
+{
+    forest_t*forest = forest_new(FOREST_VOTE, dataset_classes_as_array(dataset));
+    int k;
+    for(k=0; k<ntrees; k++) {
+        forest_start_tree(forest, 0);
+        walk_forest_node(trees[k]->data, trees[k]->pruned_tree_idx, dataset, trees[k]->root, forest, 1.0);
+    }
+    return forest;
+}
+
 class CodeGeneratingDTree: public CvDTree
 {
     public:
@@ -191,28 +232,7 @@ class CodeGeneratingRTrees: public CvRTrees
             // optimization: if it's just a single tree, we don't need voting
             walk_dtree_node(trees[0]->data,trees[0]->pruned_tree_idx,dataset,trees[0]->root,current_node,true,false);
         } else {
-            SETLOCAL(0)
-                ARRAY_NEW(dataset->desired_response->num_classes);
-            END;
-
-            int k;
-            for(k=0; k<ntrees; k++)
-            {
-                SETLOCAL(k+1)
-                    walk_dtree_node(trees[k]->data,trees[k]->pruned_tree_idx,dataset,trees[k]->root,current_node,false,false);
-                END;
-                ARRAY_AT_POS_INC
-                    GETLOCAL(0);
-                    GETLOCAL(k+1);
-                END;
-            }
-
-            ARRAY_AT_POS
-                ARRAY_CONSTANT(dataset_classes_as_array(dataset));
-                ARRAY_ARG_MAX_I;
-                    GETLOCAL(0);
-                END;
-            END;
+            FOREST(voting_forest(trees, ntrees, dataset));
         }
 
         END;
@@ -241,28 +261,7 @@ class CodeGeneratingERTrees: public CvERTrees
         if(ntrees == 1) {
             walk_dtree_node(trees[0]->data,trees[0]->pruned_tree_idx,dataset,trees[0]->root,current_node,true,false);
         } else {
-            SETLOCAL(0)
-                ARRAY_NEW(dataset->desired_response->num_classes);
-            END;
-
-            int k;
-            for(k=0; k<ntrees; k++)
-            {
-                SETLOCAL(k+1)
-                    walk_dtree_node(trees[k]->data,trees[k]->pruned_tree_idx,dataset,trees[k]->root,current_node,false,false);
-                END;
-                ARRAY_AT_POS_INC
-                    GETLOCAL(0);
-                    GETLOCAL(k+1);
-                END;
-            }
-
-            ARRAY_AT_POS
-                ARRAY_CONSTANT(dataset_classes_as_array(dataset));
-                ARRAY_ARG_MAX_I;
-                    GETLOCAL(0);
-                END;
-            END;
+            FOREST(voting_forest(trees, ntrees, dataset));
         }
         END;
         END_CODE;
@@ -284,42 +283,29 @@ class CodeGeneratingGBTrees: public CvGBTrees
 
     node_t* get_program() const
     {
-        START_CODE(code)
-        BLOCK
         assert(weak);
 
+        forest_t*forest = forest_new(FOREST_SUM, dataset_classes_as_array(dataset));
         CvSeqReader reader;
         int weak_count = cvSliceLength( CV_WHOLE_SEQ, weak[class_count-1] );
         CvDTree* tree;
-        int var_index = 0;
         for(int i=0; i<class_count; ++i) {
 	    int orig_class_label = class_labels->data.i[i];
-            SETLOCAL(orig_class_label)
-                ADD
-                    if ((weak[i]) && (weak_count)) {
-                        cvStartReadSeq( weak[i], &reader );
-                        cvSetSeqReaderPos( &reader, CV_WHOLE_SEQ.start_index );
-                        for (int j=0; j<weak_count; ++j)
-                        {
-                            CV_READ_SEQ_ELEM( tree, reader );
-                            MUL
-                                walk_dtree_node(tree->data, tree->pruned_tree_idx, dataset, tree->root, current_node, false, true);
-                                FLOAT_CONSTANT(params.shrinkage);
-                            END;
-                        }
-                    }
-                END;
-            END;
-        }
-        ARRAY_AT_POS
-            ARRAY_CONSTANT(dataset_classes_as_array(dataset));
-            ARG_MAX_F;
-                for(int i=0; i<dataset->desired_response->num_classes; ++i) {
-                    GETLOCAL(i);
+            if ((weak[i]) && (weak_count)) {
+                cvStartReadSeq( weak[i], &reader );
+                cvSetSeqReaderPos( &reader, CV_WHOLE_SEQ.start_index );
+                for (int j=0; j<weak_count; ++j)
+                {
+                    CV_READ_SEQ_ELEM( tree, reader );
+                    forest_start_tree(forest, orig_class_label);
+                    walk_forest_node(tree->data, tree->pruned_tree_idx, dataset, tree->root, forest, params.shrinkage);
                 }
-            END;
-        END;
+            }
+        }
 
+        START_CODE(code)
+        BLOCK
+            FOREST(forest);
         END;
         END_CODE;
 
@@ -354,11 +340,12 @@ static int get_max_trees(dtree_model_factory_t*factory, dataset_t*d)
 
 static model_t*dtree_train(dtree_model_factory_t*factory, dataset_t*d)
 {
-    CvMLDataFromExamples data(d);
+    CvDatasetView data(d);
 
     CodeGeneratingDTree dtree(d);
     CvDTreeParams cvd_params(16, 1, 0, factory->use_surrogate_splits, 16, 0, false, false, 0);
-    dtree.train(&data, cvd_params);
+    dtree.train(data.values, data.tflag, data.responses, data.var_idx,
+                data.train_sample_idx, data.var_types, data.missing, cvd_params);
 
     model_t*m = model_new(d);
     m->code = dtree.get_program();
@@ -371,13 +358,14 @@ static model_t*dtree_train(dtree_model_factory_t*factory, dataset_t*d)
 
 static model_t*rtrees_train(dtree_model_factory_t*factory, dataset_t*d)
 {
-    CvMLDataFromExamples data(d);
+    CvDatasetView data(d);
     CodeGeneratingRTrees rtrees(d);
     int max_trees = get_max_trees(factory, d);
     if(!max_trees)
         return 0;
     CvRTParams params(16, 2, 0, false, 16, 0, true, 0, max_trees, 0, CV_TERMCRIT_ITER);
-    rtrees.train(&data, params);
+    rtrees.train(data.values, data.tflag, data.responses, data.var_idx,
+                 data.train_sample_idx, data.var_types, data.missing, params);
     model_t*m = model_new(d);
     m->code = rtrees.get_program();
     return m;
@@ -390,13 +378,14 @@ static model_t*ertrees_train(dtree_model_factory_t*factory, dataset_t*d)
            single ordered predictor (see ertrees.cpp:1827) */
         return 0;
     }
-    CvMLDataFromExamples data(d);
+    CvDatasetView data(d);
     CodeGeneratingERTrees ertrees(d);
     int max_trees = get_max_trees(factory, d);
     if(!max_trees)
         return 0;
     CvRTParams params(16, 2, 0, false, 16, 0, true, 0, max_trees, 0, CV_TERMCRIT_ITER);
-    ertrees.train(&data, params);
+    ertrees.train(data.values, data.tflag, data.responses, data.var_idx,
+                  data.train_sample_idx, data.var_types, data.missing, params);
     model_t*m = model_new(d);
     m->code = ertrees.get_program();
     return m;
@@ -404,22 +393,42 @@ static model_t*ertrees_train(dtree_model_factory_t*factory, dataset_t*d)
 
 static model_t*gbtrees_train(dtree_model_factory_t*factory, dataset_t*d)
 {
-    CvMLDataFromExamples data(d);
+    /* CvGBTrees evaluates its trees on the rows of the training matrix */
+    CvDatasetView data(d, true);
     CodeGeneratingGBTrees gbtrees(d);
 
     CvGBTreesParams params;
     params.loss_function_type = CvGBTrees::DEVIANCE_LOSS; // classification, not regression
-    gbtrees.train(&data, params);
+    gbtrees.train(data.values, data.tflag, data.responses, data.var_idx,
+                  data.train_sample_idx, data.var_types, data.missing, params);
 
     model_t*m = model_new(d);
     m->code = gbtrees.get_program();
     return m;
 }
 
+static double dtree_cost(dtree_model_factory_t*factory, dataset_t*d)
+{
+    return (double)d->num_rows * d->num_columns * log2(d->num_rows+1);
+}
+
+static double rtrees_cost(dtree_model_factory_t*factory, dataset_t*d)
+{
+    /* every split only looks at sqrt(num_columns) random columns */
+    int num_trees = get_max_trees(factory, d);
+    return 2.5 * num_trees * d->num_rows * sqrt(d->num_columns) * log2(d->num_rows+1);
+}
+
+static double gbtrees_cost(dtree_model_factory_t*factory, dataset_t*d)
+{
+    return 40.0 * d->num_rows * d->num_columns * log2(d->num_rows+1);
+}
+
 static dtree_model_factory_t dtree_model_factory = {
     {
         name: "dtree",
         train: (training_function_t)dtree_train,
+        cost: (cost_function_t)dtree_cost,
     },
     max_trees_divide: 0,
     use_surrogate_splits: 0,
@@ -428,6 +437,7 @@ static dtree_model_factory_t dtree_s_model_factory = {
     {
         name: "dtree (with surrogate splits)",
         train: (training_function_t)dtree_train,
+        cost: (cost_function_t)dtree_cost,
     },
     max_trees_divide: 0,
     use_surrogate_splits: 1,
@@ -436,6 +446,7 @@ static dtree_model_factory_t rtrees_model_factory = {
     {
         name: "rtrees",
         train: (training_function_t)rtrees_train,
+        cost: (cost_function_t)rtrees_cost,
     },
     max_trees_divide: 1,
 };
@@ -443,6 +454,7 @@ static dtree_model_factory_t rtrees2_model_factory = {
     {
         name: "rtrees (n/2 trees)",
         train: (training_function_t)rtrees_train,
+        cost: (cost_function_t)rtrees_cost,
     },
     max_trees_divide: 2,
 };
@@ -450,6 +462,7 @@ static dtree_model_factory_t rtrees4_model_factory = {
     {
         name: "rtrees (n/4 trees)",
         train: (training_function_t)rtrees_train,
+        cost: (cost_function_t)rtrees_cost,
     },
     max_trees_divide: 4,
 };
@@ -457,6 +470,7 @@ static dtree_model_factory_t rtrees8_model_factory = {
     {
         name: "rtrees (n/8 trees)",
         train: (training_function_t)rtrees_train,
+        cost: (cost_function_t)rtrees_cost,
     },
     max_trees_divide: 8,
 };
@@ -464,6 +478,7 @@ static dtree_model_factory_t rtrees16_model_factory = {
     {
         name: "rtrees (n/16 trees)",
         train: (training_function_t)rtrees_train,
+        cost: (cost_function_t)rtrees_cost,
     },
     max_trees_divide: 16,
 };
@@ -471,6 +486,7 @@ static dtree_model_factory_t ertrees_model_factory = {
     {
         name: "ertrees",
         train: (training_function_t)ertrees_train,
+        cost: (cost_function_t)rtrees_cost,
     },
     max_trees_divide: 1,
 };
@@ -478,6 +494,7 @@ static dtree_model_factory_t ertrees2_model_factory = {
     {
         name: "ertrees (n/2 trees)",
         train: (training_function_t)ertrees_train,
+        cost: (cost_function_t)rtrees_cost,
     },
     max_trees_divide: 2,
 };
@@ -485,6 +502,7 @@ static dtree_model_factory_t ertrees4_model_factory = {
     {
         name: "ertrees (n/4 trees)",
         train: (training_function_t)ertrees_train,
+        cost: (cost_function_t)rtrees_cost,
     },
     max_trees_divide: 4,
 };
@@ -492,6 +510,7 @@ static dtree_model_factory_t ertrees8_model_factory = {
     {
         name: "ertrees (n/8 trees)",
         train: (training_function_t)ertrees_train,
+        cost: (cost_function_t)rtrees_cost,
     },
     max_trees_divide: 8,
 };
@@ -499,6 +518,7 @@ static dtree_model_factory_t ertrees16_model_factory = {
     {
         name: "ertrees (n/16 trees)",
         train: (training_function_t)ertrees_train,
+        cost: (cost_function_t)rtrees_cost,
     },
     max_trees_divide: 16,
 };
@@ -506,6 +526,7 @@ static dtree_model_factory_t gbtrees_model_factory = {
     {
         name: "gbtrees",
         train: (training_function_t)gbtrees_train,
+        cost: (cost_function_t)gbtrees_cost,
     },
     max_trees_divide: 0,
     use_surrogate_splits: 0,
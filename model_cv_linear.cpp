@@ -64,24 +64,24 @@ class CodeGeneratingLinearSVM: public CvSVM
         }
 
         int var_count = get_var_count();
+        int sv_count = df->sv_count;
+        float*weights = (float*)malloc(sizeof(float)*var_count);
+        int v;
+        for(v=0;v<var_count;v++) {
+            double sum = 0.0;
+            int k;
+            for(k = 0; k < sv_count; k++) {
+                sum += sv[df->sv_index[k]][v]*df->alpha[k];
+            }
+            weights[v] = sum;
+        }
         START_CODE(code)
         ADD
             FLOAT_CONSTANT(-df->rho);
-            int sv_count = df->sv_count;
-            int v;
-            for(v=0;v<var_count;v++) {
-                double sum = 0.0;
-                int k;
-                for(k = 0; k < sv_count; k++) {
-                    sum += sv[df->sv_index[k]][v]*df->alpha[k];
-                }
-                MUL
-                    INSERT_NODE(expanded_columns_parameter_code(expanded_columns, v))
-                    FLOAT_CONSTANT(sum)
-                END;
-            }
+            expanded_columns_append_dot(expanded_columns, current_node, weights);
         END;
         END_CODE;
+        free(weights);
         return(code);
     }
 
@@ -170,28 +170,32 @@ static model_t*svm_train(svm_model_factory_t*factory, dataset_t*d)
                                      /*degree*/0, /*gamma*/1, /*coef0*/0, /*C*/1,
                                      /*nu*/0, /*p*/0, /*class_weights*/0,
                                      cvTermCriteria(CV_TERMCRIT_ITER+CV_TERMCRIT_EPS, 1000, FLT_EPSILON));
-    CvMat* input;
-    CvMat* response;
-    make_ml_multicolumn(d, &input, &response, num_rows, false);
+    CvMat input;
+    CvMat response;
+    cv_multicolumn_rows(d, &input, &response, num_rows, false);
 
     model_t*m = 0;
-    if(svm.train_auto(input, response, 0, 0, params, 5)) {
+    if(svm.train_auto(&input, &response, 0, 0, params, 5)) {
 	m = model_new(d);
         m->code = svm.get_program();
-    } else if(svm.train(input, response, 0, 0, params)) {
+    } else if(svm.train(&input, &response, 0, 0, params)) {
 	m = model_new(d);
         m->code = svm.get_program();
     }
-
-    cvReleaseMat(&input);
-    cvReleaseMat(&response);
     return m;
 }
 
+static double svm_cost(svm_model_factory_t*factory, dataset_t*d)
+{
+    double num_rows = training_set_size(d->num_rows);
+    return 10.0 * num_rows * num_rows * d->num_columns;
+}
+
 static svm_model_factory_t simplified_linear_svm_model_factory = {
     head: {
         name: "simplified linear svm",
         train: (training_function_t)svm_train,
+        cost: (cost_function_t)svm_cost,
     },
     CvSVM::LINEAR
 };
@@ -89,20 +89,19 @@ class CodeGeneratingSVM: public CvSVM
             assert(!"polynomial kernel not supported yet");
         } else if(params.kernel_type == CvSVM::SIGMOID) {
             //calc_sigmoid(vcount, var_count, vecs, another, results);
+            float*weights = (float*)malloc(sizeof(float)*var_count);
             int j;
             for(j=0;j<sv_total;j++) {
                 float*vec = sv[j];
                 double mul = -2*params.gamma; //"alpha"
                 double add = -2*params.coef0; //"beta"
+                int k;
+                for(k=0;k<var_count;k++) {
+                    weights[k] = vec[k]*mul;
+                }
                 SETLOCAL(sv_total+j)
                     ADD
-                        int k;
-                        for(k=0;k<var_count;k++) {
-                            MUL
-                                INSERT_NODE(expanded_columns_parameter_code(expanded_columns, k))
-                                FLOAT_CONSTANT(vec[k]*mul)
-                            END;
-                        }
+                        expanded_columns_append_dot(expanded_columns, current_node, weights);
                         FLOAT_CONSTANT(add);
                     END;
                 END;
@@ -142,6 +141,7 @@ class CodeGeneratingSVM: public CvSVM
                     NOP;
                 END;
             }
+            free(weights);
         } else if(params.kernel_type == CvSVM::LINEAR) {
             //calc_non_rbf_base(vcount, var_count, vecs, another, results, 1, 0);
             int j;
@@ -149,13 +149,7 @@ class CodeGeneratingSVM: public CvSVM
                 float*vec = sv[j];
                 SETLOCAL(j)
                     ADD
-                        int k;
-                        for(k=0;k<var_count;k++) {
-                            MUL
-                                INSERT_NODE(expanded_columns_parameter_code(expanded_columns, k))
-                                FLOAT_CONSTANT(vec[k])
-                            END;
-                        }
+                        expanded_columns_append_dot(expanded_columns, current_node, vec);
                     END;
                 END;
             }
@@ -178,11 +172,16 @@ class CodeGeneratingSVM: public CvSVM
                         ADD
                             FLOAT_CONSTANT(-df->rho);
                             int sv_count = df->sv_count;
-                            int k;
-                            for(k = 0; k < sv_count; k++) {
-                                MUL
-                                    FLOAT_CONSTANT(df->alpha[k])
-                                    GETLOCAL(df->sv_index[k]);
+                            if(sv_count) {
+                                array_t*alpha = array_new(sv_count);
+                                int k;
+                                for(k = 0; k < sv_count; k++) {
+                                    alpha->entries[k] = float_constant(df->alpha[k]);
+                                }
+                                DOT(alpha)
+                                    for(k = 0; k < sv_count; k++) {
+                                        GETLOCAL(df->sv_index[k]);
+                                    }
                                 END;
                             }
                         END;
@@ -225,13 +224,13 @@ static model_t*svm_train(svm_model_factory_t*factory, dataset_t*d)
 
     int num_rows = training_set_size(d->num_rows);
 
-    if(factory->kernel == CvSVM::LINEAR && d->num_rows > 1000) {
+    if(factory->kernel == CvSVM::LINEAR && num_rows > 1000) {
         num_rows = 1000;
     }
-    if(factory->kernel == CvSVM::RBF && d->num_rows > 300) {
+    if(factory->kernel == CvSVM::RBF && num_rows > 300) {
         num_rows = 300;
     }
-    if(factory->kernel == CvSVM::SIGMOID && d->num_rows > 200) {
+    if(factory->kernel == CvSVM::SIGMOID && num_rows > 200) {
         num_rows = 200;
     }
 
@@ -240,30 +239,48 @@ static model_t*svm_train(svm_model_factory_t*factory, dataset_t*d)
                                      /*degree*/0, /*gamma*/1, /*coef0*/0, /*C*/1,
                                      /*nu*/0, /*p*/0, /*class_weights*/0,
                                      cvTermCriteria(CV_TERMCRIT_ITER+CV_TERMCRIT_EPS, 1000, FLT_EPSILON));
-    CvMat* input;
-    CvMat* response;
-    make_ml_multicolumn(d, &input, &response, num_rows, false);
+    CvMat input;
+    CvMat response;
+    cv_multicolumn_rows(d, &input, &response, num_rows, false);
 
     bool use_auto_training = d->desired_response->num_classes <= 3;
 
     model_t*m = 0;
-    if(use_auto_training && svm.train_auto(input, response, 0, 0, params, 5)) {
+    if(use_auto_training && svm.train_auto(&input, &response, 0, 0, params, 5)) {
 	m = model_new(d);
         m->code = svm.get_program();
     }
-    if(!m && svm.train(input, response, 0, 0, params)) {
+    if(!m && svm.train(&input, &response, 0, 0, params)) {
 	m = model_new(d);
         m->code = svm.get_program();
     }
-    cvReleaseMat(&input);
-    cvReleaseMat(&response);
     return m;
 }
 
+static double svm_cost(svm_model_factory_t*factory, dataset_t*d)
+{
+    if((factory->kernel == CvSVM::LINEAR && d->desired_response->num_classes > 4) ||
+       (factory->kernel == CvSVM::RBF    && d->desired_response->num_classes > 3)) {
+        return 1;
+    }
+    double num_rows = training_set_size(d->num_rows);
+    if(factory->kernel == CvSVM::LINEAR) {
+        if(num_rows > 1000)
+            num_rows = 1000;
+        return 35.0 * num_rows * num_rows * d->num_columns;
+    } else {
+        /* with at most 200-300 rows, the cross-validation in train_auto()
+           dominates, which hardly depends on the number of rows */
+        double scale = num_rows < 100 ? num_rows / 100 : 1.0;
+        return 3e6 * (d->num_columns + 16) * scale;
+    }
+}
+
 static svm_model_factory_t rbf_svm_model_factory = {
     head: {
         name: "rbf svm",
         train: (training_function_t)svm_train,
+        cost: (cost_function_t)svm_cost,
     },
     CvSVM::RBF
 };
@@ -272,6 +289,7 @@ static svm_model_factory_t sigmoid_svm_model_factory = {
     head: {
         name: "sigmoid svm",
         train: (training_function_t)svm_train,
+        cost: (cost_function_t)svm_cost,
     },
     CvSVM::SIGMOID
 };
@@ -280,6 +298,7 @@ static svm_model_factory_t linear_svm_model_factory = {
     head: {
         name: "linear svm",
         train: (training_function_t)svm_train,
+        cost: (cost_function_t)svm_cost,
     },
     CvSVM::LINEAR
 };
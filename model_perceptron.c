@@ -108,10 +108,16 @@ static model_t*perceptron_train(perceptron_model_factory_t*factory, dataset_t*d)
     return m;
 }
 
+static double perceptron_cost(perceptron_model_factory_t*factory, dataset_t*d)
+{
+    return 100.0 * d->num_rows * d->num_columns;
+}
+
 static perceptron_model_factory_t perceptron_model_factory = {
     head: {
         name: "perceptron",
         train: (training_function_t)perceptron_train,
+        cost: (cost_function_t)perceptron_cost,
     },
 };
 
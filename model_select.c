@@ -27,6 +27,8 @@
 #include <errno.h>
 #include <signal.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include "mrscake.h"
@@ -40,6 +42,7 @@
 #include "settings.h"
 #include "var_selection.h"
 #include "job.h"
+#include "bytecode.h"
 
 #define NUM(l) (sizeof(l)/sizeof((l)[0]))
 
@@ -86,6 +89,13 @@ model_factory_t* model_factory_get_by_name(const char*name)
     return 0;
 }
 
+double model_factory_cost(model_factory_t*factory, dataset_t*data)
+{
+    if(factory->cost)
+        return factory->cost(factory, data);
+    return (double)data->num_rows * data->num_columns;
+}
+
 static jobqueue_t* generate_jobs(varorder_t*order, dataset_t*data)
 {
     jobqueue_t* queue = jobqueue_new();
@@ -126,29 +136,83 @@ static jobqueue_t* generate_jobs(varorder_t*order, dataset_t*data)
 
 extern varorder_t*dtree_var_order(dataset_t*d);
 
+typedef int (*scoring_function_t)(model_t*m, dataset_t*d);
+
+typedef struct _scoring {
+    job_t**jobs;
+    int*scores;
+    int num;
+    int next;
+    dataset_t*data;
+    scoring_function_t score;
+} scoring_t;
+
+static void* score_models(void*_scoring)
+{
+    scoring_t*s = (scoring_t*)_scoring;
+    int i;
+    while((i = __sync_fetch_and_add(&s->next, 1)) < s->num) {
+        model_t*m = s->jobs[i]->model;
+        if(m) {
+            s->scores[i] = s->score(m, s->data);
+        }
+    }
+    return 0;
+}
+
+/* Computes the scores of all trained models. Scoring doesn't modify
+   the models or the dataset, so we can do it on several threads. */
+static int* jobqueue_score(jobqueue_t*jobs, dataset_t*data, scoring_function_t score)
+{
+    scoring_t s;
+    s.num = jobs->num;
+    s.next = 0;
+    s.data = data;
+    s.score = score;
+    s.jobs = (job_t**)malloc(sizeof(job_t*)*jobs->num);
+    s.scores = (int*)malloc(sizeof(int)*jobs->num);
+    job_t*job;
+    int t = 0;
+    for(job=jobs->first;job;job=job->next) {
+        s.scores[t] = INT_MAX;
+        s.jobs[t++] = job;
+    }
+
+    int num_threads = config_get_num_threads();
+    if(num_threads > jobs->num)
+        num_threads = jobs->num;
+    if(num_threads <= 1) {
+        score_models(&s);
+    } else {
+        nodelist_init();
+        pthread_t*threads = (pthread_t*)malloc(sizeof(pthread_t)*num_threads);
+        for(t=0;t<num_threads;t++) {
+            pthread_create(&threads[t], NULL, score_models, &s);
+        }
+        for(t=0;t<num_threads;t++) {
+            pthread_join(threads[t], NULL);
+        }
+        free(threads);
+    }
+    free(s.jobs);
+    return s.scores;
+}
+
 model_t* jobqueue_extract_best_and_destroy(jobqueue_t*jobs, dataset_t*data)
 {
     model_t*best_model = NULL;
     int best_score = INT_MAX;
     job_t*job;
     int count=0;
-    printf("\n");
+    printf("\nevaluating %d models\n", jobs->num);
+    int*scores = jobqueue_score(jobs, data, model_score);
     for(job=jobs->first;job;job=job->next,count++) {
-        printf("\revaluating %d/%d", count, jobs->num);fflush(stdout);
 	model_t*m = job->model;
 	if(m) {
+	    int score = scores[count];
 //#define DEBUG
 #ifdef DEBUG
-            printf("# %s\n", m->name);
-#endif
-	    int size = model_size(m);
-#ifdef DEBUG
-	    printf("# model size %d", size);fflush(stdout);
-#endif
-	    int errors = model_errors(m, data);
-	    int score = size + errors * sizeof(uint32_t);
-#ifdef DEBUG
-	    printf(", %d errors (score: %d)\n", errors, score);fflush(stdout);
+	    printf("# %s: score %d\n", m->name, score);fflush(stdout);
 	    node_sanitycheck((node_t*)m->code);
 #endif
 //#define SHOW_CODE
@@ -174,11 +238,125 @@ model_t* jobqueue_extract_best_and_destroy(jobqueue_t*jobs, dataset_t*data)
 	}
 	job->model = 0;
     }
+    free(scores);
     jobqueue_destroy(jobs);
-    printf("\n");
     return best_model;
 }
 
+/* Successive halving: Every round trains the remaining models on twice
+   as many rows as the previous one, and drops the worse half of them.
+   The dataset is shuffled, so the first n rows are a random sample.
+   Models are compared on the first 2n rows, half of which they haven't
+   seen during training. */
+#define HALVING_MIN_ROWS 256
+#define HALVING_MIN_MODELS 2
+
+typedef struct _ranking {
+    job_t*job;
+    int score;
+    int pos;
+} ranking_t;
+
+static int compare_rankings(const void*_r1, const void*_r2)
+{
+    const ranking_t*r1 = (const ranking_t*)_r1;
+    const ranking_t*r2 = (const ranking_t*)_r2;
+    if(r1->score != r2->score)
+        return r1->score < r2->score ? -1 : 1;
+    return r1->pos - r2->pos;
+}
+
+static double seconds_since(struct timespec*start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Thins out the job queue. Afterwards, the remaining jobs still have
+   to be trained on the full dataset. */
+static void jobqueue_successive_halving(jobqueue_t*jobs, dataset_t*data)
+{
+    int rounds = 0;
+    int num = jobs->num;
+    while(num > HALVING_MIN_MODELS && (data->num_rows >> (rounds+1)) >= HALVING_MIN_ROWS) {
+        num = (num+1)/2;
+        rounds++;
+    }
+    if(!rounds)
+        return;
+
+    double full_cost = (double)jobs->num * data->num_rows;
+    double cost = 0;
+    dataset_t**subsets = (dataset_t**)malloc(sizeof(dataset_t*)*rounds);
+    int r;
+    for(r=0;r<rounds;r++) {
+        int num_rows = data->num_rows >> (rounds - r);
+        dataset_t*train = subsets[r] = dataset_first_rows(data, num_rows);
+        dataset_t*validate = dataset_first_rows(data, num_rows*2);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        job_t*job;
+        for(job=jobs->first;job;job=job->next) {
+            job->data = train;
+        }
+        jobqueue_process(jobs);
+        int*scores = jobqueue_score(jobs, validate, model_errors);
+        cost += (double)jobs->num * num_rows;
+
+        ranking_t*ranking = (ranking_t*)malloc(sizeof(ranking_t)*jobs->num);
+        int count = 0, trained = 0;
+        for(job=jobs->first;job;job=job->next,count++) {
+            ranking[count].job = job;
+            ranking[count].score = job->model ? scores[count] : INT_MAX;
+            ranking[count].pos = count;
+            if(job->model)
+                trained++;
+        }
+        qsort(ranking, count, sizeof(ranking_t), compare_rankings);
+        int keep = (trained+1)/2;
+        if(!keep)
+            keep = 1;
+
+        printf("\n# round %d: trained %d models on %d rows in %.1fs, keeping %d\n",
+                r+1, count, num_rows, seconds_since(&start), keep);
+        int t;
+        for(t=0;t<count;t++) {
+            job = ranking[t].job;
+            if(job->model) {
+                printf("#   %c %s: error score %d\n", t<keep?'+':'-', job->factory->name, ranking[t].score);
+                model_destroy(job->model);
+                job->model = 0;
+            } else {
+                printf("#   - %s: failed\n", job->factory->name);
+            }
+            if(t >= keep) {
+                jobqueue_delete_job(jobs, job);
+            }
+        }
+        free(ranking);
+        free(scores);
+        dataset_view_destroy(validate);
+    }
+    job_t*job;
+    for(job=jobs->first;job;job=job->next) {
+        job->data = data;
+    }
+    cost += (double)jobs->num * data->num_rows;
+    printf("# successive halving: %.0f%% of the training rows of an exhaustive search\n",
+            100.0 * cost / full_cost);
+
+    if(!jobs->num_abandoned) {
+        for(r=0;r<rounds;r++) {
+            dataset_view_destroy(subsets[r]);
+        }
+    } else {
+        /* FIXME: leaks the subsets, see model_select() */
+    }
+    free(subsets);
+}
+
 model_t* model_select(trainingdata_t*trainingdata)
 {
     dataset_t*data = dataset_sanitize(trainingdata);
@@ -192,7 +370,11 @@ model_t* model_select(trainingdata_t*trainingdata)
     varorder_t*order = dtree_var_order(data);
 
     jobqueue_t*jobs = generate_jobs(order, data);
+    if(config_successive_halving) {
+        jobqueue_successive_halving(jobs, data);
+    }
     jobqueue_process(jobs);
+    bool data_in_use = jobs->num_abandoned > 0;
     model_t*best_model = jobqueue_extract_best_and_destroy(jobs, data);
 
 #define DEBUG
@@ -204,7 +386,12 @@ model_t* model_select(trainingdata_t*trainingdata)
     confusion_matrix_print(cm);
     confusion_matrix_destroy(cm);
 #endif
-    dataset_destroy(data);
+    if(!data_in_use) {
+        dataset_destroy(data);
+    } else {
+        /* FIXME: this leaks the dataset, but some timed out training
+                  thread might still be working on it */
+    }
     return best_model;
 }
 
@@ -257,33 +444,92 @@ void confusion_matrix_print(confusion_matrix_t*m)
         printf("\n");
     }
 }
-confusion_matrix_t* model_get_confusion_matrix(model_t*m, dataset_t*s)
+/* Maps predicted values back to class indices. Class constants are
+   categories or (registered, hence unique) strings, so we can compare them
+   by value/pointer, and look up categories in a table. */
+typedef struct _classmap {
+    column_t*column;
+    int min;
+    int*index;
+    int size;
+} classmap_t;
+
+#define MAX_CLASSMAP_TABLE_SIZE 65536
+
+static void classmap_init(classmap_t*map, column_t*column)
 {
-    dict_t*d = dict_new(&constant_hash_type);
+    map->column = column;
+    map->index = 0;
+    map->size = 0;
     int t;
-    for(t=0;t<s->desired_response->num_classes;t++) {
-        dict_put(d, &s->desired_response->classes[t], INT_TO_PTR(t));
+    int min = INT_MAX, max = INT_MIN;
+    for(t=0;t<column->num_classes;t++) {
+        constant_t*c = &column->classes[t];
+        if(c->type != CONSTANT_CATEGORY)
+            return;
+        if(c->c < min) min = c->c;
+        if(c->c > max) max = c->c;
+    }
+    if(!column->num_classes || max - min >= MAX_CLASSMAP_TABLE_SIZE)
+        return;
+    map->min = min;
+    map->size = max - min + 1;
+    map->index = (int*)malloc(sizeof(int)*map->size);
+    for(t=0;t<map->size;t++) {
+        map->index[t] = -1;
+    }
+    for(t=0;t<column->num_classes;t++) {
+        map->index[column->classes[t].c - min] = t;
     }
+}
 
-    node_t*node = m->code;
-    node_t*code = (node_t*)m->code;
-    row_t* row = row_new(s->sig->num_inputs);
-    environment_t*env = environment_new(code, row);
+static int classmap_lookup(classmap_t*map, constant_t*c)
+{
+    if(map->index && c->type == CONSTANT_CATEGORY) {
+        unsigned int pos = c->c - map->min;
+        if(pos < map->size && map->index[pos] >= 0)
+            return map->index[pos];
+    }
+    column_t*column = map->column;
+    int t;
+    for(t=0;t<column->num_classes;t++) {
+        constant_t*cls = &column->classes[t];
+        if(cls->type == c->type && (cls->type == CONSTANT_STRING ? cls->s == c->s : cls->c == c->c))
+            return t;
+    }
+    for(t=0;t<column->num_classes;t++) {
+        if(constant_equals(c, &column->classes[t]))
+            return t;
+    }
+    /* not a class we know about */
+    return 0;
+}
+
+static void classmap_destroy(classmap_t*map)
+{
+    if(map->index)
+        free(map->index);
+}
+
+confusion_matrix_t* model_get_confusion_matrix(model_t*m, dataset_t*s)
+{
+    column_t*response = s->desired_response;
+    classmap_t map;
+    classmap_init(&map, response);
+
+    constant_t*predictions = (constant_t*)malloc(sizeof(constant_t)*s->num_rows);
+    program_run_dataset(model_get_program(m), s, predictions);
 
-    confusion_matrix_t*matrix = confusion_matrix_new(s->desired_response->num_classes);
+    confusion_matrix_t*matrix = confusion_matrix_new(response->num_classes);
 
     int y;
     for(y=0;y<s->num_rows;y++) {
-        dataset_fill_row(s, row, y);
-        constant_t prediction = node_eval(code, env);
-        constant_t* desired = &s->desired_response->classes[s->desired_response->entries[y].c];
-        int column = PTR_TO_INT(dict_lookup(d, desired));
-        int row = PTR_TO_INT(dict_lookup(d, &prediction));
+        int column = response->entries[y].c;
+        int row = classmap_lookup(&map, &predictions[y]);
         matrix->entries[row][column]++;
     }
-    dict_destroy(d);
-    row_destroy(row);
-    environment_destroy(env);
+    free(predictions);
+    classmap_destroy(&map);
     return matrix;
 }
 
@@ -356,6 +602,11 @@ int model_size(model_t*m)
     return size;
 }
 
+int model_score(model_t*m, dataset_t*d)
+{
+    return model_size(m) + model_errors(m, d) * sizeof(uint32_t);
+}
+
 int training_set_size(int total_size)
 {
     if(total_size < 25) {
@@ -31,12 +31,17 @@ extern "C" {
 typedef struct _model_factory {
     const char*name;
     model_t*(*train)(struct _model_factory*factory, dataset_t*dataset);
+    /* expected training time on a given dataset, in arbitrary units
+       (roughly 5ns each). Used for scheduling jobs. */
+    double (*cost)(struct _model_factory*factory, dataset_t*dataset);
     void*internal;
 } model_factory_t;
 
 int training_set_size(int total_size);
+void reset_random_number_generator();
 
 typedef model_t*(*training_function_t)(model_factory_t*factory, dataset_t*dataset);
+typedef double (*cost_function_t)(model_factory_t*factory, dataset_t*dataset);
 
 model_t* model_select(trainingdata_t*);
 model_t* model_train_specific_model(trainingdata_t*, const char*name);
@@ -46,6 +51,7 @@ int model_score(model_t*m, dataset_t*d);
 model_t* train_model(model_factory_t*factory, dataset_t*data);
 
 model_factory_t* model_factory_get_by_name(const char*name);
+double model_factory_cost(model_factory_t*factory, dataset_t*data);
 
 typedef struct _confusion_matrix {
     int n;
@@ -64,23 +64,33 @@ void row_destroy(row_t*row);
 typedef struct _example {
     int num_inputs;
     const char**input_names;
-    struct _example*prev;
-    struct _example*next;
     variable_t desired_response;
     variable_t inputs[0];
 } example_t;
 
 example_t*example_new(int num_inputs);
+void example_destroy(example_t*e);
 row_t*example_to_row(example_t*e, const char**column_names);
 
+/* training data, stored column by column. Examples are copied into
+   the columns (and freed) as they are added, and categories are
+   numbered right away (see dataset.c). */
 typedef struct _trainingdata {
-    example_t*first_example;
-    example_t*last_example;
     int num_examples;
+    int num_inputs;
+    struct _columnbuilder**columns;
+    struct _columnbuilder*desired_response;
+
+    /* if the examples name their inputs: name -> column+1 */
+    struct _dict*column_names;
+
+    bool bad_format;
 } trainingdata_t;
 
 trainingdata_t* trainingdata_new();
 void trainingdata_add_example(trainingdata_t*d, example_t*e);
+example_t* trainingdata_get_example(trainingdata_t*d, int y);
+bool trainingdata_check_format(trainingdata_t*d);
 void trainingdata_print(trainingdata_t*dataset);
 void trainingdata_destroy(trainingdata_t*dataset);
 void trainingdata_save(trainingdata_t*d, const char*filename);
@@ -97,9 +107,17 @@ typedef struct _model {
     const char*name;
     signature_t*sig;
     void*code;
+    void*program;
+
+    /* prediction context: the number of locals the code uses (-1 if
+       unknown), and an environment that's reused between calls */
+    int num_locals;
+    void*environment;
 } model_t;
 
 variable_t model_predict(model_t*m, row_t*row);
+variable_t model_predict_compiled(model_t*m, row_t*row);
+void model_predict_batch(model_t*m, row_t**rows, int num_rows, variable_t*out);
 model_t* model_load(const char*filename);
 void model_save(model_t*m, const char*filename);
 void model_print(model_t*m);
@@ -24,6 +24,7 @@
 #include "mrscake.h"
 #include "list.h"
 #include "stringpool.h"
+#include "settings.h"
 
 #if PY_MAJOR_VERSION >= 3
 #define PYTHON3
@@ -160,6 +161,19 @@ example_t* pylist_to_example(PyObject*input)
     }
     return e;
 }
+PyObject* variable_to_pyobject(variable_t v)
+{
+    if(v.type == TEXT)
+        return PyString_FromString(v.text);
+    else if(v.type == CATEGORICAL)
+        return pyint_fromlong(v.category);
+    else if(v.type == CONTINUOUS)
+        return PyFloat_FromDouble(v.value);
+    else if(v.type == MISSING)
+        return PY_NONE;
+    else
+        return PY_ERROR("internal error: bad variable type %d", v.type);
+}
 //---------------------------------------------------------------------
 static void model_dealloc(PyObject* _self) {
     ModelObject* self = (ModelObject*)_self;
@@ -221,16 +235,57 @@ static PyObject* py_model_predict(PyObject* _self, PyObject* args, PyObject* kwa
     row_destroy(row);
     example_destroy(e);
 
-    if(i.type == TEXT)
-        return PyString_FromString(i.text);
-    else if(i.type == CATEGORICAL)
-        return pyint_fromlong(i.category);
-    else if(i.type == CONTINUOUS)
-        return PyFloat_FromDouble(i.value);
-    else if(i.type == MISSING)
-        return PY_NONE;
-    else
-        return PY_ERROR("internal error: bad variable type %d", i.type);
+    return variable_to_pyobject(i);
+}
+PyDoc_STRVAR(model_predict_many_doc, \
+"predict_many(list)\n\n"
+"Evaluate the model for a list of inputs. Returns a list of predictions.\n"
+"This is faster than calling predict() for every single input.\n"
+);
+static PyObject* py_model_predict_many(PyObject* _self, PyObject* args, PyObject* kwargs)
+{
+    ModelObject* self = (ModelObject*)_self;
+    PyObject*data = 0;
+    static char *kwlist[] = {"data", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &data))
+	return NULL;
+    if(!PyList_Check(data))
+        return PY_ERROR("first argument must be a list");
+
+    int num = PyList_Size(data);
+    row_t**rows = (row_t**)malloc(sizeof(row_t*)*num);
+    int t;
+    for(t=0;t<num;t++) {
+        example_t*e = pylist_to_example(PyList_GetItem(data, t));
+        rows[t] = 0;
+        if(e && e->num_inputs != self->model->sig->num_inputs) {
+            PY_ERROR("You supplied %d inputs for a model with %d inputs", e->num_inputs, self->model->sig->num_inputs);
+        } else if(e) {
+            rows[t] = example_to_row(e, self->model->sig->column_names);
+            if(!rows[t])
+                PY_ERROR("Can't create row from data");
+        }
+        if(e)
+            example_destroy(e);
+        if(!rows[t]) {
+            while(--t >= 0)
+                row_destroy(rows[t]);
+            free(rows);
+            return NULL;
+        }
+    }
+
+    variable_t*results = (variable_t*)malloc(sizeof(variable_t)*num);
+    model_predict_batch(self->model, rows, num, results);
+
+    PyObject*list = PyList_New(num);
+    for(t=0;t<num;t++) {
+        PyList_SetItem(list, t, variable_to_pyobject(results[t]));
+        row_destroy(rows[t]);
+    }
+    free(results);
+    free(rows);
+    return list;
 }
 PyDoc_STRVAR(model_generate_code_doc, \
 "generate_code(language)\n\n"
@@ -275,6 +330,7 @@ static PyMethodDef model_methods[] =
     /* Model functions */
     {"save", (PyCFunction)py_model_save, METH_KEYWORDS, model_save_doc},
     {"predict", (PyCFunction)py_model_predict, METH_KEYWORDS, model_predict_doc},
+    {"predict_many", (PyCFunction)py_model_predict_many, METH_KEYWORDS, model_predict_many_doc},
     {"generate_code", (PyCFunction)py_model_generate_code, METH_KEYWORDS, model_generate_code_doc},
     {0,0,0,0}
 };
@@ -530,6 +586,9 @@ PyObject * PyInit_mrscake(void)
     state_t* state = STATE(module);
     memset(state, 0, sizeof(state_t));
 
+    /* a crash while training shouldn't take the interpreter with it */
+    config_fork_for_training = true;
+
     //PyObject*module_dict = PyModule_GetDict(module);
     //PyDict_SetItemString(module_dict, "DataSet", (PyObject*)&DataSetClass);
     //PyDict_SetItemString(module_dict, "Model", (PyObject*)&ModelClass);
@@ -24,6 +24,7 @@
 #include <st.h>
 #include "mrscake.h"
 #include "stringpool.h"
+#include "settings.h"
 
 static VALUE mrscake;
 static VALUE DataSet, Model;
@@ -219,6 +220,17 @@ static VALUE rb_load_dataset(VALUE module, VALUE _filename)
     }
     return cls;
 }
+static VALUE variable_to_value(variable_t v)
+{
+    if(v.type == CONTINUOUS)
+        return rb_float_new(v.value);
+    else if(v.type == CATEGORICAL)
+        return INT2FIX(v.category);
+    else if(v.type == TEXT)
+        return rb_str_new2(v.text);
+    else
+        return T_NIL;
+}
 static VALUE rb_model_predict(VALUE cls, VALUE input)
 {
     Get_Model(model,cls);
@@ -236,14 +248,72 @@ static VALUE rb_model_predict(VALUE cls, VALUE input)
     variable_t prediction = model_predict(model->model, row);
     row_destroy(row);
 
-    if(prediction.type == CONTINUOUS)
-        return rb_float_new(prediction.value);
-    else if(prediction.type == CATEGORICAL)
-        return INT2FIX(prediction.category);
-    else if(prediction.type == TEXT)
-        return rb_str_new2(prediction.text);
-    else
-        return T_NIL;
+    return variable_to_value(prediction);
+}
+static int hash_check(VALUE key, VALUE value, VALUE arg)
+{
+    Check_Type(key, T_SYMBOL);
+    return ST_CONTINUE;
+}
+/* raises on anything value_to_example() would raise on, so that the
+   conversion itself can't leave rows behind */
+static void check_input(VALUE input, int pos, model_t*m)
+{
+    int len = 0;
+    int t;
+    if(TYPE(input) == T_ARRAY) {
+        len = RARRAY(input)->len;
+        for(t=0;t<len;t++) {
+            VALUE item = RARRAY(input)->ptr[t];
+            if(TYPE(item) != T_SYMBOL && TYPE(item) != T_FLOAT && TYPE(item) != T_FIXNUM)
+                rb_raise(rb_eArgError, "Element %d of predict_many() argument: bad element in array at pos %d", pos+1, t+1);
+        }
+    } else if(TYPE(input) == T_HASH) {
+        if(!m->sig->column_names)
+            rb_raise(rb_eArgError, "Element %d of predict_many() argument is a hash, but the model has no column names", pos+1);
+        rb_hash_foreach(input, hash_check, 0);
+        rb_hash_foreach(input, hash_count, (VALUE)&len);
+    } else {
+        rb_raise(rb_eArgError, "Element %d of predict_many() argument must be an array or a hash", pos+1);
+    }
+    if(len != m->sig->num_inputs)
+        rb_raise(rb_eArgError, "You supplied %d inputs for a model with %d inputs", len, m->sig->num_inputs);
+}
+static VALUE rb_model_predict_many(VALUE cls, VALUE inputs)
+{
+    Get_Model(model,cls);
+    Check_Type(inputs, T_ARRAY);
+
+    int num = RARRAY(inputs)->len;
+    int t;
+    for(t=0;t<num;t++) {
+        check_input(RARRAY(inputs)->ptr[t], t, model->model);
+    }
+
+    row_t**rows = (row_t**)malloc(sizeof(row_t*)*num);
+    for(t=0;t<num;t++) {
+        example_t*e = value_to_example(RARRAY(inputs)->ptr[t]);
+        rows[t] = example_to_row(e, model->model->sig->column_names);
+        example_destroy(e);
+        if(!rows[t]) {
+            while(--t >= 0)
+                row_destroy(rows[t]);
+            free(rows);
+            rb_raise(rb_eArgError, "Can't create row from data");
+        }
+    }
+
+    variable_t*predictions = (variable_t*)malloc(sizeof(variable_t)*num);
+    model_predict_batch(model->model, rows, num, predictions);
+
+    VALUE result = rb_ary_new2(num);
+    for(t=0;t<num;t++) {
+        rb_ary_push(result, variable_to_value(predictions[t]));
+        row_destroy(rows[t]);
+    }
+    free(predictions);
+    free(rows);
+    return result;
 }
 static void rb_model_mark(model_internal_t*model)
 {
@@ -262,6 +332,9 @@ void Init_mrscake()
 {
     mrscake = rb_define_module("MrsCake");
 
+    /* a crash while training shouldn't take the interpreter with it */
+    config_fork_for_training = true;
+
     rb_define_module_function(mrscake, "load_model", rb_load_model, 1);
     rb_define_module_function(mrscake, "load_data", rb_load_dataset, 1);
 
@@ -278,6 +351,7 @@ void Init_mrscake()
     rb_define_method(Model, "print", rb_model_print, 0);
     rb_define_method(Model, "save", rb_model_save, 1);
     rb_define_method(Model, "predict", rb_model_predict, 1);
+    rb_define_method(Model, "predict_many", rb_model_predict_many, 1);
     rb_define_method(Model, "generate_code", rb_model_generate_code, 1);
 }
 
@@ -19,12 +19,20 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
 
+#define _GNU_SOURCE
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <ucontext.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -33,6 +41,7 @@
 #include <memory.h>
 #include "io.h"
 #include "net.h"
+#include "dict.h"
 #include "dataset.h"
 #include "model_select.h"
 #include "serialize.h"
@@ -40,64 +49,1067 @@
 #include "job.h"
 
 #define TIME_LIMIT 3600
-#define NUM_WORKERS 32
 
-typedef struct _worker {
+/* Client and server talk in frames: a type byte, the length of the
+   payload, and the payload. One connection carries any number of
+   datasets and jobs, and results come back in whatever order the
+   jobs finish. */
+#define FRAME_DATASET 'D' // SHA-256, encoded dataset
+#define FRAME_JOB     'J' // job id, dataset hash and length, model name
+#define FRAME_BATCH   'B' // dataset hash and length, number of jobs, then job id and model name of each
+#define FRAME_CANCEL  'C' // job id
+#define FRAME_RESULT  'R' // job id, serialized model (empty if training failed)
+#define FRAME_STATUS  'S' // number of workers, number of queued and running jobs, wire formats
+
+#define FRAME_HEADER_SIZE 5
+#define MAX_FRAME_SIZE 0x7fffffff
+
+typedef struct _frame {
+    uint8_t type;
+    uint32_t length;
+    unsigned char*data;
+} frame_t;
+
+static void put_uint32(unsigned char*p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v>>8;
+    p[2] = v>>16;
+    p[3] = v>>24;
+}
+static uint32_t get_uint32(const unsigned char*p)
+{
+    return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+static bool write_all(int fd, const void*_data, int len)
+{
+    const unsigned char*data = (const unsigned char*)_data;
+    while(len>0) {
+        int ret = write(fd, data, len);
+        if(ret<0 && errno == EINTR)
+            continue;
+        if(ret<=0) {
+            perror("write");
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool fd_is_readable(int fd, int seconds)
+{
+    struct timeval timeout;
+    timeout.tv_sec = seconds;
+    timeout.tv_usec = 0;
+    fd_set readfds;
+    while(1) {
+        FD_ZERO(&readfds);
+        FD_SET(fd, &readfds);
+        int ret = select(fd+1, &readfds, NULL, NULL, &timeout);
+        if(ret<0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        return ret>0;
+    }
+}
+
+static bool read_all(int fd, void*_data, int len, int seconds)
+{
+    unsigned char*data = (unsigned char*)_data;
+    while(len>0) {
+        if(!fd_is_readable(fd, seconds)) {
+            fprintf(stderr, "timeout while trying to read %d bytes\n", len);
+            return false;
+        }
+        int ret = read(fd, data, len);
+        if(ret<0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if(ret<=0) {
+            if(ret<0)
+                perror("read");
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static void frame_header(unsigned char*header, uint8_t type, uint32_t length)
+{
+    header[0] = type;
+    put_uint32(&header[1], length);
+}
+
+/* send a frame whose payload is the concatenation of head and body */
+static bool send_frame(int sock, uint8_t type, const void*head, int head_len, const void*body, int body_len)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    frame_header(header, type, head_len + body_len);
+    return write_all(sock, header, FRAME_HEADER_SIZE) &&
+           write_all(sock, head, head_len) &&
+           write_all(sock, body, body_len);
+}
+
+static bool read_frame(int sock, frame_t*f, int seconds)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    if(!read_all(sock, header, FRAME_HEADER_SIZE, seconds))
+        return false;
+    f->type = header[0];
+    f->length = get_uint32(&header[1]);
+    if(f->length > MAX_FRAME_SIZE) {
+        fprintf(stderr, "bad frame length %u\n", f->length);
+        return false;
+    }
+    f->data = malloc(f->length + 1);
+    if(!read_all(sock, f->data, f->length, seconds)) {
+        free(f->data);
+        return false;
+    }
+    return true;
+}
+
+static void set_nodelay(int sock)
+{
+    /* frames are small and written in pieces, so don't let Nagle's
+       algorithm hold them back */
+    int val = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+}
+
+typedef struct _dataset_key {
+    unsigned char hash[DATASET_HASH_SIZE];
+    uint32_t length;
+} dataset_key_t;
+
+static bool dataset_key_equals(const dataset_key_t*k1, const dataset_key_t*k2)
+{
+    return k1->length == k2->length && !memcmp(k1->hash, k2->hash, DATASET_HASH_SIZE);
+}
+/* a short form of the hash, for messages */
+static uint32_t dataset_key_id(const dataset_key_t*k)
+{
+    return (uint32_t)k->hash[0]<<24 | k->hash[1]<<16 | k->hash[2]<<8 | k->hash[3];
+}
+static void write_dataset_key(writer_t*w, const dataset_key_t*k)
+{
+    w->write(w, (void*)k->hash, DATASET_HASH_SIZE);
+    write_uint32(w, k->length);
+}
+static dataset_key_t read_dataset_key(reader_t*r)
+{
+    dataset_key_t k;
+    memset(&k, 0, sizeof(k));
+    r->read(r, k.hash, DATASET_HASH_SIZE);
+    k.length = read_uint32(r);
+    return k;
+}
+
+#define DATASET_CACHE_SIZE 8
+
+/* Both ends of a connection keep the same list of the most recently used
+   datasets: The client looks up whether a dataset still has to be sent,
+   the server looks up the data for a job. Since both update the list
+   with the same sequence of messages, they always agree on its contents. */
+typedef struct _dataset_cache {
+    dataset_key_t key[DATASET_CACHE_SIZE];
+    void*data[DATASET_CACHE_SIZE];
+    int num;
+} dataset_cache_t;
+
+static int dataset_cache_find(dataset_cache_t*c, dataset_key_t key)
+{
+    int t;
+    for(t=0;t<c->num;t++) {
+        if(dataset_key_equals(&c->key[t], &key))
+            return t;
+    }
+    return -1;
+}
+
+static void* dataset_cache_touch(dataset_cache_t*c, int pos)
+{
+    dataset_key_t key = c->key[pos];
+    void*data = c->data[pos];
+    memmove(&c->key[1], &c->key[0], pos*sizeof(c->key[0]));
+    memmove(&c->data[1], &c->data[0], pos*sizeof(c->data[0]));
+    c->key[0] = key;
+    c->data[0] = data;
+    return data;
+}
+
+/* returns the data of the entry that was pushed out, if any */
+static void* dataset_cache_add(dataset_cache_t*c, dataset_key_t key, void*data)
+{
+    void*evicted = 0;
+    if(c->num == DATASET_CACHE_SIZE) {
+        evicted = c->data[--c->num];
+    }
+    memmove(&c->key[1], &c->key[0], c->num*sizeof(c->key[0]));
+    memmove(&c->data[1], &c->data[0], c->num*sizeof(c->data[0]));
+    c->key[0] = key;
+    c->data[0] = data;
+    c->num++;
+    return evicted;
+}
+
+#ifdef HAVE_ZLIB
+#define WIRE_FORMATS_SUPPORTED (WIRE_PACKED|WIRE_ZLIB)
+#else
+#define WIRE_FORMATS_SUPPORTED (WIRE_PACKED)
+#endif
+
+/* datasets are sent once and used right away, so favor speed over size */
+#define WIRE_ZLIB_LEVEL 1
+
+/* An encoded dataset starts with its format byte, so the server can
+   store and pass it on without having to know how it was encoded. */
+static void* dataset_encode(dataset_t*dataset, int format, int*len)
+{
+    writer_t*w = growingmemwriter_new2(65536);
+    if(format & WIRE_PACKED) {
+        dataset_write_packed(dataset, w);
+    } else {
+        dataset_write(dataset, w);
+    }
+    int raw_len;
+    void*raw = writer_growmemwrite_getmem(w, &raw_len);
+    w->finish(w);
+
+    w = growingmemwriter_new2(65536);
+    write_uint8(w, format);
+    if(format & WIRE_ZLIB) {
+        /* compress in one go- the serializers write a few bytes at a time */
+        writer_t*z = zlibdeflatewriter_new2(w, WIRE_ZLIB_LEVEL);
+        z->write(z, raw, raw_len);
+        z->finish(z);
+    } else {
+        w->write(w, raw, raw_len);
+    }
+    free(raw);
+    void*data = writer_growmemwrite_getmem(w, len);
+    w->finish(w);
+    return data;
+}
+
+static dataset_t* dataset_decode(void*data, int len)
+{
+    if(len < 1)
+        return 0;
+    uint8_t format = *(uint8_t*)data;
+    if(format & ~WIRE_FORMATS_SUPPORTED) {
+        fprintf(stderr, "unsupported wire format %02x\n", format);
+        return 0;
+    }
+    void*raw = (uint8_t*)data + 1;
+    int raw_len = len - 1;
+    void*inflated = 0;
+    if(format & WIRE_ZLIB) {
+        reader_t*r = memreader_new(raw, raw_len);
+        reader_t*z = zlibinflatereader_new(r);
+        writer_t*w = growingmemwriter_new2(65536);
+        char buffer[65536];
+        int l;
+        while((l = z->read(z, buffer, sizeof(buffer))) > 0) {
+            w->write(w, buffer, l);
+        }
+        z->dealloc(z);
+        r->dealloc(r);
+        inflated = raw = writer_growmemwrite_getmem(w, &raw_len);
+        w->finish(w);
+    }
+    reader_t*r = memreader_new(raw, raw_len);
+    dataset_t*d;
+    if(format & WIRE_PACKED) {
+        d = dataset_read_packed(r);
+    } else {
+        d = dataset_read(r);
+    }
+    r->dealloc(r);
+    free(inflated);
+    return d;
+}
+
+/* ------------------------------- server ------------------------------- */
+
+/* The server is a single process handling all client connections, and
+   a pool of pre-forked workers (one per core) doing the actual training.
+   Jobs wait in a queue until a worker is idle.
+   Every uploaded dataset is stored once, in shared memory, and handed
+   to the workers as a file descriptor. Workers keep the datasets they
+   used most recently deserialized, so that the next job on the same
+   data doesn't have to read it again. */
+
+#define WATCH_LISTEN 0
+#define WATCH_CLIENT 1
+#define WATCH_WORKER 2
+
+typedef struct _buffer {
+    unsigned char*data;
+    int size;
+    int start;
+    int end;
+} buffer_t;
+
+typedef struct _server_dataset {
+    dataset_key_t key;
+    int fd;
+    int refcount;
+    struct _server_dataset*next;
+} server_dataset_t;
+
+typedef struct _client {
+    int kind;
+    int socket;
+    dataset_cache_t datasets;
+    buffer_t in;
+    buffer_t out;
+    bool want_write;
+    bool send_status;
+    struct _client*next;
+} client_t;
+
+typedef struct _server_job {
+    client_t*client;
+    uint32_t id;
+    model_factory_t*factory;
+    server_dataset_t*dataset;
+    struct _server_job*next;
+} server_job_t;
+
+typedef struct _server_worker {
+    int kind;
     pid_t pid;
-    int start_time;
-} worker_t;
+    int socket;
+    server_job_t*job;
+    time_t start_time;
+    buffer_t in;
+
+    /* the datasets the worker has decoded, mirrored like a client's */
+    dataset_cache_t datasets;
+} server_worker_t;
+
+typedef struct _server {
+    int kind;
+    int socket;
+    int epoll_fd;
+
+    client_t*clients;
+
+    server_worker_t*workers;
+    int num_workers;
+
+    server_job_t*queue_first;
+    server_job_t*queue_last;
+    int num_queued;
+
+    server_dataset_t*datasets;
+} server_t;
+
+static void buffer_reserve(buffer_t*b, int len)
+{
+    if(b->start == b->end) {
+        b->start = b->end = 0;
+    }
+    if(b->end + len <= b->size)
+        return;
+    memmove(b->data, &b->data[b->start], b->end - b->start);
+    b->end -= b->start;
+    b->start = 0;
+    int size = b->size ? b->size : 65536;
+    while(b->end + len > size) {
+        size *= 2;
+    }
+    if(size != b->size) {
+        b->data = realloc(b->data, size);
+        b->size = size;
+    }
+}
+
+static void buffer_add_frame(buffer_t*b, uint8_t type, const void*head, int head_len, const void*body, int body_len)
+{
+    buffer_reserve(b, FRAME_HEADER_SIZE + head_len + body_len);
+    frame_header(&b->data[b->end], type, head_len + body_len);
+    b->end += FRAME_HEADER_SIZE;
+    memcpy(&b->data[b->end], head, head_len);
+    b->end += head_len;
+    memcpy(&b->data[b->end], body, body_len);
+    b->end += body_len;
+}
+
+/* read whatever is available, without blocking. Returns false if the
+   other side closed the connection. */
+static bool buffer_fill(buffer_t*b, int fd)
+{
+    while(1) {
+        buffer_reserve(b, 65536);
+        int space = b->size - b->end;
+        int ret = recv(fd, &b->data[b->end], space, MSG_DONTWAIT);
+        if(ret<0 && errno == EINTR)
+            continue;
+        if(ret<0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if(ret<=0) {
+            if(ret<0)
+                perror("recv");
+            return false;
+        }
+        b->end += ret;
+        if(ret < space)
+            return true;
+    }
+}
+
+/* write as much as the socket takes without blocking */
+static bool buffer_flush(buffer_t*b, int fd)
+{
+    while(b->start < b->end) {
+        int ret = send(fd, &b->data[b->start], b->end - b->start, MSG_DONTWAIT);
+        if(ret<0 && errno == EINTR)
+            continue;
+        if(ret<0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if(ret<=0) {
+            perror("send");
+            return false;
+        }
+        b->start += ret;
+    }
+    return true;
+}
+
+/* returns the next complete frame in the buffer, if there is one. The
+   frame data points into the buffer, and stays valid until
+   buffer_consume_frame() */
+static bool buffer_next_frame(buffer_t*b, frame_t*f, bool*bad)
+{
+    if(b->end - b->start < FRAME_HEADER_SIZE)
+        return false;
+    f->type = b->data[b->start];
+    f->length = get_uint32(&b->data[b->start+1]);
+    if(f->length > MAX_FRAME_SIZE - FRAME_HEADER_SIZE) {
+        *bad = true;
+        return false;
+    }
+    if(b->end - b->start < FRAME_HEADER_SIZE + f->length)
+        return false;
+    f->data = &b->data[b->start + FRAME_HEADER_SIZE];
+    return true;
+}
+
+static void buffer_consume_frame(buffer_t*b, frame_t*f)
+{
+    b->start += FRAME_HEADER_SIZE + f->length;
+}
+
+static void buffer_free(buffer_t*b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(buffer_t));
+}
+
+static void watch(server_t*s, int fd, void*ptr, uint32_t events, int op)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = ptr;
+    if(epoll_ctl(s->epoll_fd, op, fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/* returns 0 if the dataset couldn't be stored */
+static server_dataset_t* server_dataset_get(server_t*s, dataset_key_t key, const void*data)
+{
+    server_dataset_t*d;
+    for(d=s->datasets;d;d=d->next) {
+        if(dataset_key_equals(&d->key, &key)) {
+            d->refcount++;
+            return d;
+        }
+    }
+    d = calloc(1, sizeof(server_dataset_t));
+    d->key = key;
+    d->refcount = 1;
+    d->fd = memfd_create("mrscake-dataset", MFD_CLOEXEC);
+    if(d->fd < 0) {
+        perror("memfd_create");
+        free(d);
+        return 0;
+    }
+    if(!write_all(d->fd, data, key.length)) {
+        perror("write");
+        close(d->fd);
+        free(d);
+        return 0;
+    }
+    d->next = s->datasets;
+    s->datasets = d;
+    return d;
+}
+
+static void server_dataset_release(server_t*s, server_dataset_t*d)
+{
+    if(!d || --d->refcount)
+        return;
+    server_dataset_t**l = &s->datasets;
+    while(*l != d) {
+        l = &(*l)->next;
+    }
+    *l = d->next;
+    close(d->fd);
+    free(d);
+}
 
-void clean_old_workers(worker_t*jobs, int*num)
+static void server_job_destroy(server_t*s, server_job_t*j)
 {
+    server_dataset_release(s, j->dataset);
+    free(j);
+}
+
+static void client_send_result(client_t*c, uint32_t id, const void*model, int len)
+{
+    unsigned char head[4];
+    put_uint32(head, id);
+    buffer_add_frame(&c->out, FRAME_RESULT, head, 4, model, len);
+
+    /* the client's view of our load changed */
+    c->send_status = true;
+}
+
+static void client_send_status(server_t*s, client_t*c)
+{
+    int num_jobs = s->num_queued;
     int t;
-    for(t=0;t<*num;t++) {
-        int status;
-        pid_t p = waitpid(jobs[t].pid, &status, WNOHANG);
-        if(p == jobs[t].pid) {
-            printf("worker %d: finished\n", jobs[t].pid);
-            jobs[t] = jobs[--(*num)];
+    for(t=0;t<s->num_workers;t++) {
+        if(s->workers[t].job)
+            num_jobs++;
+    }
+    unsigned char head[12];
+    put_uint32(&head[0], s->num_workers);
+    put_uint32(&head[4], num_jobs);
+    put_uint32(&head[8], WIRE_FORMATS_SUPPORTED);
+    buffer_add_frame(&c->out, FRAME_STATUS, head, 12, 0, 0);
+    c->send_status = false;
+}
+
+static bool recv_with_fd(int sock, void*data, int len, int*fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int ret;
+    do {
+        ret = recvmsg(sock, &msg, 0);
+    } while(ret<0 && errno == EINTR);
+    if(ret <= 0)
+        return false;
+
+    *fd = -1;
+    struct cmsghdr*cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return read_all(sock, (char*)data + ret, len - ret, config_remote_read_timeout);
+}
+
+static bool send_with_fd(int sock, const void*data, int len, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr*cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    int ret;
+    do {
+        ret = sendmsg(sock, &msg, 0);
+    } while(ret<0 && errno == EINTR);
+    if(ret <= 0) {
+        perror("sendmsg");
+        return false;
+    }
+    return write_all(sock, (const char*)data + ret, len - ret);
+}
+
+static dataset_t* worker_get_dataset(dataset_cache_t*cache, dataset_key_t key, int fd, bool*cached)
+{
+    int pos = dataset_cache_find(cache, key);
+    *cached = pos >= 0;
+    if(pos >= 0)
+        return dataset_cache_touch(cache, pos);
+
+    void*mem = mmap(0, key.length, PROT_READ, MAP_SHARED, fd, 0);
+    if(mem == MAP_FAILED) {
+        perror("mmap");
+        return 0;
+    }
+    dataset_t*data = dataset_decode(mem, key.length);
+    munmap(mem, key.length);
+    if(!data)
+        return 0;
+
+    dataset_t*evicted = dataset_cache_add(cache, key, data);
+    if(evicted)
+        dataset_destroy(evicted);
+    return data;
+}
+
+static void worker_main(int socket)
+{
+    dataset_cache_t cache;
+    memset(&cache, 0, sizeof(cache));
+
+    while(1) {
+        unsigned char header[FRAME_HEADER_SIZE];
+        int fd = -1;
+        if(!recv_with_fd(socket, header, FRAME_HEADER_SIZE, &fd))
+            break;
+        uint32_t length = get_uint32(&header[1]);
+        unsigned char*payload = malloc(length);
+        if(!read_all(socket, payload, length, config_remote_read_timeout))
+            break;
+
+        reader_t*r = memreader_new(payload, length);
+        uint32_t id = read_uint32(r);
+        dataset_key_t key = read_dataset_key(r);
+        char*name = read_string(r);
+        r->dealloc(r);
+        free(payload);
+
+        bool cached;
+        job_t job;
+        memset(&job, 0, sizeof(job));
+        job.factory = model_factory_get_by_name(name);
+        job.data = worker_get_dataset(&cache, key, fd, &cached);
+        if(fd >= 0)
+            close(fd);
+        free(name);
+
+        if(job.factory && job.data) {
+            printf("worker %d: processing model %s (%d rows%s)\n", getpid(), job.factory->name,
+                    job.data->num_rows, cached ? ", cached" : "");
+            fflush(stdout);
+            job_process(&job);
         }
 
-        if(time(0) - jobs[t].start_time > TIME_LIMIT) {
-            printf("killing worker %d\n", jobs[t].pid);
-            kill(jobs[t].pid, 9);
-            waitpid(jobs[t].pid, &status, 0);
-            jobs[t] = jobs[--(*num)];
+        writer_t*w = growingmemwriter_new2(65536);
+        model_write(job.model, w);
+        int len;
+        void*mem = writer_growmemwrite_memptr(w, &len);
+        unsigned char head[4];
+        put_uint32(head, id);
+        bool ok = send_frame(socket, FRAME_RESULT, head, 4, mem, len);
+        w->finish(w);
+        if(job.model)
+            model_destroy(job.model);
+        if(!ok)
+            break;
+    }
+}
+
+static void worker_spawn(server_t*s, server_worker_t*w)
+{
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        perror("socketpair");
+        exit(1);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid<0) {
+        perror("fork");
+        exit(1);
+    }
+    if(!pid) {
+        /* don't keep the client connections (or anything else of the
+           server) open */
+        close(fds[0]);
+        close(s->socket);
+        close(s->epoll_fd);
+        client_t*c;
+        for(c=s->clients;c;c=c->next) {
+            close(c->socket);
+        }
+        int t;
+        for(t=0;t<s->num_workers;t++) {
+            if(s->workers[t].socket >= 0)
+                close(s->workers[t].socket);
         }
+        worker_main(fds[1]);
+        _exit(0);
     }
+    close(fds[1]);
+    w->kind = WATCH_WORKER;
+    w->pid = pid;
+    w->socket = fds[0];
+    w->job = 0;
+    w->datasets.num = 0;
+    watch(s, w->socket, w, EPOLLIN, EPOLL_CTL_ADD);
 }
 
-void process_request(int socket)
+/* kill the worker (and its job, if any), and start a fresh one */
+static void worker_restart(server_t*s, server_worker_t*w)
 {
-    reader_t*r = filereader_new(socket);
+    kill(w->pid, SIGKILL);
+    waitpid(w->pid, NULL, 0);
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, w->socket, NULL);
+    close(w->socket);
+    w->socket = -1;
+    buffer_free(&w->in);
+    if(w->job) {
+        server_job_destroy(s, w->job);
+        w->job = 0;
+    }
+    worker_spawn(s, w);
+}
 
-    char*name = read_string(r);
-    printf("worker %d: processing model %s\n", getpid(), name);
+static void worker_start_job(server_t*s, server_worker_t*w, server_job_t*j)
+{
+    writer_t*b = growingmemwriter_new();
+    write_uint32(b, j->id);
+    write_dataset_key(b, &j->dataset->key);
+    write_string(b, j->factory->name);
+    int len;
+    void*payload = writer_growmemwrite_memptr(b, &len);
+    unsigned char*frame = malloc(FRAME_HEADER_SIZE + len);
+    frame_header(frame, FRAME_JOB, len);
+    memcpy(frame + FRAME_HEADER_SIZE, payload, len);
+    b->finish(b);
+
+    int pos = dataset_cache_find(&w->datasets, j->dataset->key);
+    if(pos >= 0)
+        dataset_cache_touch(&w->datasets, pos);
+    else
+        dataset_cache_add(&w->datasets, j->dataset->key, 0);
+
+    w->job = j;
+    w->start_time = time(0);
+    bool ok = send_with_fd(w->socket, frame, FRAME_HEADER_SIZE + len, j->dataset->fd);
+    free(frame);
+    if(!ok) {
+        printf("worker %d: couldn't start job %d\n", w->pid, j->id);
+        client_send_result(j->client, j->id, 0, 0);
+        worker_restart(s, w);
+    }
+}
+
+static void server_unqueue_job(server_t*s, server_job_t**l)
+{
+    server_job_t*j = *l;
+    *l = j->next;
+    if(s->queue_last == j) {
+        s->queue_last = 0;
+        server_job_t*i;
+        for(i=s->queue_first;i;i=i->next)
+            s->queue_last = i;
+    }
+    s->num_queued--;
+}
+
+/* Hand queued jobs to idle workers. An idle worker takes the oldest
+   job on a dataset it has already decoded, and only if there's none,
+   the oldest job overall. That way, the jobs of a batch share one
+   decoded copy of their dataset per worker, even if several clients
+   keep the server busy with different datasets. */
+static void server_dispatch(server_t*s)
+{
+    int t;
+    for(t=0;t<s->num_workers && s->queue_first;t++) {
+        server_worker_t*w = &s->workers[t];
+        if(w->job)
+            continue;
+        server_job_t**l = &s->queue_first;
+        while(*l && dataset_cache_find(&w->datasets, (*l)->dataset->key) < 0) {
+            l = &(*l)->next;
+        }
+        if(!*l)
+            l = &s->queue_first;
+        server_job_t*j = *l;
+        server_unqueue_job(s, l);
+        worker_start_job(s, w, j);
+    }
+}
+
+static void worker_read(server_t*s, server_worker_t*w)
+{
+    bool alive = buffer_fill(&w->in, w->socket);
+    frame_t f;
+    bool bad = false;
+    while(w->job && buffer_next_frame(&w->in, &f, &bad)) {
+        server_job_t*j = w->job;
+        if(f.type == FRAME_RESULT && f.length >= 4) {
+            printf("worker %d: job %d finished (%d bytes of model data)\n", w->pid, j->id, f.length - 4);
+            client_send_result(j->client, j->id, f.data + 4, f.length - 4);
+        }
+        buffer_consume_frame(&w->in, &f);
+        server_job_destroy(s, j);
+        w->job = 0;
+    }
+    if(!alive || bad) {
+        if(w->job) {
+            printf("worker %d: crashed while processing job %d\n", w->pid, w->job->id);
+            client_send_result(w->job->client, w->job->id, 0, 0);
+        }
+        worker_restart(s, w);
+    }
+}
+
+static void client_handle_dataset(server_t*s, client_t*c, frame_t*f)
+{
+    if(f->length < DATASET_HASH_SIZE)
+        return;
+    /* datasets are shared between clients, so don't take the client's
+       word for the hash. A dataset that doesn't match it is still
+       entered into the client's list (to keep it in sync), but jobs
+       on it fail. */
+    dataset_key_t key;
+    key.length = f->length - DATASET_HASH_SIZE;
+    sha256(f->data + DATASET_HASH_SIZE, key.length, key.hash);
+    if(memcmp(key.hash, f->data, DATASET_HASH_SIZE)) {
+        printf("client %d: dataset %08x doesn't match its hash\n", c->socket, dataset_key_id(&key));
+        memcpy(key.hash, f->data, DATASET_HASH_SIZE);
+        server_dataset_t*evicted = dataset_cache_add(&c->datasets, key, 0);
+        server_dataset_release(s, evicted);
+        return;
+    }
+    server_dataset_t*d = server_dataset_get(s, key, f->data + DATASET_HASH_SIZE);
+    printf("client %d: dataset %08x (%d bytes)%s\n", c->socket, dataset_key_id(&key), key.length,
+            d ? "" : ", couldn't be stored");
+
+    server_dataset_t*evicted = dataset_cache_add(&c->datasets, key, d);
+    if(evicted)
+        server_dataset_release(s, evicted);
+}
+
+static server_dataset_t* client_find_dataset(client_t*c, dataset_key_t key)
+{
+    int pos = dataset_cache_find(&c->datasets, key);
+    if(pos<0) {
+        printf("client %d: unknown dataset %08x\n", c->socket, dataset_key_id(&key));
+        return 0;
+    }
+    return dataset_cache_touch(&c->datasets, pos);
+}
+
+static void client_queue_job(server_t*s, client_t*c, uint32_t id, const char*name, server_dataset_t*d)
+{
     model_factory_t* factory = model_factory_get_by_name(name);
-    if(!factory) {
-        printf("worker %d: unknown factory '%s'\n", getpid(), name);
-        free(name);
+    if(!factory)
+        printf("client %d: unknown factory '%s'\n", c->socket, name);
+    if(!factory || !d) {
+        client_send_result(c, id, 0, 0);
         return;
     }
+
+    server_job_t*j = calloc(1, sizeof(server_job_t));
+    j->client = c;
+    j->id = id;
+    j->factory = factory;
+    j->dataset = d;
+    j->dataset->refcount++;
+    if(s->queue_last)
+        s->queue_last->next = j;
+    else
+        s->queue_first = j;
+    s->queue_last = j;
+    s->num_queued++;
+}
+
+static void client_handle_job(server_t*s, client_t*c, frame_t*f)
+{
+    reader_t*r = memreader_new(f->data, f->length);
+    uint32_t id = read_uint32(r);
+    dataset_key_t key = read_dataset_key(r);
+    char*name = read_string(r);
+    r->dealloc(r);
+
+    client_queue_job(s, c, id, name, client_find_dataset(c, key));
     free(name);
+}
+
+/* several models to train on the same dataset. Each one is queued
+   as a job of its own, and its result is sent as soon as it's done. */
+static void client_handle_batch(server_t*s, client_t*c, frame_t*f)
+{
+    reader_t*r = memreader_new(f->data, f->length);
+    dataset_key_t key = read_dataset_key(r);
+    uint32_t num = read_uint32(r);
+    server_dataset_t*d = client_find_dataset(c, key);
+    printf("client %d: batch of %d jobs on dataset %08x\n", c->socket, num, dataset_key_id(&key));
 
-    dataset_t* dataset = dataset_read(r);
-    printf("worker %d: %d rows of data\n", getpid(), dataset->num_rows);
+    uint32_t t;
+    for(t=0;t<num && r->pos < f->length;t++) {
+        uint32_t id = read_uint32(r);
+        char*name = read_string(r);
+        client_queue_job(s, c, id, name, d);
+        free(name);
+    }
+    r->dealloc(r);
+}
+
+/* drop all queued jobs of a client, or only the one with the given id */
+static void server_remove_jobs(server_t*s, client_t*c, bool all, uint32_t id)
+{
+    server_job_t**l = &s->queue_first;
+    s->queue_last = 0;
+    while(*l) {
+        server_job_t*j = *l;
+        if(j->client == c && (all || j->id == id)) {
+            *l = j->next;
+            s->num_queued--;
+            server_job_destroy(s, j);
+        } else {
+            s->queue_last = j;
+            l = &j->next;
+        }
+    }
+    int t;
+    for(t=0;t<s->num_workers;t++) {
+        server_worker_t*w = &s->workers[t];
+        if(w->job && w->job->client == c && (all || w->job->id == id)) {
+            printf("worker %d: cancelling job %d\n", w->pid, w->job->id);
+            worker_restart(s, w);
+        }
+    }
+}
+
+static client_t* client_new(server_t*s, int socket)
+{
+    client_t*c = calloc(1, sizeof(client_t));
+    c->kind = WATCH_CLIENT;
+    c->socket = socket;
+    c->next = s->clients;
+    s->clients = c;
+    watch(s, socket, c, EPOLLIN, EPOLL_CTL_ADD);
+    printf("client %d: connected\n", socket);
+
+    /* tell the client how busy we are before it sends any jobs */
+    c->send_status = true;
+    return c;
+}
+
+static void client_close(server_t*s, client_t*c)
+{
+    printf("client %d: close\n", c->socket);
+    server_remove_jobs(s, c, true, 0);
+    int t;
+    for(t=0;t<c->datasets.num;t++) {
+        server_dataset_release(s, c->datasets.data[t]);
+    }
+    client_t**l = &s->clients;
+    while(*l != c) {
+        l = &(*l)->next;
+    }
+    *l = c->next;
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->socket, NULL);
+    close(c->socket);
+    buffer_free(&c->in);
+    buffer_free(&c->out);
+    free(c);
+}
+
+/* returns false if the client has to be disconnected */
+static bool client_read(server_t*s, client_t*c)
+{
+    bool alive = buffer_fill(&c->in, c->socket);
+    frame_t f;
+    bool bad = false;
+    while(buffer_next_frame(&c->in, &f, &bad)) {
+        switch(f.type) {
+            case FRAME_DATASET:
+                client_handle_dataset(s, c, &f);
+            break;
+            case FRAME_JOB:
+                client_handle_job(s, c, &f);
+            break;
+            case FRAME_BATCH:
+                client_handle_batch(s, c, &f);
+            break;
+            case FRAME_CANCEL:
+                if(f.length >= 4)
+                    server_remove_jobs(s, c, false, get_uint32(f.data));
+            break;
+            default:
+                printf("client %d: bad message type %02x\n", c->socket, f.type);
+        }
+        buffer_consume_frame(&c->in, &f);
+    }
+    return alive && !bad;
+}
+
+static void server_check_timeouts(server_t*s)
+{
+    time_t now = time(0);
+    int t;
+    for(t=0;t<s->num_workers;t++) {
+        server_worker_t*w = &s->workers[t];
+        if(w->job && now - w->start_time > TIME_LIMIT) {
+            printf("worker %d: killing job %d\n", w->pid, w->job->id);
+            client_send_result(w->job->client, w->job->id, 0, 0);
+            worker_restart(s, w);
+        }
+    }
+}
 
-    job_t j;
-    j.factory = factory;
-    j.data = dataset;
-    j.model = 0;
-    job_process(&j);
-    model_t*m = j.model;
-    if(m) {
-        m->name = factory->name;
+/* send out pending results, and only ask for writability while
+   there's something left to send */
+static void server_flush_clients(server_t*s)
+{
+    client_t*c = s->clients;
+    while(c) {
+        client_t*next = c->next;
+        if(c->send_status)
+            client_send_status(s, c);
+        if(!buffer_flush(&c->out, c->socket)) {
+            client_close(s, c);
+        } else {
+            bool want_write = c->out.start < c->out.end;
+            if(want_write != c->want_write) {
+                watch(s, c->socket, c, EPOLLIN | (want_write ? EPOLLOUT : 0), EPOLL_CTL_MOD);
+                c->want_write = want_write;
+            }
+        }
+        c = next;
     }
+}
 
-    printf("worker %d: writing out model data\n", getpid());
-    writer_t*w = filewriter_new(socket);
-    model_write(m, w);
-    w->finish(w);
+static void server_accept(server_t*s)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int newsock = accept(s->socket, (struct sockaddr*)&sin, &len);
+    if(newsock < 0) {
+        if(errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+            perror("accept");
+        return;
+    }
+    set_nodelay(newsock);
+    client_new(s, newsock);
 }
 
 int start_server(int port)
@@ -111,6 +1123,9 @@ int start_server(int port)
     sin.sin_port = htons(port);
     sin.sin_family = AF_INET;
 
+    /* clients going away shouldn't take the server with them */
+    signal(SIGPIPE, SIG_IGN);
+
     sock = socket(AF_INET, SOCK_STREAM, 6);
     if(sock<0) {
         perror("socket");
@@ -137,156 +1152,848 @@ int start_server(int port)
         exit(1);
     }
 
-    worker_t jobs[NUM_WORKERS];
-    int num_workers = 0;
+    server_t*s = calloc(1, sizeof(server_t));
+    s->kind = WATCH_LISTEN;
+    s->socket = sock;
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(s->epoll_fd < 0) {
+        perror("epoll_create");
+        exit(1);
+    }
+    watch(s, sock, s, EPOLLIN, EPOLL_CTL_ADD);
 
-    printf("listing on port %d\n", port);
-    while(1) {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(sock, &fds);
+    s->num_workers = config_get_num_threads();
+    s->workers = calloc(s->num_workers, sizeof(server_worker_t));
+    for(i=0;i<s->num_workers;i++) {
+        s->workers[i].socket = -1;
+    }
+    for(i=0;i<s->num_workers;i++) {
+        worker_spawn(s, &s->workers[i]);
+    }
 
-        ret = select(sock + 1, &fds, 0, 0, 0);
-        if(ret<0) {
-            perror("listen");
+    printf("listing on port %d, %d workers\n", port, s->num_workers);
+    while(1) {
+        struct epoll_event events[64];
+        int num = epoll_wait(s->epoll_fd, events, 64, 1000);
+        if(num<0) {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
             exit(1);
         }
-        if(FD_ISSET(sock, &fds)) {
-            struct sockaddr_in sin;
-            int len = sizeof(sin);
-
-            int newsock = accept(sock, (struct sockaddr*)&sin, &len);
-            if(newsock < 0) {
-                perror("accept");
-                exit(1);
+        for(i=0;i<num;i++) {
+            if(!events[i].data.ptr)
+                continue;
+            int kind = *(int*)events[i].data.ptr;
+            if(kind == WATCH_LISTEN) {
+                server_accept(s);
+            } else if(kind == WATCH_CLIENT) {
+                client_t*c = (client_t*)events[i].data.ptr;
+                if((events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) && !client_read(s, c)) {
+                    client_close(s, c);
+                    /* the client might be mentioned again further down */
+                    int j;
+                    for(j=i+1;j<num;j++) {
+                        if(events[j].data.ptr == c)
+                            events[j].data.ptr = 0;
+                    }
+                }
+            } else if(kind == WATCH_WORKER) {
+                worker_read(s, (server_worker_t*)events[i].data.ptr);
             }
+        }
+        server_check_timeouts(s);
+        server_dispatch(s);
+        server_flush_clients(s);
+    }
+}
 
-            // clear O_NONBLOCK
-            ret = fcntl(sock, F_SETFL, 0);
-            if(ret<0) {
-                perror("fcntl");
-                exit(1);
-            }
+/* ------------------------------- client ------------------------------- */
 
-            char buf[128];
-            while(num_workers == NUM_WORKERS) {
-                clean_old_workers(jobs, &num_workers);
-                if(num_workers == NUM_WORKERS) {
-                    sleep(1);
-                }
-            }
+/* Models are parsed while they are still coming in: model_read() runs
+   on a stack of its own, and whenever it wants more bytes than have
+   arrived so far, it suspends itself until the next chunk is fed to it.
+   That way, receiving a large model neither blocks the other
+   connections nor leaves all the parsing for after the last byte. */
 
-            pid_t pid = fork();
-            if(!pid) {
-                process_request(newsock);
-                printf("worker %d: close\n", getpid());
-                close(newsock);
-                _exit(0);
-            }
-            jobs[num_workers].pid = pid;
-            jobs[num_workers].start_time = time(0);
-            num_workers++;
+#define PARSER_STACK_SIZE (1024*1024)
+
+/* Stacks grow downwards, so a page below the stack which can't be
+   accessed turns a model nested too deeply into a crash, rather than
+   into writes to whatever is mapped next to it. */
+static size_t parser_guard_size()
+{
+    long page = sysconf(_SC_PAGESIZE);
+    return page > 0 ? page : 4096;
+}
+
+typedef struct _result_parser {
+    ucontext_t context;
+    ucontext_t caller;
+    char*stack;
+    reader_t reader;
+
+    const unsigned char*data;
+    int length;
+    bool eof;
 
-            close(newsock);
+    bool done;
+    model_t*model;
+} result_parser_t;
+
+static result_parser_t*starting_parser = 0;
+
+static int result_parser_read(reader_t*r, void*_data, int len)
+{
+    result_parser_t*p = (result_parser_t*)r->internal;
+    unsigned char*data = (unsigned char*)_data;
+    int pos = 0;
+    while(pos < len) {
+        if(!p->length) {
+            if(p->eof)
+                break;
+            swapcontext(&p->context, &p->caller);
+            continue;
         }
+        int l = len - pos < p->length ? len - pos : p->length;
+        memcpy(data + pos, p->data, l);
+        p->data += l;
+        p->length -= l;
+        pos += l;
     }
+    r->pos += pos;
+    return pos;
 }
 
-int connect_to_host(const char *host, int port)
+static void result_parser_main()
 {
-    int i, ret;
-    char buf_ip[100];
-    struct sockaddr_in sin;
+    result_parser_t*p = starting_parser;
+    p->model = model_read(&p->reader);
+    p->done = true;
+    /* returns to p->caller */
+}
+
+static result_parser_t* result_parser_new()
+{
+    result_parser_t*p = calloc(1, sizeof(result_parser_t));
+    size_t guard = parser_guard_size();
+    p->stack = mmap(0, guard + PARSER_STACK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+    if(p->stack == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if(mprotect(p->stack, guard, PROT_NONE) < 0) {
+        perror("mprotect");
+        exit(1);
+    }
+    p->reader.read = result_parser_read;
+    p->reader.internal = p;
+    reader_resetbits(&p->reader);
+
+    getcontext(&p->context);
+    p->context.uc_stack.ss_sp = p->stack + guard;
+    p->context.uc_stack.ss_size = PARSER_STACK_SIZE;
+    p->context.uc_link = &p->caller;
+    makecontext(&p->context, result_parser_main, 0);
+    return p;
+}
+
+/* parse as far as the given bytes allow */
+static void result_parser_feed(result_parser_t*p, const void*data, int len)
+{
+    p->data = (const unsigned char*)data;
+    p->length = len;
+    if(!p->done) {
+        starting_parser = p;
+        swapcontext(&p->caller, &p->context);
+    }
+}
+
+static model_t* result_parser_finish(result_parser_t*p)
+{
+    p->eof = true;
+    result_parser_feed(p, 0, 0);
+    model_t*m = p->model;
+    munmap(p->stack, parser_guard_size() + PARSER_STACK_SIZE);
+    free(p);
+    return m;
+}
+
+/* a long-lived connection to one of the configured servers */
+typedef struct _connection {
+    remote_server_t*server;
+    struct sockaddr_in address;
+    bool resolved;
+    int socket;
+
+    time_t failed_at;
+
+    dataset_cache_t datasets;
+
+    /* jobs sent over this connection that are still waiting for a result */
+    remote_job_t*jobs;
+    int num_jobs;
+    double cost;
+
+    /* load the server reported last, and how many of those jobs
+       were ours at that time */
+    int server_cores;
+    int server_jobs;
+    int own_jobs_at_report;
+
+    /* how we send datasets to this server */
+    int wire_format;
+
+    /* jobs that were started, but not sent yet. Jobs on the same
+       dataset are collected, and go out as one batch once we wait
+       for results (or a job on another dataset comes along). */
+    writer_t*batch;
+    dataset_key_t batch_key;
+    int batch_size;
+
+    /* the frame that's currently coming in. Result frames are parsed
+       as they arrive, all others are collected until they're complete. */
+    unsigned char header[FRAME_HEADER_SIZE+4];
+    int header_pos;
+    frame_t frame;
+    uint32_t frame_pos;
+    uint32_t result_id;
+    result_parser_t*parser;
+} connection_t;
+
+static connection_t*connections = 0;
+static int num_connections = 0;
+static remote_server_t*connections_server_list = 0;
+static uint32_t next_job_id = 1;
 
+/* for estimating the cost of other clients' jobs */
+static double total_cost = 0;
+static int total_jobs = 0;
+
+/* all open connections are registered with one epoll instance, so
+   that waiting for results is a single system call, no matter how
+   many jobs and servers there are */
+static int epoll_fd = -1;
+
+/* jobs that finished, but haven't been handed out by remote_job_wait() */
+static remote_job_t*finished_jobs = 0;
+
+static void job_finished(remote_job_t*j, model_t*m)
+{
+    j->connection = 0;
+    j->finished = true;
+    j->model = m;
+    j->next = finished_jobs;
+    finished_jobs = j;
+}
+
+static void finished_jobs_remove(remote_job_t*j)
+{
+    remote_job_t**l = &finished_jobs;
+    while(*l && *l != j) {
+        l = &(*l)->next;
+    }
+    if(*l)
+        *l = j->next;
+}
+
+static bool resolve_host(const char *host, int port, struct sockaddr_in*sin)
+{
     struct hostent *he = gethostbyname(host);
     if(!he) {
         printf("gethostbyname returned %d\n", h_errno);
         herror(host);
-        return -1;
+        return false;
     }
 
     unsigned char*ip = he->h_addr_list[0];
     //printf("Connecting to %d.%d.%d.%d:%d...\n", ip[0], ip[1], ip[2], ip[3], port);
 
-    memset(&sin, 0, sizeof(sin));
-    sin.sin_family = AF_INET;
-    sin.sin_port = htons(port);
-    memcpy(&sin.sin_addr.s_addr, ip, 4);
+    memset(sin, 0, sizeof(struct sockaddr_in));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    memcpy(&sin->sin_addr.s_addr, ip, 4);
+    return true;
+}
 
+static int connect_to_address(struct sockaddr_in*sin)
+{
     int sock = socket(AF_INET, SOCK_STREAM, 6);
     if(sock < 0) {
         perror("socket");
         return -1;
     }
 
-    ret = connect(sock, (struct sockaddr*)&sin, sizeof(struct sockaddr_in));
+    int ret = connect(sock, (struct sockaddr*)sin, sizeof(struct sockaddr_in));
     if(ret < 0) {
         perror("connect");
+        close(sock);
         return -1;
     }
+    set_nodelay(sock);
     return sock;
 }
 
-remote_job_t* remote_job_start(const char*model_name, dataset_t*dataset)
+int connect_to_host(const char *host, int port)
 {
-    int sock;
-    while(1) {
-        if(!config_num_remote_servers) {
-            fprintf(stderr, "No remote servers configured.\n");
+    struct sockaddr_in sin;
+    if(!resolve_host(host, port, &sin))
+        return -1;
+    return connect_to_address(&sin);
+}
+
+static connection_t* connection_pool()
+{
+    if(connections_server_list != config_remote_servers ||
+       num_connections != config_num_remote_servers) {
+        remote_disconnect_all();
+        num_connections = config_num_remote_servers;
+        connections_server_list = config_remote_servers;
+        connections = calloc(num_connections, sizeof(connection_t));
+        int t;
+        for(t=0;t<num_connections;t++) {
+            connections[t].server = &config_remote_servers[t];
+            connections[t].socket = -1;
+        }
+    }
+    return connections;
+}
+
+static void connection_handle_frame(connection_t*c, frame_t*f);
+
+static bool connection_open(connection_t*c)
+{
+    if(c->socket >= 0)
+        return true;
+    if(!c->resolved) {
+        if(!resolve_host(c->server->host, c->server->port, &c->address))
+            return false;
+        c->resolved = true;
+    }
+    c->socket = connect_to_address(&c->address);
+    c->datasets.num = 0;
+    if(c->socket < 0) {
+        c->failed_at = time(0);
+        return false;
+    }
+
+    /* the server starts by telling us how many cores it has */
+    frame_t f;
+    if(!read_frame(c->socket, &f, config_remote_read_timeout)) {
+        close(c->socket);
+        c->socket = -1;
+        c->failed_at = time(0);
+        return false;
+    }
+    connection_handle_frame(c, &f);
+    free(f.data);
+
+    if(epoll_fd < 0) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(epoll_fd < 0) {
+            perror("epoll_create");
             exit(1);
         }
-        static int round_robin = 0;
-        remote_server_t*s = &config_remote_servers[(round_robin++)%config_num_remote_servers];
-	printf("Starting %s on %s\n", model_name, s->host);fflush(stdout);
-        sock = connect_to_host(s->host, s->port);
-        if(sock>=0) {
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = c;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->socket, &event) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    return true;
+}
+
+/* drop the connection. Jobs still running on it have failed. */
+static void connection_close(connection_t*c)
+{
+    if(c->batch) {
+        c->batch->finish(c->batch);
+        c->batch = 0;
+        c->batch_size = 0;
+    }
+    if(c->socket >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->socket, NULL);
+        close(c->socket);
+        c->socket = -1;
+    }
+    c->datasets.num = 0;
+    c->failed_at = time(0);
+    if(c->parser) {
+        model_t*m = result_parser_finish(c->parser);
+        if(m)
+            model_destroy(m);
+        c->parser = 0;
+    }
+    if(c->header_pos >= FRAME_HEADER_SIZE && c->frame.type != FRAME_RESULT) {
+        free(c->frame.data);
+        c->frame.data = 0;
+    }
+    c->header_pos = 0;
+    while(c->jobs) {
+        remote_job_t*j = c->jobs;
+        c->jobs = j->next;
+        job_finished(j, 0);
+    }
+    c->num_jobs = 0;
+    c->cost = 0;
+}
+
+static void connection_unlink_job(connection_t*c, remote_job_t*j)
+{
+    remote_job_t**l = &c->jobs;
+    while(*l && *l != j) {
+        l = &(*l)->next;
+    }
+    if(*l) {
+        *l = j->next;
+        c->num_jobs--;
+        c->cost -= j->cost;
+    }
+    j->connection = 0;
+}
+
+static remote_encoding_t* remote_dataset_encoding(remote_dataset_t*d, int format)
+{
+    remote_encoding_t*e = &d->encoding[format];
+    if(!e->data) {
+        int len;
+        e->data = dataset_encode(d->dataset, format, &len);
+        e->length = len;
+        sha256(e->data, len, e->hash);
+    }
+    return e;
+}
+
+static bool connection_flush(connection_t*c)
+{
+    if(!c->batch)
+        return true;
+    unsigned char head[DATASET_HASH_SIZE+8];
+    memcpy(head, c->batch_key.hash, DATASET_HASH_SIZE);
+    put_uint32(&head[DATASET_HASH_SIZE], c->batch_key.length);
+    put_uint32(&head[DATASET_HASH_SIZE+4], c->batch_size);
+    int len;
+    void*mem = writer_growmemwrite_memptr(c->batch, &len);
+    bool ok = send_frame(c->socket, FRAME_BATCH, head, sizeof(head), mem, len);
+    c->batch->finish(c->batch);
+    c->batch = 0;
+    c->batch_size = 0;
+    if(!ok)
+        connection_close(c);
+    return ok;
+}
+
+static void connection_flush_all()
+{
+    int t;
+    for(t=0;t<num_connections;t++) {
+        connection_flush(&connections[t]);
+    }
+}
+
+static bool connection_send_job(connection_t*c, remote_job_t*j, const char*model_name, remote_dataset_t*d)
+{
+    remote_encoding_t*e = remote_dataset_encoding(d, c->wire_format);
+    dataset_key_t key;
+    memcpy(key.hash, e->hash, DATASET_HASH_SIZE);
+    key.length = e->length;
+
+    /* the server has to see the batch before any dataset we send
+       after it, so that its dataset list stays in sync with ours */
+    if(c->batch && !dataset_key_equals(&c->batch_key, &key)) {
+        if(!connection_flush(c))
+            return false;
+    }
+
+    int pos = dataset_cache_find(&c->datasets, key);
+    if(pos<0) {
+        if(!send_frame(c->socket, FRAME_DATASET, e->hash, DATASET_HASH_SIZE, e->data, e->length))
+            return false;
+        dataset_cache_add(&c->datasets, key, 0);
+    } else {
+        dataset_cache_touch(&c->datasets, pos);
+    }
+
+    if(!c->batch) {
+        c->batch = growingmemwriter_new();
+        c->batch_key = key;
+    }
+    write_uint32(c->batch, j->id);
+    write_string(c->batch, model_name);
+    c->batch_size++;
+
+    j->connection = c;
+    j->next = c->jobs;
+    c->jobs = j;
+    c->num_jobs++;
+    c->cost += j->cost;
+    return true;
+}
+
+static remote_job_t* connection_find_job(connection_t*c, uint32_t id)
+{
+    remote_job_t*j;
+    for(j=c->jobs;j;j=j->next) {
+        if(j->id == id)
+            return j;
+    }
+    return 0;
+}
+
+static void connection_handle_result(connection_t*c, uint32_t id, model_t*m)
+{
+    remote_job_t*j = connection_find_job(c, id);
+    if(!j) {
+        /* result of a job we cancelled */
+        if(m)
+            model_destroy(m);
+        return;
+    }
+    connection_unlink_job(c, j);
+    if(m) {
+        /* the server only knows the data, not how the inputs are named */
+        m->sig = j->sig;
+    }
+    job_finished(j, m);
+}
+
+static void connection_handle_status(connection_t*c, frame_t*f)
+{
+    if(f->length < 8)
+        return;
+    c->server_cores = get_uint32(&f->data[0]);
+    c->server_jobs = get_uint32(&f->data[4]);
+    c->own_jobs_at_report = c->num_jobs;
+    if(c->server_cores < 1)
+        c->server_cores = 1;
+    /* servers that don't tell only understand the plain format */
+    c->wire_format = 0;
+    if(f->length >= 12)
+        c->wire_format = get_uint32(&f->data[8]) & config_remote_wire_format & (NUM_WIRE_FORMATS-1);
+}
+
+static void connection_handle_frame(connection_t*c, frame_t*f)
+{
+    if(f->type == FRAME_STATUS) {
+        connection_handle_status(c, f);
+    }
+}
+
+static bool connection_header_complete(connection_t*c)
+{
+    if(c->header_pos < FRAME_HEADER_SIZE)
+        return false;
+    /* results also need the job id */
+    return c->frame.type != FRAME_RESULT || c->header_pos == FRAME_HEADER_SIZE+4;
+}
+
+static bool connection_read_header(connection_t*c, const unsigned char*data, int len)
+{
+    int size = c->header_pos < FRAME_HEADER_SIZE ? FRAME_HEADER_SIZE : FRAME_HEADER_SIZE+4;
+    int l = size - c->header_pos < len ? size - c->header_pos : len;
+    memcpy(&c->header[c->header_pos], data, l);
+    c->header_pos += l;
+    if(c->header_pos == FRAME_HEADER_SIZE) {
+        c->frame.type = c->header[0];
+        c->frame.length = get_uint32(&c->header[1]);
+        /* the previous frame's data is gone, and a bad header
+           doesn't get any */
+        c->frame.data = 0;
+        if(c->frame.length > MAX_FRAME_SIZE) {
+            fprintf(stderr, "bad frame length %u\n", c->frame.length);
+            return false;
+        }
+        c->frame_pos = 0;
+        if(c->frame.type == FRAME_RESULT) {
+            if(c->frame.length < 4)
+                return false;
+        } else {
+            c->frame.data = malloc(c->frame.length + 1);
+        }
+    } else if(c->header_pos == FRAME_HEADER_SIZE+4) {
+        c->result_id = get_uint32(&c->header[FRAME_HEADER_SIZE]);
+        c->frame_pos = 4;
+        /* no need to parse what nobody is waiting for */
+        if(c->frame.length > 4 && connection_find_job(c, c->result_id)) {
+            c->parser = result_parser_new();
+        }
+    }
+    return true;
+}
+
+static void connection_frame_complete(connection_t*c)
+{
+    c->header_pos = 0;
+    if(c->frame.type == FRAME_RESULT) {
+        model_t*m = 0;
+        if(c->parser) {
+            m = result_parser_finish(c->parser);
+            c->parser = 0;
+        }
+        connection_handle_result(c, c->result_id, m);
+    } else {
+        connection_handle_frame(c, &c->frame);
+        free(c->frame.data);
+        c->frame.data = 0;
+    }
+}
+
+static bool connection_receive(connection_t*c, const unsigned char*data, int len)
+{
+    while(1) {
+        if(!connection_header_complete(c)) {
+            if(!len)
+                break;
+            int old_pos = c->header_pos;
+            if(!connection_read_header(c, data, len))
+                return false;
+            data += c->header_pos - old_pos;
+            len -= c->header_pos - old_pos;
+            continue;
+        }
+        if(c->frame_pos == c->frame.length) {
+            connection_frame_complete(c);
+            continue;
+        }
+        if(!len)
             break;
+        int l = c->frame.length - c->frame_pos;
+        if(l > len)
+            l = len;
+        if(c->frame.type == FRAME_RESULT) {
+            if(c->parser)
+                result_parser_feed(c->parser, data, l);
+        } else {
+            memcpy(c->frame.data + c->frame_pos, data, l);
         }
-        sleep(1);
+        c->frame_pos += l;
+        data += l;
+        len -= l;
     }
+    return true;
+}
 
-    writer_t*w = filewriter_new(sock);
-    write_string(w, model_name);
-    dataset_write(dataset, w);
-    w->finish(w);
+/* process what arrived on the connection, without blocking. To be fair
+   to other connections, this only reads one chunk at a time. */
+static void connection_poll(connection_t*c)
+{
+    static unsigned char buffer[65536];
+    if(c->socket < 0)
+        return;
+    int ret;
+    do {
+        ret = recv(c->socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+    } while(ret<0 && errno == EINTR);
+    if(ret<0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if(ret<=0 || !connection_receive(c, buffer, ret)) {
+        connection_close(c);
+    }
+}
+
+/* when a job of the given cost would be finished on this server,
+   assuming that the server splits its work evenly across its cores */
+static double connection_finish_time(connection_t*c, double cost)
+{
+    /* we only know the number of jobs other clients have on the server,
+       not what they are. Assume they're like ours. */
+    int other_jobs = c->server_jobs - c->own_jobs_at_report;
+    if(other_jobs < 0)
+        other_jobs = 0;
+    double average_cost = total_jobs ? total_cost / total_jobs : cost;
+    return (c->cost + other_jobs * average_cost + cost) / c->server_cores;
+}
 
-    remote_job_t*j = malloc(sizeof(remote_job_t));
-    j->socket = sock;
+#define RECONNECT_DELAY 5
+
+/* the server that would finish the job first, and (in *finish_time)
+   when it would */
+static connection_t* connection_pick(double cost, connection_t*exclude, double*finish_time)
+{
+    connection_t*pool = connection_pool();
+    connection_t*best = 0;
+    double best_time = 0;
+    int t;
+    for(t=0;t<num_connections;t++) {
+        connection_t*c = &pool[t];
+        if(c == exclude)
+            continue;
+        if(c->socket < 0) {
+            if(c->failed_at && time(0) - c->failed_at < RECONNECT_DELAY)
+                continue;
+            if(!connection_open(c))
+                continue;
+        }
+        double time = connection_finish_time(c, cost);
+        if(!best || time < best_time) {
+            best = c;
+            best_time = time;
+        }
+    }
+    *finish_time = best_time;
+    return best;
+}
+
+void remote_disconnect_all()
+{
+    int t;
+    for(t=0;t<num_connections;t++) {
+        connection_close(&connections[t]);
+    }
+    free(connections);
+    connections = 0;
+    num_connections = 0;
+    connections_server_list = 0;
+}
+
+remote_dataset_t* remote_dataset_new(dataset_t*dataset)
+{
+    remote_dataset_t*d = calloc(1, sizeof(remote_dataset_t));
+    d->sig = dataset->sig;
+    d->dataset = dataset;
+    return d;
+}
+
+void remote_dataset_destroy(remote_dataset_t*d)
+{
+    int t;
+    for(t=0;t<NUM_WIRE_FORMATS;t++) {
+        free(d->encoding[t].data);
+    }
+    free(d);
+}
+
+static remote_job_t* remote_job_new(const char*model_name, remote_dataset_t*dataset)
+{
+    remote_job_t*j = calloc(1, sizeof(remote_job_t));
+    j->id = next_job_id++;
+    j->sig = dataset->sig;
+
+    model_factory_t*factory = model_factory_get_by_name(model_name);
+    j->cost = factory ? model_factory_cost(factory, dataset->dataset) : 1;
+    return j;
+}
+
+static bool remote_job_send(remote_job_t*j, connection_t*c, const char*model_name, remote_dataset_t*dataset)
+{
+    printf("Starting %s on %s:%d\n", model_name, c->server->host, c->server->port);fflush(stdout);
+    if(!connection_send_job(c, j, model_name, dataset)) {
+        connection_close(c);
+        return false;
+    }
+    total_cost += j->cost;
+    total_jobs++;
     j->start_time = time(0);
+    return true;
+}
+
+remote_job_t* remote_job_start(const char*model_name, remote_dataset_t*dataset)
+{
+    remote_job_t*j = remote_job_new(model_name, dataset);
+    while(1) {
+        if(!config_num_remote_servers) {
+            fprintf(stderr, "No remote servers configured.\n");
+            exit(1);
+        }
+        connection_t*c = connection_pick(j->cost, 0, &j->expected);
+        if(c) {
+            if(remote_job_send(j, c, model_name, dataset))
+                break;
+        } else {
+            connection_flush_all();
+            sleep(1);
+        }
+    }
+    return j;
+}
+
+/* start a copy of a job on a different server than the one it's
+   running on. Returns NULL if no other server is available. */
+remote_job_t* remote_job_start_elsewhere(const char*model_name, remote_dataset_t*dataset, remote_job_t*other)
+{
+    remote_job_t*j = remote_job_new(model_name, dataset);
+    connection_t*c = connection_pick(j->cost, other->connection, &j->expected);
+    if(!c || !remote_job_send(j, c, model_name, dataset)) {
+        free(j);
+        return 0;
+    }
     return j;
 }
 
 bool remote_job_is_ready(remote_job_t*j)
 {
-    struct timeval timeout;
-    memset(&timeout, 0, sizeof(timeout));
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(j->socket, &readfds);
-    while(1) {
-        int ret = select(j->socket+1, &readfds, NULL, NULL, &timeout);
-        if(ret<0 && (errno == EINTR || errno == EAGAIN))
-            continue;
-        break;
+    if(!j->finished && connection_flush(j->connection)) {
+        connection_poll(j->connection);
     }
-    return !!FD_ISSET(j->socket, &readfds);
+    return j->finished;
 }
 
 model_t* remote_job_read_result(remote_job_t*j)
 {
-    reader_t*r = filereader_with_timeout_new(j->socket, config_remote_read_timeout);
-    model_t*m = model_read(r);
-    r->dealloc(r);
+    if(!j->finished)
+        connection_flush(j->connection);
+    while(!j->finished) {
+        int left = config_model_timeout - remote_job_age(j);
+        if(left <= 0 || !fd_is_readable(j->connection->socket, left)) {
+            fprintf(stderr, "timeout while waiting for %s job %d\n", j->connection->server->host, j->id);
+            remote_job_cancel(j);
+            return 0;
+        }
+        connection_poll(j->connection);
+    }
+    finished_jobs_remove(j);
+    model_t*m = j->model;
     free(j);
     return m;
 }
 
 void remote_job_cancel(remote_job_t*j)
 {
-    close(j->socket);
+    if(!j->finished && connection_flush(j->connection)) {
+        connection_t*c = j->connection;
+        connection_unlink_job(c, j);
+        unsigned char head[4];
+        put_uint32(head, j->id);
+        if(!send_frame(c->socket, FRAME_CANCEL, head, 4, 0, 0)) {
+            connection_close(c);
+        }
+    } else {
+        finished_jobs_remove(j);
+        if(j->model)
+            model_destroy(j->model);
+    }
     free(j);
 }
 
+/* Returns a job that finished (successfully or not), waiting up to
+   timeout_ms milliseconds (-1 = forever) for one. Returns NULL if
+   none finished in time. */
+remote_job_t* remote_job_wait(int timeout_ms)
+{
+    connection_flush_all();
+    if(!finished_jobs && epoll_fd >= 0) {
+        struct epoll_event events[16];
+        int num = epoll_wait(epoll_fd, events, 16, timeout_ms);
+        if(num < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        int t;
+        for(t=0;t<num;t++) {
+            connection_poll((connection_t*)events[t].data.ptr);
+        }
+    }
+    remote_job_t*j = finished_jobs;
+    if(j) {
+        finished_jobs = j->next;
+        j->next = 0;
+    }
+    return j;
+}
+
 time_t remote_job_age(remote_job_t*j)
 {
     return time(0) - j->start_time;
@@ -294,6 +2001,9 @@ time_t remote_job_age(remote_job_t*j)
 
 model_t* process_job_remotely(const char*model_name, dataset_t*dataset)
 {
-    remote_job_t*j = remote_job_start(model_name, dataset);
-    return remote_job_read_result(j);
+    remote_dataset_t*d = remote_dataset_new(dataset);
+    remote_job_t*j = remote_job_start(model_name, d);
+    model_t*m = remote_job_read_result(j);
+    remote_dataset_destroy(d);
+    return m;
 }
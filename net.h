@@ -22,18 +22,66 @@
 #ifndef __server_h__
 #define __server_h__
 
+#include <stdint.h>
 #include <time.h>
 #include "dataset.h"
 
+/* how a dataset is encoded on the wire. Flags; the client uses those
+   that both it and the server support. */
+#define WIRE_PACKED 1 // bit-packed columns, see dataset_write_packed()
+#define WIRE_ZLIB   2 // deflate compressed
+#define NUM_WIRE_FORMATS 4
+
+/* datasets are addressed by the SHA-256 of their encoding */
+#define DATASET_HASH_SIZE 32
+
+typedef struct _remote_encoding {
+    unsigned char hash[DATASET_HASH_SIZE];
+    uint32_t length;
+    void*data;
+} remote_encoding_t;
+
+/* a dataset, serialized once per wire format (on first use),
+   and addressed by its content */
+typedef struct _remote_dataset {
+    remote_encoding_t encoding[NUM_WIRE_FORMATS];
+    signature_t*sig;
+    dataset_t*dataset;
+} remote_dataset_t;
+
 typedef struct _remote_job {
-    int socket;
+    struct _connection*connection;
+    uint32_t id;
     time_t start_time;
+    signature_t*sig;
+    double cost;
+
+    /* when we expected the job to finish, in cost units
+       from the time it was started (see model_factory_cost()) */
+    double expected;
+
+    bool finished;
+    model_t*model;
+
+    /* for the caller, to find its own job again in remote_job_wait() */
+    void*owner;
+
+    struct _remote_job*next;
 } remote_job_t;
 
+int start_server(int port);
 int connect_to_host(const char *host, int port);
 model_t* process_job_remotely(const char*model_name, dataset_t*dataset);
-remote_job_t* remote_job_start(const char*model_name, dataset_t*dataset);
+
+remote_dataset_t* remote_dataset_new(dataset_t*dataset);
+void remote_dataset_destroy(remote_dataset_t*d);
+
+remote_job_t* remote_job_start(const char*model_name, remote_dataset_t*dataset);
+remote_job_t* remote_job_start_elsewhere(const char*model_name, remote_dataset_t*dataset, remote_job_t*other);
 bool remote_job_is_ready(remote_job_t*j);
 time_t remote_job_age(remote_job_t*j);
 model_t* remote_job_read_result(remote_job_t*j);
+void remote_job_cancel(remote_job_t*j);
+remote_job_t* remote_job_wait(int timeout_ms);
+void remote_disconnect_all();
 #endif
@@ -23,10 +23,12 @@
 #include <stdlib.h>
 #include <memory.h>
 #include "ast.h"
+#include "ast_transforms.h"
 #include "io.h"
 #include "stringpool.h"
 #include "serialize.h"
 #include "dataset.h"
+#include "forest.h"
 
 static nodetype_t* opcode_to_node(uint8_t opcode)
 {
@@ -74,6 +76,72 @@ constant_t constant_read(reader_t*reader)
     return c;
 }
 
+static array_t* array_read(reader_t*reader)
+{
+    uint32_t len = read_compressed_uint(reader);
+    if(reader->error)
+        return NULL;
+    int t;
+    array_t*a = array_new(len);
+    for(t=0;t<len;t++) {
+        a->entries[t] = constant_read(reader);
+        if(!a->entries[t].type) {
+            array_destroy(a);
+            return NULL;
+        }
+    }
+    return a;
+}
+
+static forest_t* forest_read(reader_t*reader)
+{
+    uint8_t kind = read_uint8(reader);
+    if(kind != FOREST_VOTE && kind != FOREST_SUM)
+        return NULL;
+    array_t*classes = array_read(reader);
+    if(!classes)
+        return NULL;
+    forest_t*f = forest_new(kind, classes);
+
+    int num_trees = read_compressed_uint(reader);
+    int k;
+    for(k=0;k<num_trees && !reader->error;k++) {
+        forest_start_tree(f, read_compressed_uint(reader));
+        int num_nodes = read_compressed_uint(reader);
+        int n;
+        for(n=0;n<num_nodes && !reader->error;n++) {
+            int feature = (int)read_compressed_uint(reader) - 1;
+            if(feature == FOREST_LEAF) {
+                if(kind == FOREST_VOTE) {
+                    forest_add_leaf(f, read_compressed_uint(reader), 0);
+                } else {
+                    forest_add_leaf(f, 0, read_float(reader));
+                }
+                continue;
+            }
+            uint8_t flags = read_uint8(reader);
+            bool inversed = !!(flags & FOREST_FLAG_INVERSED);
+            int split;
+            if(flags & FOREST_FLAG_CATEGORICAL) {
+                array_t*set = array_read(reader);
+                if(!set) {
+                    forest_destroy(f);
+                    return NULL;
+                }
+                split = forest_add_category_split(f, feature, set, inversed);
+            } else {
+                split = forest_add_split(f, feature, read_float(reader), inversed);
+            }
+            f->right[split] = split + read_compressed_uint(reader);
+        }
+    }
+    if(reader->error || !forest_sanitycheck(f)) {
+        forest_destroy(f);
+        return NULL;
+    }
+    return f;
+}
+
 bool node_read_internal_data(node_t*node, reader_t*reader)
 {
     nodetype_t*type = node->type;
@@ -120,6 +188,11 @@ bool node_read_internal_data(node_t*node, reader_t*reader)
     } else if(type==&node_string) {
         char*s = read_string(reader);
         node->value = string_constant(s);
+    } else if(type==&node_forest) {
+        forest_t*f = forest_read(reader);
+        if(!f)
+            return false;
+        node->value = forest_constant(f);
     } else if(type==&node_constant || type==&node_setlocal || type==&node_getlocal || type==&node_inclocal) {
         node->value = constant_read(reader);
         if(!node->value.type)
@@ -153,6 +226,37 @@ nodestack_t*stack_pop(nodestack_t*stack)
     return stack;
 }
 
+/* lookups return the value at the position of the matching key, and
+   dot products multiply every input with the weight at its position, so
+   the program_t compiler and code generators rely on this */
+static bool node_check_tables(node_t*n)
+{
+    if(n->type == &node_lookup) {
+        node_t*keys = n->child[1];
+        node_t*values = n->child[2];
+        if(!node_is_array(keys) || keys->type == &node_zero_int_array ||
+           values->type != &node_float_array ||
+           keys->value.a->size != values->value.a->size) {
+            fprintf(stderr, "Invalid lookup table\n");
+            return false;
+        }
+    }
+    if(n->type == &node_dot) {
+        node_t*weights = n->child[0];
+        if(weights->type != &node_float_array ||
+           weights->value.a->size != n->num_children - 1) {
+            fprintf(stderr, "Invalid dot product weights\n");
+            return false;
+        }
+    }
+    int t;
+    for(t=0;t<n->num_children;t++) {
+        if(!node_check_tables(n->child[t]))
+            return false;
+    }
+    return true;
+}
+
 node_t* node_read(reader_t*reader)
 {
     nodestack_t*stack = 0;
@@ -188,7 +292,7 @@ node_t* node_read(reader_t*reader)
             return NULL;
     } while(stack);
 
-    if(!node_sanitycheck(top_node))
+    if(!node_sanitycheck(top_node) || !node_check_tables(top_node))
         return NULL;
 
     return top_node;
@@ -245,6 +349,50 @@ static void constant_write(constant_t*value, writer_t*writer, unsigned flags)
     }
 }
 
+static void array_write(array_t*a, writer_t*writer, unsigned flags)
+{
+    write_compressed_uint(writer, a->size);
+    int t;
+    for(t=0;t<a->size;t++) {
+        constant_write(&a->entries[t], writer, flags);
+    }
+}
+
+static void forest_write(forest_t*f, writer_t*writer, unsigned flags)
+{
+    write_uint8(writer, f->kind);
+    array_write(f->classes, writer, flags);
+    write_compressed_uint(writer, f->num_trees);
+    int k;
+    for(k=0;k<f->num_trees;k++) {
+        int start = f->tree_root[k];
+        int end = k+1<f->num_trees ? f->tree_root[k+1] : f->num_nodes;
+        write_compressed_uint(writer, f->tree_class[k]);
+        write_compressed_uint(writer, end - start);
+        int n;
+        for(n=start;n<end;n++) {
+            write_compressed_uint(writer, f->feature[n] + 1);
+            if(f->feature[n] == FOREST_LEAF) {
+                if(f->kind == FOREST_VOTE) {
+                    write_compressed_uint(writer, f->right[n]);
+                } else {
+                    write_float(writer, f->threshold[n]);
+                }
+                continue;
+            }
+            write_uint8(writer, f->flags[n]);
+            if(f->flags[n] & FOREST_FLAG_CATEGORICAL) {
+                array_write(f->sets[f->set[n]], writer, flags);
+            } else {
+                write_float(writer, f->threshold[n]);
+            }
+            /* right children are always behind their parent, and usually
+               close by, so store the distance */
+            write_compressed_uint(writer, f->right[n] - n);
+        }
+    }
+}
+
 static void node_write_internal_data(node_t*node, writer_t*writer, unsigned flags)
 {
     if(node->type==&node_int_array ||
@@ -281,6 +429,8 @@ static void node_write_internal_data(node_t*node, writer_t*writer, unsigned flag
     } else if(node->type==&node_zero_int_array) {
         int size = node->value.a->size;
         write_compressed_uint(writer, size);
+    } else if(node->type==&node_forest) {
+        forest_write(AS_FOREST(node->value), writer, flags);
     } else if(node->type->flags&NODE_FLAG_HAS_VALUE) {
         constant_write(&node->value, writer, flags);
     }
@@ -342,6 +492,7 @@ model_t* model_read(reader_t*r)
         free(m);
         return NULL;
     }
+    m->num_locals = node_highest_local((node_t*)m->code);
     return m;
 }
 model_t* model_load(const char*filename)
@@ -469,9 +620,9 @@ trainingdata_t* trainingdata_load(const char*filename)
 void trainingdata_write(trainingdata_t*d, writer_t*w)
 {
     write_compressed_uint(w, d->num_examples);
-    example_t*e = d->first_example;
-    int count = 0;
-    while(e) {
+    int y;
+    for(y=0;y<d->num_examples;y++) {
+        example_t*e = trainingdata_get_example(d, y);
         write_compressed_uint(w, e->num_inputs);
         write_uint8(w, e->input_names ? 1 : 0);
         int t;
@@ -481,10 +632,8 @@ void trainingdata_write(trainingdata_t*d, writer_t*w)
             variable_write(&e->inputs[t], w);
         }
         variable_write(&e->desired_response, w);
-        e = e->next;
-        count++;
+        example_destroy(e);
     }
-    assert(count == d->num_examples);
 }
 void trainingdata_save(trainingdata_t*d, const char*filename)
 {
@@ -493,12 +642,11 @@ void trainingdata_save(trainingdata_t*d, const char*filename)
     w->finish(w);
 }
 
-void column_write(column_t*c, int num_rows, writer_t*w)
+static void column_write_header(column_t*c, writer_t*w)
 {
     write_string(w, c->name);
     write_compressed_int(w, c->index);
     write_uint8(w, c->is_categorical);
-    int y;
     if(c->is_categorical) {
         write_compressed_uint(w, c->num_classes);
         int t;
@@ -506,16 +654,9 @@ void column_write(column_t*c, int num_rows, writer_t*w)
             constant_write(&c->classes[t], w, 0);
             write_compressed_uint(w, c->class_occurence_count[t]);
         }
-        for(y=0;y<num_rows;y++) {
-            write_compressed_uint(w, c->entries[y].c);
-        }
-    } else {
-        for(y=0;y<num_rows;y++) {
-            write_float(w, c->entries[y].f);
-        }
     }
 }
-column_t* column_read(int num_rows, reader_t*r)
+static column_t* column_read_header(int num_rows, reader_t*r)
 {
     char*name = read_string(r);
     int index = read_compressed_int(r);
@@ -527,7 +668,6 @@ column_t* column_read(int num_rows, reader_t*r)
         c->name = 0;
     }
     free(name);
-    int y;
     if(c->is_categorical) {
         c->num_classes = read_compressed_uint(r);
         c->classes = malloc(sizeof(c->classes[0])*c->num_classes);
@@ -537,6 +677,28 @@ column_t* column_read(int num_rows, reader_t*r)
             c->classes[t] = constant_read(r);
             c->class_occurence_count[t] = read_compressed_uint(r);
         }
+    }
+    return c;
+}
+void column_write(column_t*c, int num_rows, writer_t*w)
+{
+    column_write_header(c, w);
+    int y;
+    if(c->is_categorical) {
+        for(y=0;y<num_rows;y++) {
+            write_compressed_uint(w, c->entries[y].c);
+        }
+    } else {
+        for(y=0;y<num_rows;y++) {
+            write_float(w, c->entries[y].f);
+        }
+    }
+}
+column_t* column_read(int num_rows, reader_t*r)
+{
+    column_t* c = column_read_header(num_rows, r);
+    int y;
+    if(c->is_categorical) {
         for(y=0;y<num_rows;y++) {
             c->entries[y].c = read_compressed_uint(r);
         }
@@ -547,6 +709,202 @@ column_t* column_read(int num_rows, reader_t*r)
     }
     return c;
 }
+
+/* The packed format stores every column with as few bits per entry as
+   its values need: Categories as indices of ceil(log2(num_classes))
+   bits, continuous columns holding only small integers as offsets from
+   their minimum, and other continuous columns with few distinct values
+   as indices into a dictionary. Only what's left is written as floats. */
+
+#define PACKED_FLOATS 0
+#define PACKED_INTEGERS 1
+#define PACKED_DICTIONARY 2
+
+static int bits_needed(uint32_t max)
+{
+    int bits = 0;
+    while(bits < 32 && (max >> bits)) {
+        bits++;
+    }
+    return bits;
+}
+/* bits are stored msb first, ceil(num*bits/8) bytes in total */
+static void write_packed(writer_t*w, uint32_t*values, int num, int bits)
+{
+    int len = (int)(((int64_t)num*bits+7)/8);
+    uint8_t*data = malloc(len+1);
+    uint64_t acc = 0;
+    int acc_bits = 0, pos = 0, y;
+    for(y=0;y<num;y++) {
+        acc = acc << bits | values[y];
+        acc_bits += bits;
+        while(acc_bits >= 8) {
+            acc_bits -= 8;
+            data[pos++] = acc >> acc_bits;
+        }
+    }
+    if(acc_bits) {
+        data[pos++] = acc << (8-acc_bits);
+    }
+    assert(pos == len);
+    w->write(w, data, len);
+    free(data);
+}
+static void read_packed(reader_t*r, uint32_t*values, int num, int bits)
+{
+    int len = (int)(((int64_t)num*bits+7)/8);
+    uint8_t*data = malloc(len+1);
+    int l = r->read(r, data, len);
+    if(l < len) {
+        fprintf(stderr, "serialize.c:read_packed: short read (%d < %d)\n", l, len);
+        memset(data+(l<0?0:l), 0, len-(l<0?0:l));
+    }
+    uint32_t mask = bits<32 ? (1u<<bits)-1 : 0xffffffffu;
+    uint64_t acc = 0;
+    int acc_bits = 0, pos = 0, y;
+    for(y=0;y<num;y++) {
+        while(acc_bits < bits) {
+            acc = acc << 8 | data[pos++];
+            acc_bits += 8;
+        }
+        acc_bits -= bits;
+        values[y] = (acc >> acc_bits) & mask;
+    }
+    free(data);
+}
+static int compare_uint32(const void*_a, const void*_b)
+{
+    uint32_t a = *(const uint32_t*)_a;
+    uint32_t b = *(const uint32_t*)_b;
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+static bool float_is_small_int(uint32_t v)
+{
+    float f;
+    memcpy(&f, &v, sizeof(f));
+    if(!(f >= -0x800000 && f <= 0x800000))
+        return false;
+    float i = (float)(int32_t)f;
+    uint32_t bits;
+    memcpy(&bits, &i, sizeof(bits));
+    return bits == v;
+}
+
+/* floats are compared by their bit patterns, so that -0.0 and NaNs
+   survive the round trip */
+static void column_write_packed(column_t*c, int num_rows, writer_t*w)
+{
+    column_write_header(c, w);
+    uint32_t*values = malloc(sizeof(uint32_t)*(num_rows+1));
+    int y;
+    if(c->is_categorical) {
+        for(y=0;y<num_rows;y++) {
+            values[y] = c->entries[y].c;
+        }
+        write_packed(w, values, num_rows, bits_needed(c->num_classes ? c->num_classes-1 : 0));
+        free(values);
+        return;
+    }
+    for(y=0;y<num_rows;y++) {
+        memcpy(&values[y], &c->entries[y].f, sizeof(uint32_t));
+    }
+
+    bool integers = true;
+    int32_t min = 0, max = 0;
+    for(y=0;y<num_rows;y++) {
+        if(!float_is_small_int(values[y])) {
+            integers = false;
+            break;
+        }
+        int32_t i = (int32_t)c->entries[y].f;
+        if(!y || i < min) min = i;
+        if(!y || i > max) max = i;
+    }
+    if(integers) {
+        int bits = bits_needed(max - min);
+        write_uint8(w, PACKED_INTEGERS);
+        write_compressed_int(w, min);
+        write_uint8(w, bits);
+        for(y=0;y<num_rows;y++) {
+            values[y] = (int32_t)c->entries[y].f - min;
+        }
+        write_packed(w, values, num_rows, bits);
+        free(values);
+        return;
+    }
+
+    uint32_t*dict = malloc(sizeof(uint32_t)*(num_rows+1));
+    memcpy(dict, values, sizeof(uint32_t)*num_rows);
+    qsort(dict, num_rows, sizeof(uint32_t), compare_uint32);
+    int num_distinct = 0;
+    for(y=0;y<num_rows;y++) {
+        if(!num_distinct || dict[num_distinct-1] != dict[y])
+            dict[num_distinct++] = dict[y];
+    }
+    int bits = bits_needed(num_distinct ? num_distinct-1 : 0);
+    if((int64_t)num_distinct*32 + (int64_t)num_rows*bits >= (int64_t)num_rows*32) {
+        write_uint8(w, PACKED_FLOATS);
+        for(y=0;y<num_rows;y++) {
+            write_float(w, c->entries[y].f);
+        }
+        free(dict);
+        free(values);
+        return;
+    }
+    write_uint8(w, PACKED_DICTIONARY);
+    write_compressed_uint(w, num_distinct);
+    for(y=0;y<num_distinct;y++) {
+        write_uint32(w, dict[y]);
+    }
+    for(y=0;y<num_rows;y++) {
+        uint32_t*pos = bsearch(&values[y], dict, num_distinct, sizeof(uint32_t), compare_uint32);
+        values[y] = pos - dict;
+    }
+    write_packed(w, values, num_rows, bits);
+    free(dict);
+    free(values);
+}
+static column_t* column_read_packed(int num_rows, reader_t*r)
+{
+    column_t* c = column_read_header(num_rows, r);
+    uint32_t*values = malloc(sizeof(uint32_t)*(num_rows+1));
+    int y;
+    if(c->is_categorical) {
+        read_packed(r, values, num_rows, bits_needed(c->num_classes ? c->num_classes-1 : 0));
+        for(y=0;y<num_rows;y++) {
+            c->entries[y].c = values[y];
+        }
+        free(values);
+        return c;
+    }
+    uint8_t type = read_uint8(r);
+    if(type == PACKED_INTEGERS) {
+        int32_t min = read_compressed_int(r);
+        int bits = read_uint8(r);
+        read_packed(r, values, num_rows, bits);
+        for(y=0;y<num_rows;y++) {
+            c->entries[y].f = (int32_t)values[y] + min;
+        }
+    } else if(type == PACKED_DICTIONARY) {
+        int num_distinct = read_compressed_uint(r);
+        uint32_t*dict = malloc(sizeof(uint32_t)*(num_distinct+1));
+        for(y=0;y<num_distinct;y++) {
+            dict[y] = read_uint32(r);
+        }
+        read_packed(r, values, num_rows, bits_needed(num_distinct ? num_distinct-1 : 0));
+        for(y=0;y<num_rows;y++) {
+            uint32_t v = values[y] < num_distinct ? dict[values[y]] : 0;
+            memcpy(&c->entries[y].f, &v, sizeof(float));
+        }
+        free(dict);
+    } else {
+        for(y=0;y<num_rows;y++) {
+            c->entries[y].f = read_float(r);
+        }
+    }
+    free(values);
+    return c;
+}
 void dataset_write(dataset_t*d, writer_t*w)
 {
     write_compressed_uint(w, d->num_columns);
@@ -568,6 +926,33 @@ dataset_t*dataset_read(reader_t*r)
         d->columns[t] = column_read(d->num_rows, r);
     }
     d->desired_response = column_read(d->num_rows, r);
+    d->sig = signature_from_columns(d->columns, d->num_columns, false);
+    dataset_pack_columns(d);
+    return d;
+}
+void dataset_write_packed(dataset_t*d, writer_t*w)
+{
+    write_compressed_uint(w, d->num_columns);
+    write_compressed_uint(w, d->num_rows);
+    int t;
+    for(t=0;t<d->num_columns;t++) {
+        column_write_packed(d->columns[t], d->num_rows, w);
+    }
+    column_write_packed(d->desired_response, d->num_rows, w);
+}
+dataset_t*dataset_read_packed(reader_t*r)
+{
+    dataset_t*d = calloc(1, sizeof(dataset_t));
+    d->num_columns = read_compressed_uint(r);
+    d->num_rows = read_compressed_uint(r);
+    d->columns = malloc(sizeof(d->columns[0])*d->num_columns);
+    int t;
+    for(t=0;t<d->num_columns;t++) {
+        d->columns[t] = column_read_packed(d->num_rows, r);
+    }
+    d->desired_response = column_read_packed(d->num_rows, r);
+    d->sig = signature_from_columns(d->columns, d->num_columns, false);
+    dataset_pack_columns(d);
     return d;
 }
 void dataset_save(dataset_t*d, const char*filename)
@@ -49,6 +49,8 @@ void dataset_save(dataset_t*d, const char*filename);
 dataset_t* dataset_load(const char*filename);
 void dataset_write(dataset_t*d, writer_t*w);
 dataset_t*dataset_read(reader_t*r);
+void dataset_write_packed(dataset_t*d, writer_t*w);
+dataset_t*dataset_read_packed(reader_t*r);
 
 #ifdef __cplusplus
 }
@@ -4,10 +4,13 @@
 #include "mrscake.h"
 #include "dataset.h"
 #include "net.h"
+#include "settings.h"
 
 int main()
 {
     int port = 3075;
+    /* one worker per core */
+    config_num_threads = 0;
     start_server(port);
     return 0;
 }
@@ -22,7 +22,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include "settings.h"
+#include "net.h"
 
 int config_num_remote_servers = 0;
 remote_server_t*config_remote_servers = 0;
@@ -30,6 +32,19 @@ int config_job_wait_timeout = 300;
 int config_remote_read_timeout = 10;
 int config_model_timeout = 15;
 bool config_do_remote_processing = false;
+int config_remote_wire_format = WIRE_PACKED|WIRE_ZLIB;
+double config_remote_hedge_percentile = 0.75;
+int config_num_threads = 1;
+bool config_fork_for_training = false;
+bool config_successive_halving = false;
+
+int config_get_num_threads()
+{
+    if(config_num_threads > 0)
+        return config_num_threads;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
 
 static int remote_server_size = 0;
 
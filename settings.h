@@ -37,5 +37,29 @@ extern int config_job_wait_timeout;
 extern int config_model_timeout;
 extern bool config_do_remote_processing;
 
+/* WIRE_* flags (see net.h) for how datasets may be sent to
+   remote servers, if the server supports them */
+extern int config_remote_wire_format;
+
+/* start a copy of a remote job on another server once it took longer,
+   relative to its expected duration, than this fraction of all jobs.
+   0 = never */
+extern double config_remote_hedge_percentile;
+
+/* number of threads to use for local training.
+   0 = one thread per CPU core */
+extern int config_num_threads;
+int config_get_num_threads();
+
+/* train every model in a process of its own (at most
+   config_get_num_threads() at once), so that a model crashing
+   doesn't take the calling program down with it */
+extern bool config_fork_for_training;
+
+/* train all models on small subsets of the data first, and only
+   train the most promising ones on the whole dataset */
+extern bool config_successive_halving;
+
+void config_add_remote_server(char*host, int port);
 void config_parse_remote_servers(char*filename);
 #endif
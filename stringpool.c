@@ -21,21 +21,118 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "stringpool.h"
 #include "dict.h"
 
-static dict_t*stringpool = 0;
+/* The string pool is shared between all threads. Lookups of strings
+   that are already in the pool don't take any locks: Entries are only
+   ever prepended to a hash chain, and never modified or freed after
+   they have been published, so a reader always sees a consistent
+   chain. Insertions lock one of NUM_SHARDS shards. */
 
-const char*register_string(const char*s)
+#define NUM_SHARDS 64
+#define INITIAL_SLOTS 64
+
+typedef struct _poolentry {
+    const char*str;
+    unsigned int hash;
+    struct _poolentry*next;
+} poolentry_t;
+
+typedef struct _pooltable {
+    int size;
+    struct _pooltable*old;
+    poolentry_t*slots[0];
+} pooltable_t;
+
+typedef struct _poolshard {
+    pthread_mutex_t mutex;
+    pooltable_t*table;
+    int num;
+} poolshard_t;
+
+static poolshard_t shards[NUM_SHARDS] = {
+    [0 ... NUM_SHARDS-1] = {mutex: PTHREAD_MUTEX_INITIALIZER}
+};
+
+static inline poolentry_t**table_slot(pooltable_t*table, unsigned int hash)
 {
-    if(!stringpool) {
-        stringpool = dict_new(&charptr_type);
+    return &table->slots[(hash / NUM_SHARDS) & (table->size - 1)];
+}
+
+static const char*shard_lookup(poolshard_t*shard, const char*s, unsigned int hash)
+{
+    pooltable_t*table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+    if(!table)
+        return 0;
+    poolentry_t*e = __atomic_load_n(table_slot(table, hash), __ATOMIC_ACQUIRE);
+    while(e) {
+        if(e->hash == hash && !strcmp(e->str, s))
+            return e->str;
+        e = e->next;
     }
-    char*stored_string = dict_lookup(stringpool, s);
+    return 0;
+}
+
+static pooltable_t*table_new(int size, pooltable_t*old)
+{
+    pooltable_t*table = calloc(1, sizeof(pooltable_t) + sizeof(poolentry_t*)*size);
+    table->size = size;
+    table->old = old;
+    return table;
+}
+
+static void table_add(pooltable_t*table, const char*s, unsigned int hash)
+{
+    poolentry_t**slot = table_slot(table, hash);
+    poolentry_t*e = malloc(sizeof(poolentry_t));
+    e->str = s;
+    e->hash = hash;
+    e->next = *slot;
+    __atomic_store_n(slot, e, __ATOMIC_RELEASE);
+}
+
+/* must be called with the shard locked */
+static void shard_grow(poolshard_t*shard)
+{
+    pooltable_t*old = shard->table;
+    pooltable_t*table = table_new(old->size*2, old);
+    int t;
+    for(t=0;t<old->size;t++) {
+        poolentry_t*e;
+        for(e=old->slots[t];e;e=e->next) {
+            table_add(table, e->str, e->hash);
+        }
+    }
+    /* Readers might still be walking the old table, so we copy the
+       entries instead of relinking them, and never free the old table. */
+    __atomic_store_n(&shard->table, table, __ATOMIC_RELEASE);
+}
+
+const char*register_string(const char*s)
+{
+    unsigned int hash = crc32_add_string(0, s);
+    poolshard_t*shard = &shards[hash % NUM_SHARDS];
+
+    const char*stored_string = shard_lookup(shard, s, hash);
+    if(stored_string)
+        return stored_string;
+
+    pthread_mutex_lock(&shard->mutex);
+    /* some other thread might have added the string in the meantime */
+    stored_string = shard_lookup(shard, s, hash);
     if(!stored_string) {
-        stored_string = (char*)strdup(s);
-        dict_put(stringpool, s, stored_string);
+        if(!shard->table) {
+            __atomic_store_n(&shard->table, table_new(INITIAL_SLOTS, 0), __ATOMIC_RELEASE);
+        } else if(shard->num >= shard->table->size*2) {
+            shard_grow(shard);
+        }
+        stored_string = strdup(s);
+        table_add(shard->table, stored_string, hash);
+        shard->num++;
     }
+    pthread_mutex_unlock(&shard->mutex);
     return stored_string;
 }
 const char*register_and_free_string(char*s)
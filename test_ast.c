@@ -20,9 +20,15 @@
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
 #include "easy_ast.h"
 #include "io.h"
 #include "serialize.h"
+#include "bytecode.h"
+#include "ast_transforms.h"
+#include "environment.h"
 
 environment_t test_environment()
 {
@@ -121,9 +127,266 @@ void test_array()
     node_destroy(node);
 }
 
+void test_dot()
+{
+    float w[] = {0.5, 0.25, 2.0, 1.0, -1.0};
+    array_t*weights = array_new(5);
+    int t;
+    for(t=0;t<5;t++) {
+        weights->entries[t] = float_constant(w[t]);
+    }
+
+    START_CODE(node)
+	DOT(weights)
+	    RAW_PARAM(0)
+	    RAW_PARAM(1)
+	    RAW_PARAM(2)
+	    FLOAT_CONSTANT(3.0)
+	    RAW_PARAM(0)
+	END;
+    END_CODE;
+
+    node_print(node);
+
+    node = test_serialization(node);
+
+    environment_t env = test_environment();
+    constant_t v = node_eval(node, &env);
+    assert(v.type == CONSTANT_FLOAT);
+    assert(v.f == 11.0);
+
+    program_t*p = program_compile(node);
+    constant_t v2 = program_run(p, env.row);
+    assert(v2.type == CONSTANT_FLOAT);
+    assert(v2.f == v.f);
+    program_destroy(p);
+
+    row_destroy(env.row);
+    node_destroy(node);
+}
+
+/* The 1.0 only survives if the products are summed up left to right
+   in double precision, which is what the generated Python code does. */
+void test_dot_python()
+{
+    float w[] = {1e8, 1.0, -1e8};
+    array_t*weights = array_new(3);
+    int t;
+    for(t=0;t<3;t++) {
+        weights->entries[t] = float_constant(w[t]);
+    }
+
+    START_CODE(node)
+	DOT(weights)
+	    RAW_PARAM(0)
+	    RAW_PARAM(0)
+	    RAW_PARAM(0)
+	END;
+    END_CODE;
+
+    environment_t env = test_environment();
+    constant_t v = node_eval(node, &env);
+    assert(v.type == CONSTANT_FLOAT);
+    assert(v.f == 1.0);
+
+    program_t*p = program_compile(node);
+    constant_t v2 = program_run(p, env.row);
+    assert(v2.f == v.f);
+    program_destroy(p);
+
+    columntype_t types[] = {CONTINUOUS, CONTINUOUS, CONTINUOUS, CATEGORICAL};
+    signature_t sig = {num_inputs: 4, column_types: types};
+    model_t*m = (model_t*)calloc(1, sizeof(model_t));
+    m->sig = &sig;
+    m->code = node;
+    m->num_locals = -1;
+    char*code = model_generate_code(m, "python");
+
+    FILE*fi = popen("python", "w");
+    if(!fi) {
+        perror("python");
+        exit(1);
+    }
+    fprintf(fi, "%s\n", code);
+    fprintf(fi, "import sys\n"
+                "sys.exit(predict([1.0, 2.0, 4.0, 5]) != %f)\n", v.f);
+    int status = pclose(fi);
+    if(status == -1 || WEXITSTATUS(status) == 127) {
+        printf("python not found, not comparing the generated code\n");
+    } else {
+        assert(status == 0);
+    }
+    free(code);
+    model_destroy(m);
+    row_destroy(env.row);
+}
+
+/* evaluate node, which may use locals, on the test row */
+double test_eval_float(node_t*node)
+{
+    environment_t env = test_environment();
+    environment_t*e = environment_new(node, env.row);
+    constant_t v = node_eval(node, e);
+    assert(v.type == CONSTANT_FLOAT);
+    environment_destroy(e);
+    row_destroy(env.row);
+    return v.f;
+}
+
+void test_optimize_if_true()
+{
+    START_CODE(node)
+	IF
+	    BOOL_CONSTANT(1)
+	THEN
+	    ADD
+		RAW_PARAM(0)
+		RAW_PARAM(1)
+	    END;
+	ELSE
+	    FLOAT_CONSTANT(0.0)
+	END;
+    END_CODE;
+
+    double before = test_eval_float(node);
+    node = node_optimize(node);
+    node_print(node);
+
+    assert(node->type == &node_add);
+    assert(node->num_children == 2);
+    assert(node->child[0]->type == &node_param && node->child[0]->value.i == 0);
+    assert(node->child[1]->type == &node_param && node->child[1]->value.i == 1);
+    assert(node_sanitycheck(node));
+    assert(before == 3.0);
+    assert(test_eval_float(node) == before);
+    node_destroy(node);
+}
+
+void test_optimize_common_subexpressions()
+{
+    START_CODE(node)
+	BLOCK
+	    ADD
+		SQR
+		    SUB
+			RAW_PARAM(0)
+			RAW_PARAM(2)
+		    END;
+		END;
+		SQR
+		    SUB
+			RAW_PARAM(0)
+			RAW_PARAM(2)
+		    END;
+		END;
+	    END;
+	END;
+    END_CODE;
+
+    double before = test_eval_float(node);
+    node = node_optimize(node);
+    node_print(node);
+
+    /* the square is computed once, into local 0 */
+    assert(node->type == &node_block);
+    assert(node->num_children == 2);
+    node_t*setlocal = node->child[0];
+    assert(setlocal->type == &node_setlocal && setlocal->value.i == 0);
+    assert(setlocal->child[0]->type == &node_sqr);
+    assert(setlocal->child[0]->child[0]->type == &node_sub);
+    node_t*add = node->child[1];
+    assert(add->type == &node_add && add->num_children == 2);
+    assert(add->child[0]->type == &node_getlocal && add->child[0]->value.i == 0);
+    assert(add->child[1]->type == &node_getlocal && add->child[1]->value.i == 0);
+    assert(node_highest_local(node) == 1);
+    assert(node_sanitycheck(node));
+    assert(before == 18.0);
+    assert(test_eval_float(node) == before);
+    node_destroy(node);
+}
+
+void test_optimize_dead_locals()
+{
+    START_CODE(node)
+	BLOCK
+	    SETLOCAL(0)
+		ADD
+		    RAW_PARAM(0)
+		    RAW_PARAM(1)
+		END;
+	    END;
+	    SETLOCAL(1)
+		MUL
+		    RAW_PARAM(2)
+		    FLOAT_CONSTANT(2.0)
+		END;
+	    END;
+	    GETLOCAL(1)
+	END;
+    END_CODE;
+
+    double before = test_eval_float(node);
+    node = node_optimize(node);
+    node_print(node);
+
+    /* local 0 is never read, so it's gone, and local 1 is now local 0 */
+    assert(node->type == &node_block);
+    assert(node->num_children == 2);
+    node_t*setlocal = node->child[0];
+    assert(setlocal->type == &node_setlocal && setlocal->value.i == 0);
+    assert(setlocal->child[0]->type == &node_mul);
+    assert(node->child[1]->type == &node_getlocal && node->child[1]->value.i == 0);
+    assert(node_highest_local(node) == 1);
+    assert(node_sanitycheck(node));
+    assert(before == 8.0);
+    assert(test_eval_float(node) == before);
+    node_destroy(node);
+}
+
+void test_optimize_if_same_branches()
+{
+    START_CODE(node)
+	IF
+	    GT
+		RAW_PARAM(0)
+		RAW_PARAM(1)
+	    END;
+	THEN
+	    ADD
+		RAW_PARAM(2)
+		FLOAT_CONSTANT(1.0)
+	    END;
+	ELSE
+	    ADD
+		RAW_PARAM(2)
+		FLOAT_CONSTANT(1.0)
+	    END;
+	END;
+    END_CODE;
+
+    double before = test_eval_float(node);
+    node = node_optimize(node);
+    node_print(node);
+
+    assert(node->type == &node_add);
+    assert(node->num_children == 2);
+    assert(node->child[0]->type == &node_param && node->child[0]->value.i == 2);
+    assert(node->child[1]->type == &node_float && node->child[1]->value.f == 1.0);
+    assert(node_sanitycheck(node));
+    assert(before == 5.0);
+    assert(test_eval_float(node) == before);
+    node_destroy(node);
+}
+
 int main()
 {
     test_if();
     test_array();
+    test_dot();
+    test_dot_python();
+    test_optimize_if_true();
+    test_optimize_common_subexpressions();
+    test_optimize_dead_locals();
+    test_optimize_if_same_branches();
     return 0;
 }
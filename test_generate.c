@@ -0,0 +1,332 @@
+/* test_generate.c
+   Compiles the generated C code, checks it against the model, and
+   benchmarks it.
+
+   Part of the data prediction package.
+
+   Copyright (c) 2011 Matthias Kramm <kramm@quiss.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mrscake.h"
+
+#define MAX_COLUMNS 256
+
+#define SOURCE_FILE "/tmp/test_generate.c"
+#define BINARY_FILE "/tmp/test_generate"
+
+typedef struct _testset {
+    const char*filename;
+    char separator;
+    bool label_is_last;
+} testset_t;
+
+static testset_t testsets[] = {
+    {"data/letter-recognition.data", ',', false},
+    {"data/waveform.data", ',', true},
+    {"data/agaricus-lepiota.data", ',', false},
+};
+
+static const char*models[] = {
+    "dtree",
+    "rtrees (n/4 trees)",
+    "gbtrees",
+    "simplified linear svm",
+    "neuronal network (sigmoid) with 2 layers",
+};
+
+static const char*languages[] = {
+    "c",
+    "c-fast",
+};
+
+static trainingdata_t*data;
+static row_t**rows;
+static int num_rows;
+
+static variable_t parse_value(char*s)
+{
+    char*end;
+    double d = strtod(s, &end);
+    if(end != s && !*end)
+        return variable_new_continuous(d);
+    else
+        return variable_new_text(s);
+}
+
+static bool load(testset_t*set)
+{
+    FILE*fi = fopen(set->filename, "rb");
+    if(!fi) {
+        perror(set->filename);
+        return false;
+    }
+    data = trainingdata_new();
+    int rows_size = 1024;
+    rows = malloc(sizeof(row_t*)*rows_size);
+    num_rows = 0;
+
+    char line[4096];
+    while(fgets(line, sizeof(line), fi)) {
+        char*fields[MAX_COLUMNS];
+        int num_fields = 0;
+        char*p = line;
+        while(*p && *p != '\n' && *p != '\r' && num_fields < MAX_COLUMNS) {
+            fields[num_fields++] = p;
+            while(*p && *p != set->separator && *p != '\n' && *p != '\r')
+                p++;
+            if(*p == set->separator)
+                *p++ = 0;
+        }
+        *p = 0;
+        if(num_fields < 2)
+            continue;
+
+        int label = set->label_is_last ? num_fields-1 : 0;
+        example_t*e = example_new(num_fields-1);
+        int t, pos = 0;
+        for(t=0;t<num_fields;t++) {
+            if(t != label) {
+                e->inputs[pos++] = parse_value(fields[t]);
+            }
+        }
+        e->desired_response = variable_new_text(fields[label]);
+
+        if(num_rows == rows_size) {
+            rows_size *= 2;
+            rows = realloc(rows, sizeof(row_t*)*rows_size);
+        }
+        rows[num_rows++] = example_to_row(e, 0);
+        trainingdata_add_example(data, e);
+    }
+    fclose(fi);
+    return true;
+}
+
+static void unload()
+{
+    int t;
+    for(t=0;t<num_rows;t++) {
+        row_destroy(rows[t]);
+    }
+    free(rows);
+    trainingdata_destroy(data);
+}
+
+static const char* c_type(columntype_t type)
+{
+    switch(type) {
+        case CONTINUOUS:
+            return "float";
+        case CATEGORICAL:
+            return "int";
+        case TEXT:
+            return "char*";
+        default:
+            return 0;
+    }
+}
+
+static void write_value(FILE*fi, variable_t*v)
+{
+    const char*p;
+    switch(v->type) {
+        case CONTINUOUS:
+            fprintf(fi, "%.9g", v->value);
+            break;
+        case CATEGORICAL:
+            fprintf(fi, "%d", v->category);
+            break;
+        case TEXT:
+            fputc('"', fi);
+            for(p=v->text;*p;p++) {
+                if(*p == '"' || *p == '\\')
+                    fputc('\\', fi);
+                fputc(*p, fi);
+            }
+            fputc('"', fi);
+            break;
+        default:
+            fprintf(fi, "0");
+            break;
+    }
+}
+
+/* The generated code, followed by the rows (column by column, as
+   predict_n() takes them), the model's predictions, and a main()
+   which times predict_n() and compares. */
+static bool write_program(model_t*m, const char*code, variable_t*expected)
+{
+    signature_t*sig = m->sig;
+    const char*result_type = c_type(expected[0].type);
+    int x,y;
+    if(!result_type)
+        return false;
+    for(x=0;x<sig->num_inputs;x++) {
+        if(!c_type(sig->column_types[x]))
+            return false;
+        for(y=0;y<num_rows;y++) {
+            if(rows[y]->inputs[x].type != sig->column_types[x])
+                return false;
+        }
+    }
+
+    FILE*fi = fopen(SOURCE_FILE, "wb");
+    if(!fi) {
+        perror(SOURCE_FILE);
+        return false;
+    }
+    fprintf(fi, "#include <stdio.h>\n#include <stdlib.h>\n#include <time.h>\n");
+    fprintf(fi, "%s\n", code);
+
+    for(x=0;x<sig->num_inputs;x++) {
+        fprintf(fi, "static %s column%d[%d] = {", c_type(sig->column_types[x]), x, num_rows);
+        for(y=0;y<num_rows;y++) {
+            if(y) fprintf(fi, ",");
+            write_value(fi, &rows[y]->inputs[x]);
+        }
+        fprintf(fi, "};\n");
+    }
+    fprintf(fi, "static %s expected[%d] = {", result_type, num_rows);
+    for(y=0;y<num_rows;y++) {
+        if(y) fprintf(fi, ",");
+        write_value(fi, &expected[y]);
+    }
+    fprintf(fi, "};\n");
+
+    fprintf(fi, "static double now()\n"
+                "{\n"
+                "    struct timespec t;\n"
+                "    clock_gettime(CLOCK_MONOTONIC, &t);\n"
+                "    return t.tv_sec + t.tv_nsec / 1e9;\n"
+                "}\n");
+    fprintf(fi, "int main()\n"
+                "{\n"
+                "    %s*out = malloc(sizeof(%s)*%d);\n"
+                "    double start = now(), elapsed;\n"
+                "    int t, reps = 0;\n"
+                "    do {\n"
+                "        predict_n(%d", result_type, result_type, num_rows, num_rows);
+    for(x=0;x<sig->num_inputs;x++) {
+        fprintf(fi, ", column%d", x);
+    }
+    fprintf(fi, ", out);\n"
+                "        reps++;\n"
+                "    } while((elapsed = now() - start) < 0.3);\n"
+                "    for(t=0;t<%d;t++) {\n"
+                "        if(%s) {\n"
+                "            printf(\"mismatch in row %%d\\n\", t);\n"
+                "            return 1;\n"
+                "        }\n"
+                "    }\n"
+                "    printf(\"%%.0f\\n\", %d.0 * reps / elapsed);\n"
+                "    return 0;\n"
+                "}\n",
+                num_rows,
+                expected[0].type == TEXT ? "strcmp(out[t], expected[t])" : "out[t] != expected[t]",
+                num_rows);
+    fclose(fi);
+    return true;
+}
+
+/* returns rows per second, or -1 */
+static double compile_and_run()
+{
+    const char*cc = getenv("CC");
+    char command[1024];
+    snprintf(command, sizeof(command), "%s -O2 -w %s -o %s -lm -lrt",
+             cc ? cc : "cc", SOURCE_FILE, BINARY_FILE);
+    if(system(command)) {
+        printf("(compile failed: %s) ", command);
+        return -1;
+    }
+    FILE*fi = popen(BINARY_FILE, "r");
+    char line[256];
+    double speed = -1;
+    if(fgets(line, sizeof(line), fi)) {
+        if(!strncmp(line, "mismatch", 8)) {
+            printf("(%s) ", strtok(line, "\n"));
+        } else {
+            speed = atof(line);
+        }
+    }
+    pclose(fi);
+    unlink(BINARY_FILE);
+    return speed;
+}
+
+static bool benchmark(const char*filename, const char*model_name)
+{
+    model_t*m = model_train_specific_model(data, model_name);
+    if(!m) {
+        printf("%-28s %-42s (training failed)\n", filename, model_name);
+        return true;
+    }
+
+    variable_t*expected = malloc(sizeof(variable_t)*num_rows);
+    int t;
+    for(t=0;t<num_rows;t++) {
+        expected[t] = model_predict(m, rows[t]);
+    }
+
+    bool ok = true;
+    printf("%-28s %-42s", filename, model_name);
+    /* "c" expands packed forests into the model's code, so that
+       goes last */
+    int l;
+    for(l=sizeof(languages)/sizeof(languages[0])-1;l>=0;l--) {
+        char*code = model_generate_code(m, languages[l]);
+        double speed = -1;
+        if(!write_program(m, code, expected)) {
+            printf(" (%s: inputs don't fit the signature)", languages[l]);
+        } else {
+            speed = compile_and_run();
+            ok &= speed >= 0;
+        }
+        printf(" %s: %8.0f rows/s", languages[l], speed);
+        fflush(stdout);
+        free(code);
+    }
+    printf("\n");
+    unlink(SOURCE_FILE);
+
+    free(expected);
+    model_destroy(m);
+    return ok;
+}
+
+int main(int argn, char*argv[])
+{
+    int s, t;
+    bool ok = true;
+    for(s=0;s<sizeof(testsets)/sizeof(testsets[0]);s++) {
+        testset_t*set = &testsets[s];
+        if(argn > 1 && !strstr(set->filename, argv[1]))
+            continue;
+        if(!load(set))
+            continue;
+        for(t=0;t<sizeof(models)/sizeof(models[0]);t++) {
+            if(argn > 2 && strcmp(models[t], argv[2]))
+                continue;
+            ok &= benchmark(set->filename, models[t]);
+        }
+        unload();
+    }
+    return ok ? 0 : 1;
+}
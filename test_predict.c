@@ -0,0 +1,216 @@
+/* test_predict.c
+   Prediction benchmark on the data/ sets.
+
+   Part of the data prediction package.
+
+   Copyright (c) 2011 Matthias Kramm <kramm@quiss.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mrscake.h"
+#include "ast.h"
+#include "ast_transforms.h"
+
+#define MAX_COLUMNS 256
+
+typedef struct _testset {
+    const char*filename;
+    char separator;
+    bool label_is_last;
+} testset_t;
+
+static testset_t testsets[] = {
+    {"data/letter-recognition.data", ',', false},
+    {"data/waveform.data", ',', true},
+    {"data/agaricus-lepiota.data", ',', false},
+    {"data/headlines.dat", ' ', false},
+};
+
+static const char*models[] = {
+    "dtree",
+    "rtrees (n/4 trees)",
+    "gbtrees",
+    "rbf svm",
+    "simplified linear svm",
+    "neuronal network (sigmoid) with 2 layers",
+};
+
+static trainingdata_t*data;
+static row_t**rows;
+static int num_rows;
+
+static variable_t parse_value(char*s)
+{
+    char*end;
+    double d = strtod(s, &end);
+    if(end != s && !*end)
+        return variable_new_continuous(d);
+    else
+        return variable_new_text(s);
+}
+
+static bool load(testset_t*set)
+{
+    FILE*fi = fopen(set->filename, "rb");
+    if(!fi) {
+        perror(set->filename);
+        return false;
+    }
+    data = trainingdata_new();
+    int rows_size = 1024;
+    rows = malloc(sizeof(row_t*)*rows_size);
+    num_rows = 0;
+
+    char line[4096];
+    while(fgets(line, sizeof(line), fi)) {
+        char*fields[MAX_COLUMNS];
+        int num_fields = 0;
+        char*p = line;
+        while(*p && *p != '\n' && *p != '\r' && num_fields < MAX_COLUMNS) {
+            fields[num_fields++] = p;
+            while(*p && *p != set->separator && *p != '\n' && *p != '\r')
+                p++;
+            if(*p == set->separator)
+                *p++ = 0;
+        }
+        *p = 0;
+        if(num_fields < 2)
+            continue;
+
+        int label = set->label_is_last ? num_fields-1 : 0;
+        example_t*e = example_new(num_fields-1);
+        int t, pos = 0;
+        for(t=0;t<num_fields;t++) {
+            if(t != label) {
+                e->inputs[pos++] = parse_value(fields[t]);
+            }
+        }
+        e->desired_response = variable_new_text(fields[label]);
+
+        if(num_rows == rows_size) {
+            rows_size *= 2;
+            rows = realloc(rows, sizeof(row_t*)*rows_size);
+        }
+        rows[num_rows++] = example_to_row(e, 0);
+        trainingdata_add_example(data, e);
+    }
+    fclose(fi);
+    return true;
+}
+
+static void unload()
+{
+    int t;
+    for(t=0;t<num_rows;t++) {
+        row_destroy(rows[t]);
+    }
+    free(rows);
+    trainingdata_destroy(data);
+}
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void benchmark(const char*filename, const char*model_name)
+{
+    model_t*m = model_train_specific_model(data, model_name);
+    if(!m) {
+        printf("%-28s %-42s (training failed)\n", filename, model_name);
+        return;
+    }
+
+    variable_t*expected = malloc(sizeof(variable_t)*num_rows);
+
+    double start = now();
+    int t;
+    for(t=0;t<num_rows;t++) {
+        expected[t] = model_predict(m, rows[t]);
+    }
+    double tree = now() - start;
+
+    start = now();
+    for(t=0;t<num_rows;t++) {
+        variable_t v = model_predict_compiled(m, rows[t]);
+        assert(variable_equals(&v, &expected[t]));
+    }
+    double compiled = now() - start;
+
+    variable_t*results = malloc(sizeof(variable_t)*num_rows);
+    start = now();
+    model_predict_batch(m, rows, num_rows, results);
+    double batch = now() - start;
+    for(t=0;t<num_rows;t++) {
+        assert(variable_equals(&results[t], &expected[t]));
+    }
+
+    printf("%-28s %-42s node_eval: %8.0f rows/s  compiled: %8.0f rows/s (%.1fx)  batch: %8.0f rows/s (%.1fx)\n",
+            filename, model_name, num_rows / tree, num_rows / compiled, tree / compiled,
+            num_rows / batch, tree / batch);
+    fflush(stdout);
+
+    /* the model has to survive a save/load cycle */
+    model_save(m, "/tmp/test_predict.model");
+    model_t*loaded = model_load("/tmp/test_predict.model");
+    assert(loaded);
+    for(t=0;t<num_rows;t++) {
+        variable_t v = model_predict(loaded, rows[t]);
+        assert(variable_equals(&v, &expected[t]));
+    }
+    model_destroy(loaded);
+    unlink("/tmp/test_predict.model");
+
+    /* code generation works on a copy, and leaves the model (and its
+       packed forests) alone */
+    bool has_forest = node_has_child((node_t*)m->code, &node_forest);
+    free(model_generate_code(m, "c"));
+    assert(node_has_child((node_t*)m->code, &node_forest) == has_forest);
+    for(t=0;t<num_rows;t++) {
+        variable_t v = model_predict(m, rows[t]);
+        assert(variable_equals(&v, &expected[t]));
+    }
+
+    free(results);
+    free(expected);
+    model_destroy(m);
+}
+
+int main(int argn, char*argv[])
+{
+    int s, t;
+    for(s=0;s<sizeof(testsets)/sizeof(testsets[0]);s++) {
+        testset_t*set = &testsets[s];
+        if(argn > 1 && !strstr(set->filename, argv[1]))
+            continue;
+        if(!load(set))
+            continue;
+        for(t=0;t<sizeof(models)/sizeof(models[0]);t++) {
+            if(argn > 2 && strcmp(models[t], argv[2]))
+                continue;
+            benchmark(set->filename, models[t]);
+        }
+        unload();
+    }
+    return 0;
+}
@@ -1,10 +1,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <signal.h>
+#include <assert.h>
 #include "mrscake.h"
 #include "dataset.h"
+#include "settings.h"
 #include "net.h"
 
+#define JOBS_PER_DATASET 8
+
 void test()
 {
     trainingdata_t* data = trainingdata_new();
@@ -20,21 +25,41 @@ void test()
     }
 
     dataset_t*dataset = dataset_sanitize(data);
-    model_t*m = process_job_remotely("dtree", dataset);
-    if(m) {
+
+    /* all jobs share one upload of the dataset, and run at the
+       same time over the same connection */
+    remote_dataset_t*remote_data = remote_dataset_new(dataset);
+    remote_job_t*jobs[JOBS_PER_DATASET];
+    for(t=0;t<JOBS_PER_DATASET;t++) {
+        jobs[t] = remote_job_start("dtree", remote_data);
+    }
+    for(t=0;t<JOBS_PER_DATASET;t++) {
+        model_t*m = remote_job_read_result(jobs[t]);
+        assert(m);
         printf("%s\n", m->name);
+        model_destroy(m);
     }
+    remote_dataset_destroy(remote_data);
+
+    model_t*m = process_job_remotely("dtree", dataset);
+    assert(m);
+    model_destroy(m);
 }
 
 int main()
 {
     int port = 3075;
-    if(fork()) {
+    pid_t server = fork();
+    if(!server) {
         start_server(port);
         _exit(0);
     }
+    config_add_remote_server("localhost", port);
     int t;
-    for(t=0;t<32*2;t++) {
+    for(t=0;t<8;t++) {
         test();
     }
+    remote_disconnect_all();
+    kill(server, SIGTERM);
+    return 0;
 }
@@ -0,0 +1,119 @@
+/* test_stringpool.c
+   Concurrency test and benchmark for the string pool.
+
+   Part of the data prediction package.
+   
+   Copyright (c) 2011 Matthias Kramm <kramm@quiss.org> 
+ 
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "mrscake.h"
+#include "stringpool.h"
+
+#define NUM_WORDS 4096
+#define NUM_LOOKUPS (1<<21)
+#define MAX_THREADS 16
+
+static char*words[NUM_WORDS];
+static const char*registered[NUM_WORDS];
+/* the copy each thread got back for each word */
+static const char*seen[MAX_THREADS][NUM_WORDS];
+
+typedef struct _thread_args {
+    int nr;
+    int num_lookups;
+    bool record;
+} thread_args_t;
+
+static void* lookup_words(void*_args)
+{
+    thread_args_t*args = (thread_args_t*)_args;
+    char buf[64];
+    int t;
+    for(t=0;t<args->num_lookups;t++) {
+        int nr = ((unsigned)t*7919 + args->nr) % NUM_WORDS;
+        variable_t v = variable_new_text(words[nr]);
+        assert(!registered[nr] || v.text == registered[nr]);
+        if(args->record)
+            seen[args->nr][nr] = v.text;
+        if(!(t&1023)) {
+            /* also add some new strings, to exercise the write path */
+            sprintf(buf, "thread%d-%d", args->nr, t);
+            assert(!strcmp(register_string(buf), buf));
+        }
+    }
+    return 0;
+}
+
+static double run_threads(int num_threads, bool record)
+{
+    pthread_t threads[MAX_THREADS];
+    thread_args_t args[MAX_THREADS];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int t;
+    for(t=0;t<num_threads;t++) {
+        args[t].nr = t;
+        args[t].num_lookups = NUM_LOOKUPS / num_threads;
+        args[t].record = record;
+        pthread_create(&threads[t], NULL, lookup_words, &args[t]);
+    }
+    for(t=0;t<num_threads;t++) {
+        pthread_join(threads[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main()
+{
+    int t;
+    for(t=0;t<NUM_WORDS;t++) {
+        char buf[64];
+        sprintf(buf, "word%d", t*31337);
+        words[t] = strdup(buf);
+    }
+
+    /* insert concurrently, then check that every thread got the same copy */
+    run_threads(8, true);
+    for(t=0;t<NUM_WORDS;t++) {
+        registered[t] = register_string(words[t]);
+        assert(registered[t] != words[t]);
+        assert(!strcmp(registered[t], words[t]));
+        int i;
+        for(i=0;i<8;i++) {
+            /* every thread looks up every word, as 7919 and NUM_WORDS
+               are coprime */
+            assert(seen[i][t] == registered[t]);
+        }
+    }
+
+    int num_threads;
+    double single = 0;
+    for(num_threads=1;num_threads<=MAX_THREADS;num_threads*=2) {
+        double seconds = run_threads(num_threads, false);
+        if(num_threads == 1)
+            single = seconds;
+        printf("%2d threads: %6.2f million variable_new_text/s (speedup %.2f)\n",
+                num_threads, NUM_LOOKUPS / seconds / 1e6, single / seconds);
+    }
+    return 0;
+}
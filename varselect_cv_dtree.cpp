@@ -125,12 +125,13 @@ extern "C" varorder_t*dtree_var_order(dataset_t*d);
 
 varorder_t*dtree_var_order(dataset_t*d)
 {
-    CvMLDataFromExamples data(d);
+    CvDatasetView data(d);
 
     VarSelectingDTree dtree(d);
     bool use_surrogate_splits = true;
     CvDTreeParams cvd_params(16, 1, 0, use_surrogate_splits, 16, 0, false, false, 0);
-    dtree.train(&data, cvd_params);
+    dtree.train(data.values, data.tflag, data.responses, data.var_idx,
+                data.train_sample_idx, data.var_types, data.missing, cvd_params);
 
     const CvMat* var_imp = dtree.get_var_importance();
 